@@ -0,0 +1,639 @@
+#include <benchmark/benchmark.h>
+
+#include <set>
+#include <span>
+#include <cmath>
+#include <string>
+#include <random>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+
+#include "rbtree.hpp"
+#include "frozen_rbtree.hpp"
+
+#ifndef BENCH_MAX_SIZE
+#define BENCH_MAX_SIZE 100000000
+#endif
+
+namespace {
+
+using RBTREE::rbtree;
+using RBTREE::frozen_rbtree;
+using RBTREE::node_layout;
+
+/* Distributions of the keys. */
+enum class dist_kind { RANDOM, SORTED, ZIPF };
+
+const char* dist_name(dist_kind dist) {
+
+  switch (dist) {
+    case dist_kind::RANDOM: return "random";
+    case dist_kind::SORTED: return "sorted";
+    case dist_kind::ZIPF:   return "zipf";
+    default:                return "";
+  }
+}
+
+/* Upper limit for the number of lookups done in one iteration. */
+constexpr std::size_t max_probes = std::size_t{1} << 20;
+
+/* Number of range queries done in one iteration of distance benchmark. */
+constexpr std::size_t distance_queries = 1024;
+
+/* Number of keys resolved by one call of batched lookups. */
+constexpr std::size_t lookup_batch = 256;
+
+/* Size of sorted batches merged into the tree. */
+constexpr std::size_t insert_batch = 10000;
+
+/*
+ * std::distance is linear, so distance benchmark for std::set
+ * is not run for larger trees.
+ */
+constexpr std::size_t max_linear_distance_size = 1000000;
+
+/* Conversion of 64-bit value to the key preserving order. */
+template <typename Key>
+Key make_key(std::uint64_t value);
+
+template <>
+int make_key<int>(std::uint64_t value) {
+  return static_cast<int>(value & 0x7FFFFFFF);
+}
+
+template <>
+std::uint64_t make_key<std::uint64_t>(std::uint64_t value) {
+  return value;
+}
+
+/* Zero-padded, so that lexicographical order matches numerical one. Long enough to avoid SSO. */
+template <>
+std::string make_key<std::string>(std::uint64_t value) {
+
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "key_%020llu", static_cast<unsigned long long>(value));
+  return std::string(buf);
+}
+
+template <typename Key>
+const char* key_name();
+
+template <> const char* key_name<int>()           { return "int"; }
+template <> const char* key_name<std::uint64_t>() { return "u64"; }
+template <> const char* key_name<std::string>()   { return "string"; }
+
+/* Spread ranks over the key space, so that hot keys are not adjacent. */
+std::uint64_t scramble(std::uint64_t rank) {
+  return rank * 0x9E3779B97F4A7C15ull;
+}
+
+/*
+ * Approximate Zipf (s = 1) rank from [0, n): for s = 1 CDF is close to ln(x) / ln(n),
+ * so inverted CDF of uniform variable gives the rank.
+ */
+std::uint64_t zipf_rank(std::mt19937_64& gen, std::size_t n) {
+
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  auto rank = static_cast<std::uint64_t>(std::pow(static_cast<double>(n) + 1.0, unif(gen))) - 1;
+  return std::min<std::uint64_t>(rank, n - 1);
+}
+
+std::vector<std::uint64_t> gen_values(dist_kind dist, std::size_t n, std::uint64_t seed) {
+
+  std::mt19937_64 gen(seed);
+  std::vector<std::uint64_t> values(n);
+
+  switch (dist) {
+
+    case dist_kind::RANDOM:
+      for (auto& value : values) {
+        value = gen() >> 1;
+      }
+      break;
+
+    case dist_kind::SORTED:
+      for (std::size_t ind = 0; ind < n; ++ind) {
+        values[ind] = ind;
+      }
+      break;
+
+    case dist_kind::ZIPF:
+      for (auto& value : values) {
+        value = scramble(zipf_rank(gen, n)) >> 1;
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  return values;
+}
+
+/* Keys to be inserted and keys to be looked up. */
+template <typename Key>
+struct dataset {
+
+  dist_kind dist;
+  std::size_t size = 0;
+
+  std::vector<Key> keys;
+  std::vector<Key> probes;
+};
+
+/*
+ * Generating keys for large sizes is expensive, so the last generated dataset
+ * is kept: benchmarks are registered grouped by key type, distribution and size.
+ */
+template <typename Key>
+const dataset<Key>& get_dataset(dist_kind dist, std::size_t n) {
+
+  static dataset<Key> cached;
+  if (cached.size == n && cached.dist == dist && !cached.keys.empty()) {
+    return cached;
+  }
+
+  cached = dataset<Key>{};
+  cached.dist = dist;
+  cached.size = n;
+
+  auto values = gen_values(dist, n, 42);
+  cached.keys.reserve(n);
+  for (auto value : values) {
+    cached.keys.push_back(make_key<Key>(value));
+  }
+
+  std::size_t probes_num = std::min(n, max_probes);
+  cached.probes.reserve(probes_num);
+
+  if (dist == dist_kind::ZIPF) {
+
+    /* Lookups follow the same skew as insertions. */
+    auto probe_values = gen_values(dist, probes_num, 4242);
+    for (auto value : probe_values) {
+      cached.probes.push_back(make_key<Key>(value));
+    }
+
+  } else {
+
+    /* Lookups of the present keys in random order. */
+    std::mt19937_64 gen(4242);
+    std::uniform_int_distribution<std::size_t> ind_dist(0, n - 1);
+    for (std::size_t ind = 0; ind < probes_num; ++ind) {
+      cached.probes.push_back(cached.keys[ind_dist(gen)]);
+    }
+  }
+
+  return cached;
+}
+
+/* Number of elements in range [lo, hi). */
+template <typename Key>
+std::ptrdiff_t range_distance(const rbtree<Key>& tree, const Key& lo, const Key& hi) {
+  return tree.distance(lo, hi);
+}
+
+template <typename Key>
+std::ptrdiff_t range_distance(const frozen_rbtree<Key>& tree, const Key& lo, const Key& hi) {
+  return tree.distance(lo, hi);
+}
+
+template <typename Key>
+std::ptrdiff_t range_distance(const std::set<Key>& set, const Key& lo, const Key& hi) {
+  return std::distance(set.lower_bound(lo), set.lower_bound(hi));
+}
+
+/* Tree with nodes relocated in given layout after it is built. */
+template <typename Key, node_layout Layout>
+struct compacted_rbtree : rbtree<Key> {
+
+  static constexpr node_layout layout = Layout;
+};
+
+template <typename Container>
+Container build(const std::vector<typename Container::key_type>& keys) {
+
+  using key_type = typename Container::key_type;
+
+  /* Frozen tree is read-only, it is made from the built tree. */
+  if constexpr (std::is_same_v<Container, frozen_rbtree<key_type>>) {
+    return freeze(build<rbtree<key_type>>(keys));
+
+  } else if constexpr (requires { Container::layout; }) {
+
+    Container cont;
+    static_cast<rbtree<key_type>&>(cont) = build<rbtree<key_type>>(keys);
+    cont.compact(Container::layout);
+
+    return cont;
+
+  } else {
+
+    Container cont;
+    for (const auto& key : keys) {
+      cont.insert(key);
+    }
+
+    return cont;
+  }
+}
+
+template <typename Container>
+void bm_insert(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+
+  for (auto _ : state) {
+
+    Container cont;
+    for (const auto& key : data.keys) {
+      cont.insert(key);
+    }
+
+    benchmark::DoNotOptimize(cont);
+
+    state.PauseTiming();
+    cont.clear();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(data.keys.size()));
+}
+
+template <typename Container>
+void bm_erase(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+
+  for (auto _ : state) {
+
+    state.PauseTiming();
+    auto cont = build<Container>(data.keys);
+    state.ResumeTiming();
+
+    for (const auto& key : data.probes) {
+      cont.erase(key);
+    }
+
+    benchmark::DoNotOptimize(cont);
+
+    state.PauseTiming();
+    cont.clear();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(data.probes.size()));
+}
+
+/* 
+ * Every other key is merged into the tree built from the rest in sorted batches: 
+ * with insert_sorted() by the tree, key by key by std::set.
+ */
+template <typename Container>
+void bm_insert_batches(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+
+  std::vector<key_type> initial;
+  std::vector<std::vector<key_type>> batches(1);
+
+  for (std::size_t ind = 0; ind < data.keys.size(); ++ind) {
+
+    if (ind % 2 == 0) {
+      initial.push_back(data.keys[ind]);
+      continue;
+    }
+
+    if (batches.back().size() == insert_batch) {
+      batches.emplace_back();
+    }
+    batches.back().push_back(data.keys[ind]);
+  }
+
+  for (auto& batch : batches) {
+
+    std::sort(batch.begin(), batch.end());
+    batch.erase(std::unique(batch.begin(), batch.end()), batch.end());
+  }
+
+  for (auto _ : state) {
+
+    state.PauseTiming();
+    auto cont = build<Container>(initial);
+    state.ResumeTiming();
+
+    for (const auto& batch : batches) {
+
+      if constexpr (requires { cont.insert_sorted(batch.begin(), batch.end()); }) {
+        cont.insert_sorted(batch.begin(), batch.end());
+      } else {
+        for (const auto& key : batch) {
+          cont.insert(key);
+        }
+      }
+    }
+
+    benchmark::DoNotOptimize(cont);
+
+    state.PauseTiming();
+    cont.clear();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(data.keys.size() - initial.size()));
+}
+
+/* Erasure of the middle half of the tree with one call. */
+template <typename Container>
+void bm_erase_range(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+  std::size_t erased = 0;
+
+  for (auto _ : state) {
+
+    state.PauseTiming();
+    auto cont = build<Container>(data.keys);
+    auto first = std::next(cont.begin(), static_cast<std::ptrdiff_t>(cont.size() / 4));
+    auto last  = std::next(first, static_cast<std::ptrdiff_t>(cont.size() / 2));
+    erased = cont.size() / 2;
+    state.ResumeTiming();
+
+    cont.erase(first, last);
+    benchmark::DoNotOptimize(cont);
+
+    state.PauseTiming();
+    cont.clear();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(erased));
+}
+
+template <typename Container>
+void bm_find(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+  const auto cont = build<Container>(data.keys);
+
+  for (auto _ : state) {
+    for (const auto& key : data.probes) {
+      benchmark::DoNotOptimize(cont.find(key));
+    }
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(data.probes.size()));
+}
+
+template <typename Container>
+void bm_lower_bound(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+  const auto cont = build<Container>(data.keys);
+
+  for (auto _ : state) {
+    for (const auto& key : data.probes) {
+      benchmark::DoNotOptimize(cont.lower_bound(key));
+    }
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(data.probes.size()));
+}
+
+/* Probes are looked up in batches with find_many(). */
+template <typename Container>
+void bm_find_many(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+  const auto cont = build<Container>(data.keys);
+
+  std::vector<typename Container::const_iterator> found(lookup_batch);
+  std::span<const key_type> probes(data.probes);
+
+  for (auto _ : state) {
+    for (std::size_t ind = 0; ind < probes.size(); ind += lookup_batch) {
+
+      cont.find_many(probes.subspan(ind, std::min(lookup_batch, probes.size() - ind)), found);
+      benchmark::DoNotOptimize(found.data());
+    }
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(data.probes.size()));
+}
+
+template <typename Container>
+void bm_iterate(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+  const auto cont = build<Container>(data.keys);
+
+  for (auto _ : state) {
+    for (const auto& key : cont) {
+      benchmark::DoNotOptimize(&key);
+    }
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(cont.size()));
+}
+
+/* Middle half of the elements is exported to a vector. */
+template <typename Container>
+void bm_export_range(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+  const auto cont = build<Container>(data.keys);
+
+  key_type lo = *std::next(cont.begin(), static_cast<std::ptrdiff_t>(cont.size() / 4));
+  key_type hi = *std::next(cont.begin(), static_cast<std::ptrdiff_t>(3 * cont.size() / 4));
+  std::size_t exported = 0;
+
+  for (auto _ : state) {
+
+    std::vector<key_type> keys;
+
+    if constexpr (requires { cont.copy_range(lo, hi); }) {
+      keys = cont.copy_range(lo, hi);
+    } else {
+      std::copy(cont.lower_bound(lo), cont.lower_bound(hi), std::back_inserter(keys));
+    }
+
+    exported = keys.size();
+    benchmark::DoNotOptimize(keys.data());
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(exported));
+}
+
+template <typename Container>
+void bm_distance(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+  const auto cont = build<Container>(data.keys);
+
+  /* Pairs of probes with lower one first. */
+  std::vector<std::pair<key_type, key_type>> queries;
+  for (std::size_t ind = 0; ind + 1 < data.probes.size() && queries.size() < distance_queries; ind += 2) {
+    queries.push_back(std::minmax(data.probes[ind], data.probes[ind + 1]));
+  }
+
+  for (auto _ : state) {
+    for (const auto& [lo, hi] : queries) {
+      benchmark::DoNotOptimize(range_distance(cont, lo, hi));
+    }
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(queries.size()));
+}
+
+template <typename Container>
+void bm_copy(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+  const auto cont = build<Container>(data.keys);
+
+  for (auto _ : state) {
+
+    Container copy(cont);
+    benchmark::DoNotOptimize(copy);
+
+    state.PauseTiming();
+    copy.clear();
+    state.ResumeTiming();
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(cont.size()));
+}
+
+template <typename Container>
+void bm_clear(benchmark::State& state, dist_kind dist, std::size_t n) {
+
+  using key_type = typename Container::key_type;
+  const auto& data = get_dataset<key_type>(dist, n);
+  const auto cont = build<Container>(data.keys);
+
+  for (auto _ : state) {
+
+    state.PauseTiming();
+    Container copy(cont);
+    state.ResumeTiming();
+
+    copy.clear();
+    benchmark::DoNotOptimize(copy);
+  }
+
+  state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(cont.size()));
+}
+
+template <typename Container>
+using bench_func = void (*)(benchmark::State&, dist_kind, std::size_t);
+
+template <typename Key, typename Container>
+void register_container(const char* cont_name, dist_kind dist, std::size_t n) {
+
+  std::pair<const char*, bench_func<Container>> benches[] = {
+    {"insert",         &bm_insert<Container>},
+    {"insert_batches", &bm_insert_batches<Container>},
+    {"erase",          &bm_erase<Container>},
+    {"erase_range",    &bm_erase_range<Container>},
+    {"find",           &bm_find<Container>},
+    {"lower_bound",    &bm_lower_bound<Container>},
+    {"iterate",        &bm_iterate<Container>},
+    {"export_range",   &bm_export_range<Container>},
+    {"distance",       &bm_distance<Container>},
+    {"copy",           &bm_copy<Container>},
+    {"clear",          &bm_clear<Container>}
+  };
+
+  constexpr bool is_std_set = std::is_same_v<Container, std::set<Key>>;
+
+  for (auto [op_name, func] : benches) {
+
+    if (is_std_set && func == &bm_distance<Container> && n > max_linear_distance_size) {
+      continue;
+    }
+
+    /* Name: <op>/<container>/<key>/<distribution>/<size>. */
+    std::string name = std::string(op_name) + "/" + cont_name + "/" + key_name<Key>()
+                     + "/" + dist_name(dist) + "/" + std::to_string(n);
+
+    benchmark::RegisterBenchmark(name.c_str(), func, dist, n)->Unit(benchmark::kMillisecond);
+  }
+
+  /* Batched lookups are provided only by the tree. */
+  if constexpr (!is_std_set) {
+
+    std::string name = std::string("find_many/") + cont_name + "/" + key_name<Key>()
+                     + "/" + dist_name(dist) + "/" + std::to_string(n);
+
+    benchmark::RegisterBenchmark(name.c_str(), &bm_find_many<Container>, dist, n)->Unit(benchmark::kMillisecond);
+  }
+}
+
+/* Lookups and iteration only: frozen tree is read-only, compaction affects only them. */
+template <typename Key, typename Container>
+void register_lookups(const char* cont_name, dist_kind dist, std::size_t n) {
+
+  std::pair<const char*, bench_func<Container>> benches[] = {
+    {"find",        &bm_find<Container>},
+    {"lower_bound", &bm_lower_bound<Container>},
+    {"iterate",     &bm_iterate<Container>},
+    {"distance",    &bm_distance<Container>}
+  };
+
+  for (auto [op_name, func] : benches) {
+
+    std::string name = std::string(op_name) + "/" + cont_name + "/" + key_name<Key>()
+                     + "/" + dist_name(dist) + "/" + std::to_string(n);
+
+    benchmark::RegisterBenchmark(name.c_str(), func, dist, n)->Unit(benchmark::kMillisecond);
+  }
+}
+
+template <typename Key>
+void register_key_type() {
+
+  for (auto dist : {dist_kind::RANDOM, dist_kind::SORTED, dist_kind::ZIPF}) {
+    for (std::size_t n = 1000; n <= BENCH_MAX_SIZE; n *= 10) {
+
+      register_container<Key, rbtree<Key>>("rbtree", dist, n);
+      register_container<Key, std::set<Key>>("std::set", dist, n);
+      register_lookups<Key, frozen_rbtree<Key>>("frozen", dist, n);
+      register_lookups<Key, compacted_rbtree<Key, node_layout::IN_ORDER>>("rbtree_in_order", dist, n);
+      register_lookups<Key, compacted_rbtree<Key, node_layout::VAN_EMDE_BOAS>>("rbtree_veb", dist, n);
+    }
+  }
+}
+
+}; /* anonymous namespace */
+
+int main(int argc, char** argv) {
+
+  register_key_type<int>();
+  register_key_type<std::uint64_t>();
+  register_key_type<std::string>();
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
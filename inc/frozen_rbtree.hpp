@@ -0,0 +1,337 @@
+#pragma once
+
+#include <new>
+#include <bit>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+
+#include "rbtree.hpp"
+
+namespace RBTREE {
+
+namespace DETAIL {
+
+/* Allocator placing arrays on given alignment, so that they start at a cache line. */
+template <typename T, std::size_t Align>
+struct aligned_allocator {
+
+  using value_type = T;
+
+  template <typename U>
+  struct rebind { using other = aligned_allocator<U, Align>; };
+
+  aligned_allocator() = default;
+
+  template <typename U>
+  aligned_allocator(const aligned_allocator<U, Align>&) noexcept {}
+
+  T* allocate(std::size_t n) {
+    return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{Align}));
+  }
+
+  void deallocate(T* ptr, std::size_t) noexcept {
+    ::operator delete(ptr, std::align_val_t{Align});
+  }
+
+  template <typename U>
+  bool operator==(const aligned_allocator<U, Align>&) const noexcept { return true; }
+};
+
+}; /* namespace DETAIL */
+
+/*
+ * Immutable pointer-free snapshot of the tree. Keys are stored in one
+ * cache-line aligned array in Eytzinger (BFS) order: children of the
+ * element 'k' are '2k' and '2k + 1', element 0 is not used.
+ * Descent has no branches depending on comparison results, and cache lines
+ * of the elements four levels below are prefetched for small keys.
+ *
+ * Rank of the element is computed from its index alone, since elements
+ * fill levels of the implicit tree from left to right, so no subtree sizes are stored.
+ */
+template <typename Key, typename Compare = std::less<Key>>
+class frozen_rbtree {
+
+public:
+
+  using key_type        = Key;
+  using value_type      = Key;
+  using size_type       = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using key_compare     = Compare;
+
+  using const_reference = const key_type&;
+  using const_pointer   = const key_type*;
+
+private:
+
+  static constexpr std::size_t cache_line = 64;
+
+  /* Number of keys in a cache line. Descendants four levels below share 16 cache line slots. */
+  static constexpr std::size_t keys_per_line = (sizeof(Key) <= cache_line)? cache_line / sizeof(Key) : 1;
+
+  std::vector<key_type, dtl::aligned_allocator<key_type, cache_line>> keys;
+  size_type count = 0;
+
+  Compare cmp;
+
+  /* Index of the first element, for which 'go_right' is false, or 0 if there is none. */
+  template <typename GoRight>
+  size_type descend(GoRight go_right) const;
+
+  /* Index of the leftmost and rightmost elements in subtree of 'idx'. */
+  size_type leftmost_from(size_type idx) const;
+  size_type rightmost_from(size_type idx) const;
+
+  /* Fill subtree of 'idx' with elements from 'it' in in-order. */
+  template <typename InputIt>
+  void fill(InputIt& it, size_type idx);
+
+public:
+
+  /* Bidirectional iterator, index of the element in the array. 0 means end. */
+  class const_iterator {
+
+    const frozen_rbtree* tree = nullptr;
+    size_type idx = 0;
+
+  public:
+
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type   = std::ptrdiff_t;
+    using value_type        = Key;
+    using pointer           = const value_type*;
+    using reference         = const value_type&;
+
+    const_iterator() = default;
+
+    const_iterator(const frozen_rbtree* owner, size_type index) noexcept
+    : tree(owner), idx(index) {}
+
+    reference operator*() const { return tree->keys[idx]; }
+    pointer operator->() const { return &tree->keys[idx]; }
+
+    /* Successor: leftmost element in the right subtree, or the first ancestor, subtree of which is left. */
+    const_iterator& operator++() {
+
+      if (2 * idx + 1 <= tree->count) {
+        idx = tree->leftmost_from(2 * idx + 1);
+      } else {
+        idx >>= std::countr_one(idx) + 1;
+      }
+
+      return *this;
+    }
+
+    const_iterator& operator--() {
+
+      if (idx == 0) {
+        idx = tree->rightmost_from(1);
+      } else if (2 * idx <= tree->count) {
+        idx = tree->rightmost_from(2 * idx);
+      } else {
+        idx >>= std::countr_zero(idx) + 1;
+      }
+
+      return *this;
+    }
+
+    const_iterator operator++(int) { auto temp(*this); operator++(); return temp; }
+    const_iterator operator--(int) { auto temp(*this); operator--(); return temp; }
+
+    friend bool operator==(const const_iterator& lhs, const const_iterator& rhs) {
+      return (lhs.idx == rhs.idx);
+    }
+
+    friend class frozen_rbtree;
+  };
+
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  frozen_rbtree(const Compare& compare = Compare())
+  : cmp(compare) {}
+
+  /* Ctor from sorted range without equivalent elements. */
+  template <typename InputIt>
+  frozen_rbtree(sorted_unique_t, InputIt first, size_type n, const Compare& compare = Compare());
+
+  /* Iterators. */
+  const_iterator cbegin() const { return const_iterator(this, (count != 0)? leftmost_from(1) : 0); }
+  const_iterator begin()  const { return cbegin(); }
+
+  const_iterator cend() const { return const_iterator(this, 0); }
+  const_iterator end()  const { return cend(); }
+
+  const_reverse_iterator crbegin() const { return const_reverse_iterator(cend()); }
+  const_reverse_iterator rbegin()  const { return crbegin(); }
+
+  const_reverse_iterator crend() const { return const_reverse_iterator(cbegin()); }
+  const_reverse_iterator rend()  const { return crend(); }
+
+  bool empty() const { return (count == 0); }
+  size_type size() const { return count; }
+
+  /* Lookup. Branchless descent of full height. */
+  const_iterator lower_bound(const key_type& key) const {
+    return const_iterator(this, descend([&](const key_type& elem) { return cmp(elem, key); }));
+  }
+
+  const_iterator upper_bound(const key_type& key) const {
+    return const_iterator(this, descend([&](const key_type& elem) { return !cmp(key, elem); }));
+  }
+
+  const_iterator find(const key_type& key) const {
+
+    auto it = lower_bound(key);
+    return (it.idx == 0 || cmp(key, *it))? cend() : it;
+  }
+
+  bool contains(const key_type& key) const { return (find(key) != cend()); }
+
+  /* Order statistics. Rank is computed from the index of the element in O(1). */
+  size_type rank(const_iterator pos) const;
+
+  size_type less_than(const key_type& key) const { return rank(lower_bound(key)); }
+
+  size_type count_range(const key_type& lo, const key_type& hi) const {
+    return (cmp(lo, hi))? less_than(hi) - less_than(lo) : 0;
+  }
+
+  difference_type distance(const key_type& first, const key_type& second) const {
+    return static_cast<difference_type>(less_than(second)) - static_cast<difference_type>(less_than(first));
+  }
+
+  difference_type distance(const_iterator first, const_iterator second) const {
+    return static_cast<difference_type>(rank(second)) - static_cast<difference_type>(rank(first));
+  }
+
+  key_compare key_comp() const { return cmp; }
+};
+
+/* Equality comparison between two frozen trees. */
+template <typename Key, typename Compare>
+bool operator==(const frozen_rbtree<Key, Compare>& lhs, const frozen_rbtree<Key, Compare>& rhs) {
+
+  return (lhs.size() == rhs.size())
+       && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+/* Element 0 is a copy of the first one, so that the array has no holes. */
+template <typename Key, typename Compare>
+template <typename InputIt>
+frozen_rbtree<Key, Compare>::frozen_rbtree(sorted_unique_t, InputIt first, size_type n, const Compare& compare)
+: count(n), cmp(compare) {
+
+  if (n == 0) {
+    return;
+  }
+
+  keys.reserve(n + 1);
+  keys.push_back(*first);
+  keys.resize(n + 1, keys.front());
+
+  fill(first, 1);
+}
+
+template <typename Key, typename Compare>
+template <typename InputIt>
+void frozen_rbtree<Key, Compare>::fill(InputIt& it, size_type idx) {
+
+  if (idx > count) {
+    return;
+  }
+
+  fill(it, 2 * idx);
+  keys[idx] = *it;
+  ++it;
+  fill(it, 2 * idx + 1);
+}
+
+/*
+ * Index goes to '2k + go_right(k)' down to the leaf level. Trailing ones of
+ * the final index are right turns taken after the answer, they are cut off with it.
+ */
+template <typename Key, typename Compare>
+template <typename GoRight>
+typename frozen_rbtree<Key, Compare>::size_type
+frozen_rbtree<Key, Compare>::descend(GoRight go_right) const {
+
+  const key_type* data = keys.data();
+  size_type idx = 1;
+
+  while (idx <= count) {
+
+    if constexpr (std::is_trivially_copyable_v<key_type> && sizeof(key_type) <= cache_line) {
+      dtl::prefetch(data + std::min(idx * keys_per_line, count));
+    }
+
+    idx = 2 * idx + static_cast<size_type>(go_right(data[idx]));
+  }
+
+  return idx >> (std::countr_one(idx) + 1);
+}
+
+template <typename Key, typename Compare>
+typename frozen_rbtree<Key, Compare>::size_type
+frozen_rbtree<Key, Compare>::leftmost_from(size_type idx) const {
+
+  while (2 * idx <= count) {
+    idx *= 2;
+  }
+
+  return idx;
+}
+
+template <typename Key, typename Compare>
+typename frozen_rbtree<Key, Compare>::size_type
+frozen_rbtree<Key, Compare>::rightmost_from(size_type idx) const {
+
+  while (2 * idx + 1 <= count) {
+    idx = 2 * idx + 1;
+  }
+
+  return idx;
+}
+
+/*
+ * In a perfect tree of height 'h' element 'k' on depth 'd' has in-order position
+ * (2 (k - 2^d) + 1) 2^(h - 1 - d) - 1. Only the last level is incomplete,
+ * its slots are every other position starting from 0, and only
+ * the leftmost 'last_level' of them are filled. Missing slots before the position are subtracted.
+ */
+template <typename Key, typename Compare>
+typename frozen_rbtree<Key, Compare>::size_type
+frozen_rbtree<Key, Compare>::rank(const_iterator pos) const {
+
+  size_type idx = pos.idx;
+  if (idx == 0) {
+    return count;
+  }
+
+  auto height = static_cast<size_type>(std::bit_width(count));
+  auto depth  = static_cast<size_type>(std::bit_width(idx)) - 1;
+
+  size_type perfect_pos = ((2 * (idx - (size_type{1} << depth)) + 1) << (height - 1 - depth)) - 1;
+  size_type last_level  = count - ((size_type{1} << (height - 1)) - 1);
+
+  size_type slots_before = (perfect_pos + 1) / 2;
+  return perfect_pos - ((slots_before > last_level)? slots_before - last_level : 0);
+}
+
+/* 
+ * Immutable pointer-free copy of the tree with keys in Eytzinger order. 
+ * Keys are copied, O(n).
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+frozen_rbtree<Key, Compare> freeze(const rbtree<Key, Compare, Allocator, NodeSize>& source) {
+  return frozen_rbtree<Key, Compare>(sorted_unique, source.cbegin(), source.size(), source.key_comp());
+}
+
+}; /* namespace RBTREE */
@@ -7,7 +7,7 @@
 
 namespace RBTREE {
 
-template < typename Key, typename Compare> 
+template <typename Key, typename Compare, typename Allocator, typename NodeSize> 
 class rbtree;
 
 namespace DETAIL {
@@ -16,7 +16,7 @@ namespace DETAIL {
  * Iterator for the tree. 
  */
 template <typename Node>
-class const_iter final {
+class const_iter {
 
   /* Underlying node pointer. */
   using node = Node;
@@ -37,8 +37,11 @@ public:
   explicit const_iter(const end_node* node_ptr = nullptr) noexcept 
   : node_ptr_(node_ptr) {}
 
-  /* Implicit conversion to bool. */
-  operator bool() const { 
+  /* 
+   * Conversion to bool. Explicit, so that 'it + n' with integral 'n'
+   * is not ambiguous with built-in arithmetic.
+   */
+  explicit operator bool() const { 
     return static_cast<bool>(node_ptr_); 
   }
 
@@ -51,6 +54,29 @@ public:
   const_iter operator++(int) { auto temp(*this); operator++(); return temp; }
   const_iter operator--(int) { auto temp(*this); operator--(); return temp; }
 
+  /* 
+   * Random access-like operations performed in O(log n) using subtree sizes.
+   * NOTE: iterator category is still bidirectional, since these operations
+   * are not constant time.
+   */
+  const_iter& operator+=(difference_type n) { 
+    node_ptr_ = node::advance(node_ptr_, n); 
+    return *this; 
+  }
+
+  const_iter& operator-=(difference_type n) { return operator+=(-n); }
+
+  friend const_iter operator+(const_iter it, difference_type n) { return it += n; }
+  friend const_iter operator+(difference_type n, const_iter it) { return it += n; }
+  friend const_iter operator-(const_iter it, difference_type n) { return it -= n; }
+
+  friend difference_type operator-(const const_iter& lhs, const const_iter& rhs) {
+    return static_cast<difference_type>(node::rank(lhs.node_ptr_)) 
+         - static_cast<difference_type>(node::rank(rhs.node_ptr_));
+  }
+
+  reference operator[](difference_type n) const { return *(*this + n); }
+
   friend bool operator==(const const_iter& lhs, const const_iter& rhs) {
     return (lhs.node_ptr_ == rhs.node_ptr_);
   }
@@ -59,7 +85,7 @@ public:
     return (lhs.node_ptr_ != rhs.node_ptr_);
   }
 
-  template <typename Key, typename Compare>
+  template <typename Key, typename Compare, typename Allocator, typename NodeSize>
   friend class ::RBTREE::rbtree;
 };
 
@@ -93,6 +119,48 @@ const_iter<Node>& const_iter<Node>::operator--() {
   return *this;
 }
 
+/* 
+ * Mutable iterator. Used by containers, whose elements could be 
+ * partially modified without breaking the order (mapped values of the map).
+ */
+template <typename Node>
+class iter final : public const_iter<Node> {
+
+  using base = const_iter<Node>;
+
+public:
+
+  using iterator_category = typename base::iterator_category;
+  using difference_type   = typename base::difference_type;
+  using value_type        = typename base::value_type;
+  using pointer           = value_type*;
+  using reference         = value_type&;
+
+  iter() noexcept = default;
+
+  /* Nodes are never const objects, so constness could be dropped. */
+  explicit iter(const base& it) noexcept 
+  : base(it) {}
+
+  reference operator*() const { return const_cast<reference>(base::operator*()); }
+  pointer operator->() const { return const_cast<pointer>(base::operator->()); }
+
+  iter& operator++() { base::operator++(); return *this; }
+  iter& operator--() { base::operator--(); return *this; }
+
+  iter operator++(int) { auto temp(*this); operator++(); return temp; }
+  iter operator--(int) { auto temp(*this); operator--(); return temp; }
+
+  iter& operator+=(difference_type n) { base::operator+=(n); return *this; }
+  iter& operator-=(difference_type n) { base::operator-=(n); return *this; }
+
+  friend iter operator+(iter it, difference_type n) { return it += n; }
+  friend iter operator+(difference_type n, iter it) { return it += n; }
+  friend iter operator-(iter it, difference_type n) { return it -= n; }
+
+  reference operator[](difference_type n) const { return *(*this + n); }
+};
+
 }; /* namespace DETAIL */
 
 }; /* namespace RBTREE */
@@ -1,7 +1,6 @@
 #pragma once 
 
 #include <ios>
-#include <stack>
 #include <string>
 #include <memory>
 #include <cstdio>
@@ -14,11 +13,38 @@
 #include <iostream>
 #include <type_traits>
 
+#include "pool.hpp"
+
 namespace RBTREE {
 
 namespace DETAIL {
 
-/* Node structure representing end node. */
+/* 
+ * Tagged pointer helpers. Nodes are aligned at least as pointers are, 
+ * so low bits of pointers to them are free and used for flags.
+ */
+using tagged_ptr = std::uintptr_t;
+
+/* Flag that shows that pointer is a thread, not a child. */
+inline constexpr tagged_ptr thread_bit = 0b01;
+/* Flag in left pointer of the end node, distinguishing it from ordinary nodes. */
+inline constexpr tagged_ptr end_bit = 0b10;
+/* Flag in parent pointer showing that node is black. */
+inline constexpr tagged_ptr black_bit = 0b01;
+
+inline constexpr tagged_ptr tag_mask = 0b11;
+
+template <typename T>
+T* untag(tagged_ptr ptr) noexcept { return reinterpret_cast<T*>(ptr & ~tag_mask); }
+
+template <typename T>
+tagged_ptr tag(T* ptr, tagged_ptr flags = 0) noexcept { return reinterpret_cast<tagged_ptr>(ptr) | flags; }
+
+/* 
+ * Node structure representing end node. 
+ * NOTE: there are no virtual functions - end node is distinguished 
+ * from ordinary nodes by flag stored in its left pointer.
+ */
 template <typename Node>
 class end_node_t {
 
@@ -28,63 +54,61 @@ public:
 
 protected:
 
-  /* Flag that shows that left pointer is thread, node left child. */
-  bool left_is_thread = false;
-  node_t* left = nullptr;
+  /* Left child or thread to prev node. Flags are stored in low bits. */
+  tagged_ptr left = 0;
+
+  /* Construct base of an ordinary node. */
+  struct node_base_tag {};
+  end_node_t(node_base_tag) noexcept {}
 
 public:
 
-  end_node_t(node_t* lft = nullptr) noexcept:
-  left(lft) {};
+  end_node_t(node_t* lft = nullptr) noexcept
+  : left(tag(lft, end_bit)) {};
 
   end_node_t(const end_node_t& that) = delete;
   end_node_t& operator=(const end_node_t& that) = delete;
 
   end_node_t(end_node_t&& that) noexcept
-  : left(std::exchange(that.left, nullptr)),
-    left_is_thread(std::exchange(that.left_is_thread, false)) {} 
+  : left(std::exchange(that.left, that.left & end_bit)) {} 
 
   end_node_t& operator=(end_node_t&& that) noexcept {
 
     std::swap(left, that.left);
-    std::swap(left_is_thread, that.left_is_thread);
     return *this;
   }
 
-  virtual ~end_node_t() {};
+  /* Check whether this is the end node of the tree. */
+  bool is_end() const noexcept { return (left & end_bit); }
 
   /* Get letf child if it is present, otherwise nullptr. */
   node_t* get_left() const noexcept { 
-    return (left_is_thread)? nullptr : left; 
+    return (left & thread_bit)? nullptr : untag<node_t>(left); 
   }
 
   /* Get link to prev node if it is present, otherwise nullptr. */
   node_t* get_left_thread() const {
-    return (left_is_thread)? left : nullptr;
+    return (left & thread_bit)? untag<node_t>(left) : nullptr;
   }
 
   /* Get pointer to left node - child or prev. */
   node_t* get_left_unsafe() const {
-    return left;
+    return untag<node_t>(left);
   }
 
   /* Set pointer to left child. */
   void set_left(node_t* nd) {
-
-    left_is_thread = false;
-    left = nd;
+    left = tag(nd, left & end_bit);
   }
 
   /* Set pointer to left child and set its parent to this. */
   node_t* tie_left(node_t* child) noexcept {
 
-    node_t* prev = left;
-
-    left_is_thread = false;
-    left = child;
+    node_t* prev = get_left_unsafe();
+    set_left(child);
     
-    if (left != nullptr) {
-      left->set_parent(this);
+    if (child != nullptr) {
+      child->set_parent(this);
     }
 
     return prev;
@@ -93,34 +117,37 @@ public:
   /* Make thread to prev node. */
   node_t* stitch_left(end_node_t* nd) noexcept {
 
-    node_t* prev = left;
-
-    left_is_thread = true;
-    left = static_cast<node_t*>(nd);
+    node_t* prev = get_left_unsafe();
+    left = tag(nd, (left & end_bit) | thread_bit);
     
     return prev;
   }
 
   /* Check whether left child is present. */
   bool has_left() const noexcept { 
-    return (!left_is_thread) && (left != nullptr); 
+    return (get_left() != nullptr);
   }
 
   /* Check whether thread to prev node is present. */
   bool is_thread_left() const {
-    return left_is_thread;
+    return (left & thread_bit);
   }
 
   /* 
    * Get parent node as end_node pointer or node_t pointer. 
-   * Returns nullptr since end node has no parent.
+   * Returns nullptr for the end node, since it has no parent.
    */
-  virtual end_node_t* parent_as_end() const { return nullptr; }
-  virtual node_t* parent() const { return nullptr; }
+  end_node_t* parent_as_end() const noexcept { 
+    return (is_end())? nullptr : static_cast<const node_t*>(this)->parent_as_end(); 
+  }
+
+  node_t* parent() const noexcept { 
+    return (is_end())? nullptr : static_cast<const node_t*>(this)->parent(); 
+  }
 };
 
-/* Root node temaplte class. */
-template <typename Node>
+/* Root node temaplte class. Owns the nodes of the tree and allocator used for them. */
+template <typename Node, typename Allocator = std::allocator<Node>>
 class root final {
 
 public:
@@ -129,16 +156,25 @@ public:
   /* Corresponding end node type. */
   using end_node = typename Node::end_node;
 
+  /* Allocator rebound to node type. */
+  using allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<node>;
+  using alloc_traits   = std::allocator_traits<allocator_type>;
+
 private:
 
   /* End node of the tree. */
   end_node end;
 
+  /* Allocator used for creating and freeing nodes. */
+  [[no_unique_address]] allocator_type alloc;
+
 public:
 
-  root(node* root = nullptr) 
+  root(node* root = nullptr, const allocator_type& allocator = allocator_type()) 
   noexcept(std::is_nothrow_default_constructible_v<end_node> && 
-           noexcept(set(std::declval<node*>()))) {
+           std::is_nothrow_copy_constructible_v<allocator_type> &&
+           noexcept(set(std::declval<node*>())))
+  : alloc(allocator) {
     set(root);
   }
 
@@ -146,13 +182,24 @@ public:
   root& operator=(const root& that) = delete;
 
   root(root&& that) 
-  noexcept(noexcept(set(std::declval<node*>()))) {
+  noexcept(noexcept(set(std::declval<node*>())))
+  : alloc(std::move(that.alloc)) {
     set(that.set(nullptr));
   }
 
+  /* 
+   * Swap contents of two roots. Allocators are swapped only if 
+   * they propagate on swap, otherwise they are supposed to be equal.
+   */
   void swap(root& that) 
   noexcept(noexcept(set(std::declval<node*>()))) {
+    
     set(that.set(end.get_left()));
+
+    if constexpr (alloc_traits::propagate_on_container_swap::value) {
+      using std::swap;
+      swap(alloc, that.alloc);
+    }
   }
 
   root& operator=(root&& that) 
@@ -166,8 +213,26 @@ public:
     clear();
   }
 
+  /* 
+   * Free all nodes. If allocator supports bulk release and its memory is not 
+   * shared, whole slabs are dropped at once instead of freeing nodes one by one.
+   */
   void clear() {
-    node::free_subtree(get(), end_node_ptr());
+
+    if constexpr (bulk_releasable<allocator_type>) {
+      if (alloc.unique()) {
+
+        if constexpr (!std::is_trivially_destructible_v<typename node::key_type>) {
+          node::template free_subtree<false>(get(), end_node_ptr(), alloc);
+        }
+
+        set(nullptr);
+        alloc.release();
+        return;
+      }
+    }
+
+    node::free_subtree(get(), end_node_ptr(), alloc);
     set(nullptr);
   }
 
@@ -180,94 +245,92 @@ public:
 
   const end_node* end_node_ptr() const { return std::addressof(end); }
   end_node* end_node_ptr() { return std::addressof(end); }
+
+  /* Get allocator used for nodes. */
+  const allocator_type& get_allocator() const noexcept { return alloc; }
+  allocator_type& get_allocator() noexcept { return alloc; }
 };
 
-/* Node structure used in searching tree. */
-template <typename Key>
-class node_t : public end_node_t<node_t<Key>> {
+/* 
+ * Node structure used in searching tree. 
+ * Color and thread flags are packed into low bits of pointers.
+ * Size of subtree is stored with 'Size' type, so 32-bit sizes 
+ * could be used for more compact nodes.
+ */
+template <typename Key, typename Size = std::size_t>
+class node_t : public end_node_t<node_t<Key, Size>> {
 
 public:
 
-  /* Root node type. */
-  using root_type = root<node_t>;
-
   /* Base class type. */
   using end_node = end_node_t<node_t>;
 
   /* Key value that node holds. */
   using key_type = Key;
-  key_type value;
 
   /* 
    * Every node is either red or black. 
    * Inserted node is red by default.
    */  
   enum class color { RED, BLACK };
-  color color = color::RED;
 
-  using size_type = std::size_t;
-  /* Subtree size. */
-  size_type size = 1;
+  using size_type = Size;
 
 private:
 
-  /* Flag that shows that left pointer is thread, node left child. */
-  using end_node::left_is_thread;
   using end_node::left;
 
-  bool right_is_thread = false;
-  node_t* right = nullptr;
+  /* Right child or thread to next node, flag is stored in low bit. */
+  tagged_ptr right = 0;
 
-  end_node* parent_ = nullptr;
+  /* Parent node, color is stored in low bit. */
+  tagged_ptr parent_ = 0;
 
 public:
 
+  /* Subtree size. */
+  size_type size = 1;
+
+  key_type value;
+
   node_t(const node_t& that)
   noexcept(std::is_nothrow_copy_constructible_v<key_type>)
-  : value(that.value),
-    color(that.color),
-    size(that.size) {}
+  : end_node(typename end_node::node_base_tag{}),
+    parent_(that.parent_ & black_bit),
+    size(that.size),
+    value(that.value) {}
 
   node_t& operator=(const node_t& that) = delete;
 
   node_t(node_t&& that) 
   noexcept(std::is_nothrow_move_constructible_v<key_type>)
   : end_node(std::move(that)), 
-    value(std::move(that.value)),
-    color(that.color), 
+    right(std::exchange(that.right, 0)),
+    parent_(std::exchange(that.parent_, that.parent_ & black_bit)),
     size(std::exchange(that.size, 1)),
-    right_is_thread(std::exchange(that.right_is_thread, false)),
-    right(std::exchange(that.right, nullptr)),
-    parent_(std::exchange(that.parent_, nullptr)) {}
-
-  void swap(node_t& that)
-  noexcept(std::is_nothrow_swappable_v<key_type>) {
-
-    std::swap(static_cast<end_node>(*this), static_cast<end_node>(that));
-    std::swap(value, that.value);
-    std::swap(color, that.color);
-    std::swap(size, that.size);
-    std::swap(right_is_thread, that.right_is_thread);
-    std::swap(right, that.right);
-    std::swap(parent_, that.parent_);
-  }
-
-  node_t& operator=(node_t&& that) 
-  noexcept(noexcept(swap(std::declval<node_t&>()))) {
+    value(std::move(that.value)) {}
 
-    swap(that);
-    return *this;
-  }
+  node_t& operator=(node_t&& that) = delete;
 
   /* Construct node that holds copy of key. */
   node_t(const key_type& key) 
   noexcept(std::is_nothrow_copy_constructible_v<key_type>)
-  : value(key) {}
+  : end_node(typename end_node::node_base_tag{}),
+    value(key) {}
 
   /* Move-constructs value from key. */
   node_t(key_type&& key)
   noexcept(std::is_nothrow_move_constructible_v<key_type>)
-  : value(std::move(key)) {}
+  : end_node(typename end_node::node_base_tag{}),
+    value(std::move(key)) {}
+
+  /* Constructs value in-place from args. */
+  template <typename... Args>
+  requires std::is_constructible_v<key_type, Args...>
+  explicit node_t(std::in_place_t, Args&&... args)
+  noexcept(std::is_nothrow_constructible_v<key_type, Args...>)
+  : end_node(typename end_node::node_base_tag{}),
+    value(std::forward<Args>(args)...) {}
 
   using end_node::get_left;
   using end_node::get_left_thread;
@@ -275,17 +338,17 @@ public:
 
   /* Get right child if it is present, otherwise nullptr. */
   node_t* get_right() const noexcept { 
-    return (right_is_thread)? nullptr : right; 
+    return (right & thread_bit)? nullptr : untag<node_t>(right); 
   }
 
   /* Get link to next node if it is present, otherwise nullptr. */
   node_t* get_right_thread() const { 
-    return (right_is_thread)? right : nullptr; 
+    return (right & thread_bit)? untag<node_t>(right) : nullptr; 
   }
 
   /* Get pointer to right node - child or prev. */
   node_t* get_right_unsafe() const { 
-    return right; 
+    return untag<node_t>(right); 
   }
 
   /* Set pointer to left child. */
@@ -293,26 +356,36 @@ public:
 
   /* Set pointer to right child. */
   void set_right(node_t* nd) {
-
-    right_is_thread = false;
-    right = nd;
+    right = tag(nd);
   }
 
   /* Get parent node as end_node pointer or node_t pointer. */
-  end_node* parent_as_end() const override { return parent_; }
-  node_t* parent() const override { return static_cast<node_t*>(parent_); }
+  end_node* parent_as_end() const noexcept { return untag<end_node>(parent_); }
+  node_t* parent() const noexcept { return static_cast<node_t*>(parent_as_end()); }
 
   /* Set parent node using end_node pointer. */
-  void set_parent(end_node* parent) { parent_ = parent; }
+  void set_parent(end_node* parent) { parent_ = tag(parent, parent_ & black_bit); }
 
-  bool is_leaf() const { return ((left == nullptr) && (right == nullptr));}
+  /* 
+   * Reset links of the node, unlinked from the tree, 
+   * so it could be linked again as a new red leaf.
+   */
+  void detach() noexcept {
+
+    left = 0;
+    right = 0;
+    parent_ = 0;
+    size = 1;
+  }
+
+  bool is_leaf() const { return ((get_left_unsafe() == nullptr) && (get_right_unsafe() == nullptr));}
 
   /* Check whether left child is present. */
   using end_node::has_left;
 
   /* Check whether right child is present. */
   bool has_right() const noexcept { 
-    return (!right_is_thread) && (right != nullptr);
+    return (get_right() != nullptr);
   }
 
   /* Check whether thread to prev node is present. */
@@ -320,11 +393,13 @@ public:
 
   /* Check whether thread to next node is present. */
   bool is_thread_right() const {
-    return right_is_thread;
+    return (right & thread_bit);
   }
 
-  bool is_red() const { return (color == color::RED); }
-  bool is_black() const { return (color == color::BLACK); }
+  enum color get_color() const { return (parent_ & black_bit)? color::BLACK : color::RED; }
+
+  bool is_red() const { return !(parent_ & black_bit); }
+  bool is_black() const { return (parent_ & black_bit); }
 
   /* 
    * NOTE: nullptr node is also a black one. 
@@ -335,24 +410,19 @@ public:
   static bool is_red  (const node_t* nd) { return (nd != nullptr && nd->is_red()); }
   static bool is_black(const node_t* nd) { return (nd == nullptr || nd->is_black()); }
 
-  /* 
-   * paint() method so no need to write 'color' 
-   * twice in situations like the following: 
-   * node_t->color = node_t::color::BLACK
-   * we can just write: 'node_t->paint(node_t::color::BLACK)' instead. 
-   */
-  void paint (enum color clr) { color = clr; }
+  /* Paint node in given color. */
+  void paint (enum color clr) { 
+    parent_ = (clr == color::BLACK)? (parent_ | black_bit) : (parent_ & ~black_bit); 
+  }
 
   /* Set pointer to right child and set its parent to this. */
   node_t* tie_right(node_t* child) noexcept {
 
-    node_t* prev = right;
-
-    right_is_thread = false;
-    right = child;
+    node_t* prev = get_right_unsafe();
+    set_right(child);
 
-    if (right != nullptr) {
-      right->set_parent(this);      
+    if (child != nullptr) {
+      child->set_parent(this);      
     }
 
     return prev;
@@ -364,28 +434,31 @@ public:
   /* Make thread to next node. */
   node_t* stitch_right(end_node* nd) noexcept {
 
-    node_t* prev = right;
-
-    right_is_thread = true;
-    right = static_cast<node_t*>(nd);
+    node_t* prev = get_right_unsafe();
+    right = tag(nd, thread_bit);
     
     return prev;
   }
 
   bool on_left() const {
-    return (parent_ == nullptr)? false : this == parent_->get_left();
+    
+    end_node* parent_nd = parent_as_end();
+    return (parent_nd == nullptr)? false : this == parent_nd->get_left();
   }
 
+  /* NOTE: parent may be end node, which has no right child. */
   bool on_right() const {
-    return (parent_ == nullptr)? false : this == parent()->get_right();
+    return (parent_as_end() == nullptr)? false : !on_left();
   }
 
   node_t* sibling() const {
-    return (parent_ == nullptr)? nullptr : (on_left())? parent()->get_right() : parent_->get_left();
+    
+    end_node* parent_nd = parent_as_end();
+    return (parent_nd == nullptr)? nullptr : (on_left())? parent()->get_right() : parent_nd->get_left();
   }
 
   node_t* uncle() const {
-    return (parent_ == nullptr)? nullptr : parent()->sibling();
+    return (parent_as_end() == nullptr)? nullptr : parent()->sibling();
   }
 
   /* Get smallest element in subtree. */
@@ -400,34 +473,45 @@ public:
     return (subtree_root != nullptr)? subtree_root->size : 0;
   }
 
-  /* Structure holding info about subtree: root, leftmost and rightmost nodes */
-  struct subtree_info_t {
+  using difference_type = std::ptrdiff_t;
 
-    const node_t* root;
-    const end_node* leftmost;
-    const end_node* rightmost;
-    const end_node* end_node_ptr;
-  };
+  /* Get node with given in-order index in subtree. Index should be less than subtree size. */
+  static const node_t* select_desc(const node_t* subtree_root, size_type index) noexcept;
 
-  /* Structure holding info about newly made subtree copy. */
-  struct subtree_copy_t {
+  /* 
+   * Get number of nodes preceding given one in the whole tree.
+   * For end node it is number of nodes in the tree.
+   */
+  static size_type rank(const end_node* nd) noexcept;
 
-    root_type root;
-    end_node* leftmost  = nullptr;
-    end_node* rightmost = nullptr;
-  };
+  /* 
+   * Get node 'offset' positions away from given one in in-order. 
+   * End node is treated as one past the last node. Result should be in range. 
+   */
+  static const end_node* advance(const end_node* nd, difference_type offset) noexcept;
 
-  /* Make a copy of subtree. */
-  static void copy_subtree(subtree_copy_t& subtree_copy, const subtree_info_t& subtree_info);
+  /* Allocate node using given allocator and construct it from args. */
+  template <typename Alloc, typename... Args>
+  static node_t* create(Alloc& alloc, Args&&... args);
 
-  static void copy_subtree_impl(subtree_copy_t& subtree_copy, const subtree_info_t& subtree_info,
-                                                              const node_t* subtree, node_t* copy);
+  /* Destroy node and deallocate its memory using given allocator. */
+  template <typename Alloc>
+  static void destroy(Alloc& alloc, node_t* nd) noexcept;
 
-  /* Stitch each node in subtree. */
-  static void stitch_subtree(node_t* subtree) noexcept;
+  /* 
+   * Move node into allocated memory 'slot', relinking parent, children and threads 
+   * pointing to it. Old node is left unlinked, so it could be destroyed. 
+   * If construction of the key throws, the tree is not changed.
+   */
+  template <typename Alloc>
+  static node_t* relocate(Alloc& alloc, node_t* nd, node_t* slot);
 
-  /* Free given subtree. */
-  static void free_subtree(node_t* subtree, const end_node* end_node_ptr) noexcept;
+  /* 
+   * Free given subtree. If 'Deallocate' is false, nodes are only destroyed. 
+   * Link from 'end_node_ptr' to the subtree is left as is.
+   */
+  template <bool Deallocate = true, typename Alloc>
+  static void free_subtree(node_t* subtree, const end_node* end_node_ptr, Alloc& alloc) noexcept;
 
   /* Increase subtree size for each node in route from nd to root by 1. */
   static void incr_subtree_sizes(end_node* nd, const end_node* end_node_ptr);
@@ -470,127 +554,222 @@ public:
   static void write_pastend_dot(std::basic_ostream<CharT>& os, uintptr_t node_num);
 };
 
-template <typename Key>
-void node_t<Key>::copy_subtree(subtree_copy_t& subtree_copy, const subtree_info_t& subtree_info) {
+template <typename Key, typename Size>
+template <typename Alloc, typename... Args>
+node_t<Key, Size>* node_t<Key, Size>::create(Alloc& alloc, Args&&... args) {
 
-  if (subtree_info.root == nullptr) {
-    return;
+  using alloc_traits = std::allocator_traits<Alloc>;
+
+  node_t* nd = alloc_traits::allocate(alloc, 1);
+
+  try {
+    alloc_traits::construct(alloc, nd, std::forward<Args>(args)...);
+  } catch (...) {
+    alloc_traits::deallocate(alloc, nd, 1);
+    throw;
   }
 
-  const node_t* subtree = subtree_info.root;
+  return nd;
+}
 
-  node_t* copy = new node_t(*subtree);
-  subtree_copy.root.set(copy);
-  
-  copy_subtree_impl(subtree_copy, subtree_info, subtree, copy);
+template <typename Key, typename Size>
+template <typename Alloc>
+void node_t<Key, Size>::destroy(Alloc& alloc, node_t* nd) noexcept {
+
+  using alloc_traits = std::allocator_traits<Alloc>;
+
+  alloc_traits::destroy(alloc, nd);
+  alloc_traits::deallocate(alloc, nd, 1);
 }
 
-template <typename Key>
-void node_t<Key>::copy_subtree_impl(subtree_copy_t& subtree_copy, const subtree_info_t& subtree_info,
-                                                                  const node_t* subtree, node_t* copy) {
+/* 
+ * Threads to the node are made only by extreme nodes of its subtrees: 
+ * predecessor without left subtree is an ancestor having right child.
+ */
+template <typename Key, typename Size>
+template <typename Alloc>
+node_t<Key, Size>* node_t<Key, Size>::relocate(Alloc& alloc, node_t* nd, node_t* slot) {
+
+  std::allocator_traits<Alloc>::construct(alloc, slot, std::in_place, std::move_if_noexcept(nd->value));
+
+  bool left_child = nd->on_left();
 
-  end_node *parent;
+  slot->left    = nd->left;
+  slot->right   = nd->right;
+  slot->parent_ = nd->parent_;
+  slot->size    = nd->size;
+  nd->detach();
+
+  if (left_child) {
+    slot->parent_as_end()->set_left(slot);
+  } else {
+    slot->parent()->set_right(slot);
+  }
+
+  if (node_t* lft = slot->get_left(); lft != nullptr) {
+    lft->set_parent(slot);
+    get_rightmost_desc(lft)->stitch_right(slot);
+  }
+
+  if (node_t* rgt = slot->get_right(); rgt != nullptr) {
+    rgt->set_parent(slot);
+    get_leftmost_desc(rgt)->stitch_left(slot);
+  }
+
+  return slot;
+}
+
+template <typename Key, typename Size>
+template <bool Deallocate, typename Alloc>
+void node_t<Key, Size>::free_subtree(node_t* subtree, const end_node* end_node_ptr, Alloc& alloc) noexcept {
+
+  if (subtree == nullptr) {
+    return;
+  }
+
+  end_node* parent = nullptr;
 
   do {
 
-    if (subtree->has_left() && !copy->has_left()) {
+    if (subtree->has_left()) {
 
       subtree = subtree->get_left_unsafe();
-      copy->tie_left(new node_t(*subtree));
-      copy = copy->get_left_unsafe();
+      continue;
 
-    } else if (subtree->has_right() && !copy->has_right()) {
+    } else if (subtree->has_right()) {
 
       subtree = subtree->get_right_unsafe();
-      copy->tie_right(new node_t(*subtree));      
-      copy = copy->get_right_unsafe();
+      continue;
 
     } else {
 
-      if (subtree == subtree_info.leftmost) {
-        subtree_copy.leftmost = copy;
-      }
+      node_t* deleting = subtree;
+      parent = subtree->parent_as_end();
+      subtree = subtree->parent();
 
-      if (subtree == subtree_info.rightmost) {
-        subtree_copy.rightmost = copy;
+      /* Boundary node is not touched, it could be shared with other threads. */
+      if (parent != end_node_ptr) {
+
+        if (deleting->on_left()) {
+          subtree->set_left(nullptr);
+
+        } else {
+          subtree->set_right(nullptr);
+        }
       }
 
-      copy = copy->parent();
-      parent = subtree->parent_as_end();
-      subtree = subtree->parent();
+      if constexpr (Deallocate) {
+        destroy(alloc, deleting);
+      } else {
+        std::allocator_traits<Alloc>::destroy(alloc, deleting);
+      }
     }
 
-  } while (parent != subtree_info.end_node_ptr);
+  } while (parent != end_node_ptr);
 }
 
-template <typename Key>
-void node_t<Key>::stitch_subtree(node_t* subtree) noexcept {
+template <typename Key, typename Size>
+const node_t<Key, Size>* node_t<Key, Size>::select_desc(const node_t* cur, size_type index) noexcept {
 
-  std::stack<node_t*> stack;
+  while (cur != nullptr) {
 
-  while (subtree != nullptr || !stack.empty()) {
+    size_type left_size = subtree_size(cur->get_left());
 
-    if (!stack.empty()) {
-      subtree = stack.top();
-      stack.pop();
-    }
+    if (index < left_size) {
+      cur = cur->get_left();
 
-    while (subtree != nullptr) {
+    } else if (index > left_size) {
 
-      subtree->stitch();
+      index -= left_size + 1;
+      cur = cur->get_right();
 
-      auto right = subtree->get_right();
-      if (right != nullptr) {
-        stack.push(right);
-      }
-
-      subtree = subtree->get_left();
+    } else {
+      break;
     }
   }
+
+  return cur;
 }
 
-template <typename Key>
-void node_t<Key>::free_subtree(node_t* subtree, const end_node* end_node_ptr) noexcept {
+template <typename Key, typename Size>
+typename node_t<Key, Size>::size_type node_t<Key, Size>::rank(const end_node* nd) noexcept {
 
-  if (subtree == nullptr) {
-    return;
+  size_type number = subtree_size(nd->get_left());
+
+  /* End node has no parent. */
+  if (nd->parent_as_end() == nullptr) {
+    return number;
   }
 
-  end_node* parent;
+  auto cur = static_cast<const node_t*>(nd);
 
-  do {
+  for (const end_node* parent = cur->parent_as_end(); 
+       parent->parent_as_end() != nullptr; parent = cur->parent_as_end()) {
 
-    if (subtree->has_left()) {
+    auto parent_nd = static_cast<const node_t*>(parent);
+    if (parent_nd->get_right() == cur) {
+      number += 1 + subtree_size(parent_nd->get_left());
+    }
 
-      subtree = subtree->get_left_unsafe();
-      continue;
+    cur = parent_nd;
+  }
 
-    } else if (subtree->has_right()) {
+  return number;
+}
 
-      subtree = subtree->get_right_unsafe();
-      continue;
+/* 
+ * Climb up until subtree containing target node is found, 
+ * keeping index of the target relative to the current subtree. 
+ * Then descend to the target using subtree sizes.
+ */
+template <typename Key, typename Size>
+const typename node_t<Key, Size>::end_node* 
+node_t<Key, Size>::advance(const end_node* nd, difference_type offset) noexcept {
+
+  if (offset == 0) {
+    return nd;
+  }
 
-    } else {
+  const end_node* cur = nd;
+  auto index = static_cast<difference_type>(subtree_size(nd->get_left())) + offset;
 
-      node_t* deleting = subtree;
-      parent = subtree->parent_as_end();
-      subtree = subtree->parent();
+  if (nd->parent_as_end() != nullptr) {
 
-      if (deleting->on_left()) {
-        subtree->set_left(nullptr);
+    auto cur_nd = static_cast<const node_t*>(nd);
+    
+    while (index < 0 || index >= static_cast<difference_type>(cur_nd->size)) {
+
+      const end_node* parent = cur_nd->parent_as_end();
+      if (parent->parent_as_end() == nullptr) {
+        
+        /* Root reached, index is now relative to the whole tree. */
+        cur = parent;
+        break;
+      }
 
-      } else {
-        subtree->set_right(nullptr);
+      auto parent_nd = static_cast<const node_t*>(parent);
+      if (parent_nd->get_right() == cur_nd) {
+        index += static_cast<difference_type>(1 + subtree_size(parent_nd->get_left()));
       }
 
-      delete deleting;
+      cur = cur_nd = parent_nd;
     }
 
-  } while (parent != end_node_ptr);
+    if (cur != cur_nd->parent_as_end()) {
+      return select_desc(cur_nd, static_cast<size_type>(index));
+    }
+  }
+
+  /* 'cur' is end node here. */
+  if (index >= static_cast<difference_type>(subtree_size(cur->get_left()))) {
+    return cur;
+  }
+
+  return select_desc(cur->get_left(), static_cast<size_type>(index));
 }
 
-template <typename Key>
-void node_t<Key>::incr_subtree_sizes(end_node* nd, const end_node* end_node_ptr) {
+template <typename Key, typename Size>
+void node_t<Key, Size>::incr_subtree_sizes(end_node* nd, const end_node* end_node_ptr) {
 
   if (nd == nullptr) {
     return;
@@ -605,8 +784,8 @@ void node_t<Key>::incr_subtree_sizes(end_node* nd, const end_node* end_node_ptr)
   }
 }
 
-template <typename Key>
-void node_t<Key>::decr_subtree_sizes(end_node* nd, const end_node* end_node_ptr) {
+template <typename Key, typename Size>
+void node_t<Key, Size>::decr_subtree_sizes(end_node* nd, const end_node* end_node_ptr) {
   
   if (nd == nullptr) {
     return;
@@ -621,8 +800,8 @@ void node_t<Key>::decr_subtree_sizes(end_node* nd, const end_node* end_node_ptr)
   }
 }
 
-template <typename Key>
-node_t<Key>* node_t<Key>::get_leftmost_desc(node_t* cur) {
+template <typename Key, typename Size>
+node_t<Key, Size>* node_t<Key, Size>::get_leftmost_desc(node_t* cur) {
 
   while (cur != nullptr && cur->has_left()) {
     cur = cur->get_left();
@@ -631,8 +810,8 @@ node_t<Key>* node_t<Key>::get_leftmost_desc(node_t* cur) {
   return cur;
 }
 
-template <typename Key>
-const node_t<Key>* node_t<Key>::get_leftmost_desc(const node_t* cur) {
+template <typename Key, typename Size>
+const node_t<Key, Size>* node_t<Key, Size>::get_leftmost_desc(const node_t* cur) {
 
   while (cur != nullptr && cur->has_left()) {
     cur = cur->get_left();
@@ -641,8 +820,8 @@ const node_t<Key>* node_t<Key>::get_leftmost_desc(const node_t* cur) {
   return cur;
 }
 
-template <typename Key>
-node_t<Key>* node_t<Key>::get_rightmost_desc(node_t* cur) {
+template <typename Key, typename Size>
+node_t<Key, Size>* node_t<Key, Size>::get_rightmost_desc(node_t* cur) {
 
   while (cur != nullptr && cur->has_right()) {
     cur = cur->get_right();
@@ -651,8 +830,8 @@ node_t<Key>* node_t<Key>::get_rightmost_desc(node_t* cur) {
   return cur;
 }
 
-template <typename Key>
-const node_t<Key>* node_t<Key>::get_rightmost_desc(const node_t* cur) {
+template <typename Key, typename Size>
+const node_t<Key, Size>* node_t<Key, Size>::get_rightmost_desc(const node_t* cur) {
 
   while (cur != nullptr && cur->has_right()) {
     cur = cur->get_right();
@@ -661,12 +840,12 @@ const node_t<Key>* node_t<Key>::get_rightmost_desc(const node_t* cur) {
   return cur;
 }
 
-template <typename Key>
-const typename node_t<Key>::end_node* 
-node_t<Key>::get_prev() const noexcept {
+template <typename Key, typename Size>
+const typename node_t<Key, Size>::end_node* 
+node_t<Key, Size>::get_prev() const noexcept {
 
   if (has_left()) {
-    return node_t::get_rightmost_desc(left);
+    return node_t::get_rightmost_desc(get_left_unsafe());
 
   } else {
 
@@ -677,7 +856,7 @@ node_t<Key>::get_prev() const noexcept {
 
       auto nd = static_cast<const node_t*>(node_ptr);
 
-      if (prev == nd->right) {
+      if (prev == nd->get_right()) {
         return nd;
       }
 
@@ -689,12 +868,12 @@ node_t<Key>::get_prev() const noexcept {
   }
 }
 
-template <typename Key>
-typename node_t<Key>::end_node* 
-node_t<Key>::get_prev() noexcept {
+template <typename Key, typename Size>
+typename node_t<Key, Size>::end_node* 
+node_t<Key, Size>::get_prev() noexcept {
 
   if (has_left()) {
-    return node_t::get_rightmost_desc(left);
+    return node_t::get_rightmost_desc(get_left_unsafe());
 
   } else {
 
@@ -705,7 +884,7 @@ node_t<Key>::get_prev() noexcept {
 
       auto nd = static_cast<node_t*>(node_ptr);
 
-      if (prev == nd->right) {
+      if (prev == nd->get_right()) {
         return nd;
       }
 
@@ -717,12 +896,12 @@ node_t<Key>::get_prev() noexcept {
   }
 }
 
-template <typename Key>
-const typename node_t<Key>::end_node* 
-node_t<Key>::get_next() const noexcept {
+template <typename Key, typename Size>
+const typename node_t<Key, Size>::end_node* 
+node_t<Key, Size>::get_next() const noexcept {
 
   if (has_right()) {
-    return node_t::get_leftmost_desc(right);
+    return node_t::get_leftmost_desc(get_right_unsafe());
 
   } else {
 
@@ -733,7 +912,7 @@ node_t<Key>::get_next() const noexcept {
 
       auto nd = static_cast<const node_t*>(node_ptr);
 
-      if (prev == nd->left) {
+      if (prev == nd->get_left()) {
         return nd;
       }
 
@@ -745,12 +924,12 @@ node_t<Key>::get_next() const noexcept {
   }
 }
 
-template <typename Key>
-typename node_t<Key>::end_node* 
-node_t<Key>::get_next() noexcept {
+template <typename Key, typename Size>
+typename node_t<Key, Size>::end_node* 
+node_t<Key, Size>::get_next() noexcept {
 
   if (has_right()) {
-    return node_t::get_leftmost_desc(right);
+    return node_t::get_leftmost_desc(get_right_unsafe());
 
   } else {
 
@@ -761,7 +940,7 @@ node_t<Key>::get_next() noexcept {
 
       auto nd = static_cast<node_t*>(node_ptr);
 
-      if (prev == nd->left) {
+      if (prev == nd->get_left()) {
         return nd;
       }
 
@@ -773,8 +952,8 @@ node_t<Key>::get_next() noexcept {
   }
 }
 
-template <typename Key>
-void node_t<Key>::stitch() noexcept {
+template <typename Key, typename Size>
+void node_t<Key, Size>::stitch() noexcept {
 
   if (!has_left()) {
     stitch_left(get_prev());
@@ -785,8 +964,8 @@ void node_t<Key>::stitch() noexcept {
   } 
 }
 
-template <typename Key>
-bool node_t<Key>::debug_validate_rb() const {
+template <typename Key, typename Size>
+bool node_t<Key, Size>::debug_validate_rb() const {
 
   if (is_black()) {
     return true;
@@ -794,19 +973,19 @@ bool node_t<Key>::debug_validate_rb() const {
 
   bool res = true;
 
-  if (has_left() && left->color != color::BLACK) {
+  if (has_left() && !get_left()->is_black()) {
 
     std::cerr << "Debug validation:"
-              << " left descendant " << left 
+              << " left descendant " << get_left() 
               << " of a red node " << this
               << " is not black. \n";
     res = false;
   }
 
-  if (has_right() && right->color != color::BLACK) {
+  if (has_right() && !get_right()->is_black()) {
     
     std::cerr << "Debug validation:"
-              << " right descendant " << right
+              << " right descendant " << get_right()
               << " of a red node " << this
               << " is not black."
               << std::endl;
@@ -816,43 +995,34 @@ bool node_t<Key>::debug_validate_rb() const {
   return res;
 }
 
-template <typename Key>
-bool node_t<Key>::debug_validate_size() const {
+template <typename Key, typename Size>
+bool node_t<Key, Size>::debug_validate_size() const {
 
-  size_t sz = 0;
-
-  bool has_l = has_left();
-  if (has_l) {
-    sz += left->size;
-  }
-
-  bool has_r = has_right();
-  if (has_r) {
-    sz += right->size;
-  }
+  size_t sz = subtree_size(get_left()) + subtree_size(get_right());
 
   if (sz + 1 != size) {
     std::cerr << "Debug validation: invalid subtree sizes." 
               << " Size of node " << this << " is " << size;
       
-    if (has_l) {
-      std::cerr << " Size of left descendant " << left 
-                << " is " << left->size;
+    if (has_left()) {
+      std::cerr << " Size of left descendant " << get_left() 
+                << " is " << get_left()->size;
     }
 
-    if (has_r) {
-      std::cerr << " Size of right descendant " << right 
-                << " is " << right->size;
+    if (has_right()) {
+      std::cerr << " Size of right descendant " << get_right() 
+                << " is " << get_right()->size;
     }
 
     std::cerr << std::endl;
+    return false;
   } 
 
   return true;
 }
 
-template <typename Key>
-bool node_t<Key>::debug_validate() const {
+template <typename Key, typename Size>
+bool node_t<Key, Size>::debug_validate() const {
 
   auto rb_res   = debug_validate_rb();
   auto size_res = debug_validate_size();
@@ -861,9 +1031,9 @@ bool node_t<Key>::debug_validate() const {
 }
 
 /* Write node desctiption in dot format to temporary text file. */
-template <typename Key>
+template <typename Key, typename Size>
   template <typename CharT>
-  void DETAIL::node_t<Key>::write_dot(std::basic_ostream<CharT>& os) const {
+  void DETAIL::node_t<Key, Size>::write_dot(std::basic_ostream<CharT>& os) const {
 
     os << "NODE" << this << " ["
        << " label = < " << value << " <BR /> "
@@ -874,7 +1044,7 @@ template <typename Key>
        << " ]; \n";
 
     os << "NODE" << this << " -> "
-       << "NODE" << parent_ << " ["
+       << "NODE" << parent_as_end() << " ["
        << " style = \"dashed\""
        << " label = \"P\" ]; \n";
 
@@ -886,7 +1056,7 @@ template <typename Key>
       l = reinterpret_cast<const void*>(&left);
 
     } else {
-      l = reinterpret_cast<const void*>(left);
+      l = reinterpret_cast<const void*>(get_left());
     }
 
     if (!has_right()) {
@@ -895,7 +1065,7 @@ template <typename Key>
       r = reinterpret_cast<const void*>(&right);
 
     } else {
-      r = reinterpret_cast<const void*>(right);
+      r = reinterpret_cast<const void*>(get_right());
     }
 
     os << "NODE" << this << " -> "
@@ -904,27 +1074,27 @@ template <typename Key>
     os << "NODE" << this << " -> "
        << "NODE" << r << " [ label = \"R\" ]; \n";
 
-    if (left_is_thread) {
+    if (is_thread_left()) {
 
       os << "NODE" << this << " -> "
-         << "NODE" << left
+         << "NODE" << get_left_unsafe()
          << " [ label = \"PREV\" style = \"dotted\" " 
          << " fontcolor = \"#a3a3c2\" color = \"#a3a3c2\" ]; \n"; 
     }
 
-    if (right_is_thread) {
+    if (is_thread_right()) {
 
       os << "NODE" << this << " -> "
-         << "NODE" << right
+         << "NODE" << get_right_unsafe()
          << " [ label = \"NEXT\" style = \"dotted\" " 
          << " fontcolor = \"#a3a3c2\" color = \"#a3a3c2\" ]; \n"; 
     }
   }
 
 /* Helper function to add nill nodes. */
-template <typename Key>
+template <typename Key, typename Size>
   template <typename CharT>
-  void DETAIL::node_t<Key>::write_nill_dot(std::basic_ostream<CharT>& os, uintptr_t node_num) {
+  void DETAIL::node_t<Key, Size>::write_nill_dot(std::basic_ostream<CharT>& os, uintptr_t node_num) {
 
     os << "NODE" << std::hex << std::showbase << node_num << std::dec << " ["
        << " label = \"nill\" color = \"#000000\" width=0.1" 
@@ -932,15 +1102,22 @@ template <typename Key>
   }
 
 /* Helper function to add past-end node. */
-template <typename Key>
+template <typename Key, typename Size>
   template <typename CharT>
-  void DETAIL::node_t<Key>::write_pastend_dot(std::basic_ostream<CharT>& os, uintptr_t node_num) {
+  void DETAIL::node_t<Key, Size>::write_pastend_dot(std::basic_ostream<CharT>& os, uintptr_t node_num) {
 
     os << "NODE" << std::hex << std::showbase << node_num << std::dec << " ["
        << " label = \"PAST-END\" color = \"#00FFFF\" width=0.1" 
        << " fontcolor = \"#000000\" fontsize = \"10\" shape = \"diamond\" ]; \n";
   }
 
+/* 
+ * Color and thread flags take no space of their own: node with 32-bit
+ * subtree size is just three pointers, size and key.
+ */
+static_assert(sizeof(node_t<int, std::uint32_t>) == 3 * sizeof(void*) + sizeof(std::uint32_t) + sizeof(int));
+static_assert(sizeof(node_t<int>) <= 3 * sizeof(void*) + 2 * sizeof(std::size_t));
+
 }; /* namespace DETAIL */
 
 }; /* namespace RBTREE */
\ No newline at end of file
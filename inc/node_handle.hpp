@@ -0,0 +1,147 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+#include <optional>
+#include <type_traits>
+
+namespace RBTREE {
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+class rbtree;
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+class rbmultiset;
+
+namespace DETAIL {
+
+/*
+ * Owner of the node extracted from the tree. Node is not reallocated
+ * when it is moved between trees with equal allocators.
+ * Node handle is move-only, node is destroyed along with the handle
+ * unless it is inserted into a tree.
+ */
+template <typename Node, typename Allocator>
+class node_handle final {
+
+  using node = Node;
+
+  /* Node allocator type and its traits. */
+  using node_allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<node>;
+  using node_alloc_traits   = std::allocator_traits<node_allocator_type>;
+
+  node* nd = nullptr;
+  std::optional<node_allocator_type> alloc;
+
+  node_handle(node* owned, const node_allocator_type& allocator) noexcept
+  : nd(owned), alloc(allocator) {}
+
+  /* Give up ownership of the node. */
+  node* release() noexcept {
+
+    alloc.reset();
+    return std::exchange(nd, nullptr);
+  }
+
+public:
+
+  using value_type     = typename node::key_type;
+  using allocator_type = Allocator;
+
+  /* Empty node handle. */
+  constexpr node_handle() noexcept = default;
+
+  node_handle(const node_handle& that) = delete;
+  node_handle& operator=(const node_handle& that) = delete;
+
+  node_handle(node_handle&& that) noexcept
+  : nd(std::exchange(that.nd, nullptr)),
+    alloc(std::move(that.alloc)) {
+
+    that.alloc.reset();
+  }
+
+  node_handle& operator=(node_handle&& that) noexcept {
+
+    if (this == &that) {
+      return *this;
+    }
+
+    /* Handle is empty after reset, so allocator is always taken from 'that'. */
+    reset();
+
+    alloc = std::move(that.alloc);
+    nd = std::exchange(that.nd, nullptr);
+    that.alloc.reset();
+    return *this;
+  }
+
+  ~node_handle() { reset(); }
+
+  /* Checks whether handle owns a node. */
+  [[nodiscard]] bool empty() const noexcept { return (nd == nullptr); }
+  explicit operator bool() const noexcept { return !empty(); }
+
+  /* Value stored in the node. Handle should not be empty. */
+  value_type& value() const noexcept { return nd->value; }
+
+  /* Key and mapped value for nodes of the map. */
+  auto& key() const noexcept
+  requires requires { nd->value.first; nd->value.second; } {
+    using key_type = std::remove_const_t<decltype(nd->value.first)>;
+    return const_cast<key_type&>(nd->value.first);
+  }
+
+  auto& mapped() const noexcept
+  requires requires { nd->value.first; nd->value.second; } {
+    return nd->value.second;
+  }
+
+  /* Allocator, which the node was allocated with. Handle should not be empty. */
+  allocator_type get_allocator() const { return allocator_type(*alloc); }
+
+  void swap(node_handle& that) noexcept {
+
+    std::swap(nd, that.nd);
+
+    if constexpr (node_alloc_traits::propagate_on_container_swap::value) {
+      std::swap(alloc, that.alloc);
+    } else if (!alloc || !that.alloc) {
+      std::swap(alloc, that.alloc);
+    }
+  }
+
+  friend void swap(node_handle& lhs, node_handle& rhs) noexcept { lhs.swap(rhs); }
+
+  template <typename Key, typename Compare, typename TreeAllocator, typename NodeSize>
+  friend class ::RBTREE::rbtree;
+
+  template <typename Key, typename Compare, typename TreeAllocator, typename NodeSize>
+  friend class ::RBTREE::rbmultiset;
+
+private:
+
+  /* Destroy owned node if any. */
+  void reset() noexcept {
+
+    if (nd != nullptr) {
+      node::destroy(*alloc, nd);
+      nd = nullptr;
+    }
+
+    alloc.reset();
+  }
+};
+
+/* Result of inserting node handle. If insertion failed, 'node' owns the node back. */
+template <typename Iter, typename NodeType>
+struct insert_return {
+
+  Iter position;
+  bool inserted;
+  NodeType node;
+};
+
+}; /* namespace DETAIL */
+
+}; /* namespace RBTREE */
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <new>
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <concepts>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+namespace RBTREE {
+
+namespace DETAIL {
+
+/*
+ * Slab arena handing out fixed size slots.
+ * Slot size is fixed by the first slot allocation. Slots are cut from
+ * large contiguous slabs, freed slots are kept on intrusive free list.
+ * All slabs are dropped at once on release() or on destruction.
+ * NOTE: arena is not thread-safe.
+ */
+class node_pool final {
+
+public:
+
+  /* Number of slots in the first slab and upper limit for slab growth. */
+  static constexpr std::size_t min_slab_slots = 64;
+  static constexpr std::size_t max_slab_slots = std::size_t{1} << 16;
+
+private:
+
+  /* Freed slot is reused as a link of the free list. */
+  struct free_slot {
+    free_slot* next;
+  };
+
+  /* Slab - contiguous memory block, slots are cut from. */
+  struct slab {
+    std::byte* mem;
+    std::size_t bytes;
+  };
+
+  std::vector<slab> slabs;
+
+  /* Head of the free list. */
+  free_slot* free_list = nullptr;
+
+  /* Unused part of the last slab. */
+  std::byte* cur  = nullptr;
+  std::byte* last = nullptr;
+
+  /* Size and alignment of the slot, zero size means that it is not fixed yet. */
+  std::size_t slot_size  = 0;
+  std::size_t slot_align = alignof(free_slot);
+
+  /* Number of slots in the next slab. Grows geometrically. */
+  std::size_t next_slab_slots = min_slab_slots;
+
+public:
+
+  node_pool() = default;
+
+  node_pool(const node_pool& that) = delete;
+  node_pool& operator=(const node_pool& that) = delete;
+
+  ~node_pool() {
+    release();
+  }
+
+  /*
+   * Check whether object with given size and alignment could be placed in the slot.
+   * First call fixes slot size and alignment.
+   */
+  bool fits(std::size_t bytes, std::size_t align) noexcept {
+
+    if (slot_size == 0) {
+
+      slot_align = std::max(align, alignof(free_slot));
+      slot_size  = round_up(std::max(bytes, sizeof(free_slot)), slot_align);
+    }
+
+    return (bytes <= slot_size && align <= slot_align);
+  }
+
+  /* Get slot from the free list or from the current slab. */
+  void* allocate() {
+
+    if (free_list != nullptr) {
+      return std::exchange(free_list, free_list->next);
+    }
+
+    return allocate_sequential();
+  }
+
+  /* Get slot right after the previous one taken from the current slab, ignoring the free list. */
+  void* allocate_sequential() {
+
+    if (cur == last) {
+      add_slab();
+    }
+
+    return std::exchange(cur, cur + slot_size);
+  }
+
+  /* Return slot to the free list. */
+  void deallocate(void* ptr) noexcept {
+    free_list = ::new (ptr) free_slot{free_list};
+  }
+
+  /* Make sure that at least 'count' slots could be handed out without allocating slabs. */
+  void reserve(std::size_t count) {
+
+    std::size_t avail = (slot_size == 0)? 0 : static_cast<std::size_t>(last - cur) / slot_size;
+    if (count > avail) {
+      add_slab(count);
+    }
+  }
+
+  /* Drop all slabs at once. All slots handed out before become invalid. */
+  void release() noexcept {
+
+    for (auto& s : slabs) {
+      ::operator delete(s.mem, s.bytes, std::align_val_t(slot_align));
+    }
+
+    slabs.clear();
+    free_list = nullptr;
+    cur = last = nullptr;
+    next_slab_slots = min_slab_slots;
+  }
+
+  /* Number of slabs currently held by the arena. */
+  std::size_t slab_count() const noexcept { return slabs.size(); }
+
+private:
+
+  static std::size_t round_up(std::size_t value, std::size_t align) noexcept {
+    return (value + align - 1) / align * align;
+  }
+
+  void add_slab(std::size_t min_slots = 0) {
+
+    std::size_t slots = std::max(next_slab_slots, min_slots);
+    std::size_t bytes = slots * slot_size;
+
+    slabs.reserve(slabs.size() + 1);
+    auto mem = static_cast<std::byte*>(::operator new(bytes, std::align_val_t(slot_align)));
+    slabs.push_back({mem, bytes});
+
+    cur  = mem;
+    last = mem + bytes;
+
+    next_slab_slots = std::min(next_slab_slots * 2, max_slab_slots);
+  }
+};
+
+/*
+ * Allocators handing out objects one right after another in fresh memory,
+ * so that objects allocated in a row are adjacent.
+ */
+template <typename Alloc>
+concept sequential_allocator = requires (Alloc& alloc) {
+  { alloc.allocate_sequential() } -> std::same_as<typename std::allocator_traits<Alloc>::pointer>;
+};
+
+/*
+ * Allocators supporting bulk release: tree may drop all its nodes
+ * at once, if no one else shares memory resource of the allocator.
+ */
+template <typename Alloc>
+concept bulk_releasable = requires (Alloc& alloc, const Alloc& calloc) {
+  { calloc.unique() } -> std::convertible_to<bool>;
+  alloc.release();
+};
+
+}; /* namespace DETAIL */
+
+/*
+ * Allocator handing out single objects from slab arena.
+ * Copies of the allocator (including rebound ones) share the arena.
+ * Copy of the container gets its own arena. Arrays are allocated
+ * with global operator new.
+ */
+template <typename T>
+class pool_allocator final {
+
+  template <typename U>
+  friend class pool_allocator;
+
+  using pool_type = DETAIL::node_pool;
+  std::shared_ptr<pool_type> pool;
+
+public:
+
+  using value_type = T;
+
+  /* Arena moves along with the nodes, but copies of the container do not share it. */
+  using propagate_on_container_copy_assignment = std::false_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap            = std::true_type;
+  using is_always_equal                        = std::false_type;
+
+  /* Construct allocator with new empty arena. */
+  pool_allocator()
+  : pool(std::make_shared<pool_type>()) {}
+
+  /*
+   * NOTE: no move ctor defined, since moved-from allocator should
+   * stay equal to the moved-to one.
+   */
+  pool_allocator(const pool_allocator& that) noexcept = default;
+  pool_allocator& operator=(const pool_allocator& that) noexcept = default;
+
+  template <typename U>
+  pool_allocator(const pool_allocator<U>& that) noexcept
+  : pool(that.pool) {}
+
+  T* allocate(std::size_t n) {
+
+    if (n == 1 && pool->fits(sizeof(T), alignof(T))) {
+      return static_cast<T*>(pool->allocate());
+    }
+
+    return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+  }
+
+  void deallocate(T* ptr, std::size_t n) noexcept {
+
+    if (n == 1 && pool->fits(sizeof(T), alignof(T))) {
+      pool->deallocate(ptr);
+    } else {
+      ::operator delete(ptr, n * sizeof(T), std::align_val_t(alignof(T)));
+    }
+  }
+
+  /* Copy of the container gets new arena. */
+  pool_allocator select_on_container_copy_construction() const {
+    return pool_allocator();
+  }
+
+  /* Allocate single object next to the previous one taken from the slab, freed slots are not reused. */
+  T* allocate_sequential() {
+
+    if (pool->fits(sizeof(T), alignof(T))) {
+      return static_cast<T*>(pool->allocate_sequential());
+    }
+
+    return allocate(1);
+  }
+
+  /* Reserve slots for 'count' objects. */
+  void reserve(std::size_t count) {
+
+    if (pool->fits(sizeof(T), alignof(T))) {
+      pool->reserve(count);
+    }
+  }
+
+  /* Check whether arena is used only by this allocator. */
+  bool unique() const noexcept { return (pool.use_count() == 1); }
+
+  /* Drop all slabs of the arena at once. */
+  void release() noexcept { pool->release(); }
+
+  /* Number of slabs currently held by the arena. */
+  std::size_t slab_count() const noexcept { return pool->slab_count(); }
+
+  template <typename U>
+  bool operator==(const pool_allocator<U>& that) const noexcept {
+    return (pool == that.pool);
+  }
+};
+
+}; /* namespace RBTREE */
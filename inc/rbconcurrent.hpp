@@ -0,0 +1,350 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <functional>
+#include <type_traits>
+
+#include "rbpersistent.hpp"
+
+namespace RBTREE {
+
+namespace DETAIL {
+
+/*
+ * Epoch-based read-side protection. Readers announce themselves in one of
+ * the slots, counters are kept separately for two parities of the epoch.
+ * Slots are placed on separate cache lines, so readers with different
+ * slots do not contend. Grace period: epoch is advanced and readers
+ * of the previous parity are waited for. Operations on the epoch, counters 
+ * and published pointer are sequentially consistent: reader either is 
+ * seen by the grace period, or sees the pointer published before it.
+ */
+class epoch_domain final {
+
+public:
+
+  static constexpr std::size_t slot_count = 64;
+
+private:
+
+  static constexpr std::size_t cache_line = 64;
+
+  struct alignas(cache_line) slot {
+    std::array<std::atomic<std::uint64_t>, 2> readers{};
+  };
+
+  std::array<slot, slot_count> slots;
+  std::atomic<std::uint64_t> epoch{0};
+
+  /* Slots are assigned to threads round-robin. */
+  static std::size_t thread_slot() noexcept {
+
+    static std::atomic<std::size_t> next_slot{0};
+    thread_local std::size_t slot_idx = next_slot.fetch_add(1, std::memory_order_relaxed) % slot_count;
+
+    return slot_idx;
+  }
+
+public:
+
+  /* Read-side critical section, protected data could be accessed while guard is alive. */
+  class guard {
+
+    std::atomic<std::uint64_t>* counter;
+
+  public:
+
+    explicit guard(epoch_domain& domain) noexcept {
+
+      auto& readers = domain.slots[thread_slot()].readers;
+
+      /* If epoch was advanced in between, writer could have missed this reader. */
+      while (true) {
+
+        std::uint64_t cur = domain.epoch.load();
+        counter = &readers[cur & 1];
+        counter->fetch_add(1);
+
+        if (domain.epoch.load() == cur) {
+          break;
+        }
+
+        counter->fetch_sub(1);
+      }
+    }
+
+    guard(const guard& that) = delete;
+    guard& operator=(const guard& that) = delete;
+
+    ~guard() {
+      counter->fetch_sub(1, std::memory_order_release);
+    }
+  };
+
+  /*
+   * Wait for all readers, which could have seen data unpublished before the call.
+   * Should not be called concurrently.
+   */
+  void synchronize() noexcept {
+
+    std::uint64_t prev = epoch.fetch_add(1);
+
+    for (auto& s : slots) {
+      while (s.readers[prev & 1].load() != 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+};
+
+}; /* namespace DETAIL */
+
+/*
+ * Ordered set for many readers and writers serialized by a mutex.
+ * Versions are RBTREE::rbpersistent trees: writer makes a new version
+ * (copying O(log n) nodes), publishes it with a single atomic store and
+ * retires the old one. Readers never lock or write shared memory except
+ * their epoch slot, and are never blocked by writer. Retired versions are
+ * freed in batches, after readers which could have seen them are done.
+ *
+ * Since published trees are never changed, readers see consistent version
+ * of the whole set, and there are no rotations racing with traversals.
+ */
+template <typename Key, typename Compare = std::less<Key>,
+                        typename Allocator = std::allocator<Key>,
+                        typename NodeSize = std::size_t>
+class rbconcurrent {
+
+public:
+
+  using key_type        = Key;
+  using value_type      = Key;
+  using size_type       = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using key_compare     = Compare;
+  using allocator_type  = Allocator;
+
+  /* Version of the set, seen by readers. */
+  using tree_type = rbpersistent<Key, Compare, Allocator, NodeSize>;
+
+  /* Number of retired versions, after which writer waits for readers and frees them. */
+  static constexpr std::size_t reclaim_batch = 64;
+
+private:
+
+  mutable dtl::epoch_domain domain;
+
+  /* Current version, loaded by readers. */
+  std::atomic<const tree_type*> current;
+
+  /* Writer state. */
+  std::mutex write_mutex;
+  std::unique_ptr<tree_type> owned;
+  std::vector<std::unique_ptr<tree_type>> retired;
+
+  /* 
+   * Publish new version and retire the current one. Write mutex should be held. 
+   * Space for retired versions is reserved beforehand, so publishing does not throw.
+   */
+  void publish(std::unique_ptr<tree_type> version);
+
+  /* Free retired versions. Write mutex should be held. */
+  void reclaim_retired() noexcept;
+
+public:
+
+  rbconcurrent(const Compare& compare = Compare(), const Allocator& alloc = Allocator())
+  : owned(std::make_unique<tree_type>(compare, alloc)) {
+
+    current.store(owned.get());
+    retired.reserve(reclaim_batch);
+  }
+
+  /* Ctor from existing tree, nodes are shared with it. */
+  explicit rbconcurrent(const tree_type& version)
+  : owned(std::make_unique<tree_type>(version)) {
+
+    current.store(owned.get());
+    retired.reserve(reclaim_batch);
+  }
+
+  rbconcurrent(const rbconcurrent& that) = delete;
+  rbconcurrent& operator=(const rbconcurrent& that) = delete;
+
+  /* No readers or writers should be active. */
+  ~rbconcurrent() = default;
+
+  /*
+   * Writers. Calls are serialized, each one, which changes the set, publishes a new version.
+   * 'update' applies several modifications to a private copy of the current version
+   * and publishes them at once, readers see either none or all of them. If 'modify' 
+   * returns bool, false means nothing was changed: the copy is discarded, nothing is published.
+   */
+  template <typename F>
+  void update(F&& modify);
+
+  bool insert(const key_type& key);
+  bool insert(key_type&& key);
+  size_type erase(const key_type& key);
+  void clear();
+
+  /* Wait for readers and free all retired versions. */
+  void reclaim();
+
+  /*
+   * Readers, lock-free. 'read' calls 'f' with the current version,
+   * references and iterators obtained from it are valid only inside the call.
+   */
+  template <typename F>
+  decltype(auto) read(F&& f) const {
+
+    dtl::epoch_domain::guard section(domain);
+    return std::invoke(std::forward<F>(f), *current.load());
+  }
+
+  /* Current version, which stays valid after later updates. */
+  tree_type snapshot() const { return read([](const tree_type& version) { return version; }); }
+
+  size_type size() const { return read([](const tree_type& version) { return version.size(); }); }
+  bool empty() const { return (size() == 0); }
+
+  bool contains(const key_type& key) const {
+    return read([&](const tree_type& version) { return version.contains(key); });
+  }
+
+  /* Elements are returned by value, since nodes could be freed after the call. */
+  std::optional<key_type> lower_bound(const key_type& key) const;
+  std::optional<key_type> upper_bound(const key_type& key) const;
+
+  size_type less_than(const key_type& key) const {
+    return read([&](const tree_type& version) { return version.less_than(key); });
+  }
+
+  size_type count_range(const key_type& lo, const key_type& hi) const {
+    return read([&](const tree_type& version) { return version.count_range(lo, hi); });
+  }
+
+  difference_type distance(const key_type& first, const key_type& second) const {
+    return read([&](const tree_type& version) { return version.distance(first, second); });
+  }
+};
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbconcurrent<Key, Compare, Allocator, NodeSize>::publish(std::unique_ptr<tree_type> version) {
+
+  current.store(version.get());
+  retired.push_back(std::exchange(owned, std::move(version)));
+
+  if (retired.size() >= reclaim_batch) {
+    reclaim_retired();
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbconcurrent<Key, Compare, Allocator, NodeSize>::reclaim_retired() noexcept {
+
+  if (retired.empty()) {
+    return;
+  }
+
+  /* Readers entered after this point see only the current version. */
+  domain.synchronize();
+  retired.clear();
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename F>
+void rbconcurrent<Key, Compare, Allocator, NodeSize>::update(F&& modify) {
+
+  std::lock_guard lock(write_mutex);
+
+  /* Copy shares all nodes, so it is made on the stack and moved to the heap only if published. */
+  tree_type version(*owned);
+
+  if constexpr (std::is_same_v<std::invoke_result_t<F, tree_type&>, bool>) {
+
+    if (!std::invoke(std::forward<F>(modify), version)) {
+      return;
+    }
+
+  } else {
+    std::invoke(std::forward<F>(modify), version);
+  }
+
+  publish(std::make_unique<tree_type>(std::move(version)));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool rbconcurrent<Key, Compare, Allocator, NodeSize>::insert(const key_type& key) {
+
+  bool inserted = false;
+  update([&](tree_type& version) { return (inserted = version.insert(key)); });
+  return inserted;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool rbconcurrent<Key, Compare, Allocator, NodeSize>::insert(key_type&& key) {
+
+  bool inserted = false;
+  update([&](tree_type& version) { return (inserted = version.insert(std::move(key))); });
+  return inserted;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbconcurrent<Key, Compare, Allocator, NodeSize>::size_type
+rbconcurrent<Key, Compare, Allocator, NodeSize>::erase(const key_type& key) {
+
+  size_type erased = 0;
+  update([&](tree_type& version) { return ((erased = version.erase(key)) != 0); });
+  return erased;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbconcurrent<Key, Compare, Allocator, NodeSize>::clear() {
+  update([](tree_type& version) {
+
+    bool changed = !version.empty();
+    version.clear();
+    return changed;
+  });
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbconcurrent<Key, Compare, Allocator, NodeSize>::reclaim() {
+
+  std::lock_guard lock(write_mutex);
+  reclaim_retired();
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::optional<typename rbconcurrent<Key, Compare, Allocator, NodeSize>::key_type>
+rbconcurrent<Key, Compare, Allocator, NodeSize>::lower_bound(const key_type& key) const {
+
+  return read([&](const tree_type& version) -> std::optional<key_type> {
+
+    auto it = version.lower_bound(key);
+    return (it == version.end())? std::nullopt : std::optional<key_type>(*it);
+  });
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::optional<typename rbconcurrent<Key, Compare, Allocator, NodeSize>::key_type>
+rbconcurrent<Key, Compare, Allocator, NodeSize>::upper_bound(const key_type& key) const {
+
+  return read([&](const tree_type& version) -> std::optional<key_type> {
+
+    auto it = version.upper_bound(key);
+    return (it == version.end())? std::nullopt : std::optional<key_type>(*it);
+  });
+}
+
+}; /* namespace RBTREE */
@@ -0,0 +1,459 @@
+#pragma once
+
+#include <tuple>
+#include <utility>
+#include <cstddef>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include <type_traits>
+#include <initializer_list>
+
+#include "rbtree.hpp"
+
+namespace RBTREE {
+
+namespace DETAIL {
+
+/*
+ * Comparator of the map elements, compares keys only.
+ * Transparent, so that elements could be looked up and
+ * inserted by keys without constructing key-value pairs.
+ */
+template <typename Value, typename Compare>
+struct map_value_compare {
+
+  using is_transparent = void;
+
+  Compare comp;
+
+  bool operator()(const Value& lhs, const Value& rhs) const { return comp(lhs.first, rhs.first); }
+
+  template <typename K>
+  bool operator()(const Value& lhs, const K& rhs) const { return comp(lhs.first, rhs); }
+
+  template <typename K>
+  bool operator()(const K& lhs, const Value& rhs) const { return comp(lhs, rhs.first); }
+
+  template <typename K>
+  bool operator()(const K& lhs, const K& rhs) const { return comp(lhs, rhs); }
+};
+
+}; /* namespace DETAIL */
+
+/*
+ * Ordered map based on the red-black tree.
+ * Key-value pairs are stored in the nodes of the tree, so order
+ * statistics and threaded iteration are available as in RBTREE::rbtree.
+ * Mapped values could be modified in place through iterators.
+ */
+template <typename Key, typename T, typename Compare = std::less<Key>,
+          typename Allocator = std::allocator<std::pair<const Key, T>>,
+          typename NodeSize = std::size_t>
+class rbmap {
+
+public:
+
+  using key_type        = Key;
+  using mapped_type     = T;
+  using value_type      = std::pair<const Key, T>;
+  using size_type       = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using key_compare     = Compare;
+  using value_compare   = dtl::map_value_compare<value_type, Compare>;
+  using allocator_type  = Allocator;
+
+  using reference       = value_type&;
+  using const_reference = const value_type&;
+  using pointer         = value_type*;
+  using const_pointer   = const value_type*;
+
+private:
+
+  /* Underlying tree, ordering pairs by keys. */
+  using tree_type = rbtree<value_type, value_compare, Allocator, NodeSize>;
+  tree_type tree;
+
+  using node = typename tree_type::node;
+
+public:
+
+  /* Bidirectional iterators. */
+  using iterator               = dtl::iter<node>;
+  using const_iterator         = typename tree_type::const_iterator;
+  using reverse_iterator       = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  /* Node handle, owning extracted node, and result of its insertion. */
+  using node_type = typename tree_type::node_type;
+  using insert_return_type = dtl::insert_return<iterator, node_type>;
+
+  /* Default ctor. */
+  rbmap(const Compare& compare = Compare(), const Allocator& alloc = Allocator())
+  : tree(value_compare{compare}, alloc) {}
+
+  explicit rbmap(const Allocator& alloc)
+  : rbmap(Compare(), alloc) {}
+
+  /* Ctor from range defined by two iterators. */
+  template <typename InputIt>
+  rbmap(InputIt first, InputIt last, const Compare& compare = Compare(),
+                                     const Allocator& alloc = Allocator())
+  : tree(first, last, value_compare{compare}, alloc) {}
+
+  template <typename InputIt>
+  rbmap(InputIt first, InputIt last, const Allocator& alloc)
+  : rbmap(first, last, Compare(), alloc) {}
+
+  /* Ctor from range sorted by keys without equivalent keys. */
+  template <typename InputIt>
+  rbmap(sorted_unique_t tag, InputIt first, InputIt last, const Compare& compare = Compare(),
+                                                          const Allocator& alloc = Allocator())
+  : tree(tag, first, last, value_compare{compare}, alloc) {}
+
+  rbmap(std::initializer_list<value_type> init, const Compare& compare = Compare(),
+                                                const Allocator& alloc = Allocator())
+  : rbmap(init.begin(), init.end(), compare, alloc) {}
+
+  rbmap(std::initializer_list<value_type> init, const Allocator& alloc)
+  : rbmap(init.begin(), init.end(), Compare(), alloc) {}
+
+  /* Copy and move ctors with allocator. */
+  rbmap(const rbmap& that, const Allocator& alloc)
+  : tree(that.tree, alloc) {}
+
+  rbmap(rbmap&& that, const Allocator& alloc)
+  : tree(std::move(that.tree), alloc) {}
+
+  /* Returns copy of the allocator associated with the map. */
+  allocator_type get_allocator() const noexcept { return tree.get_allocator(); }
+
+  /* Access to mapped value. Throws std::out_of_range if there is no such key. */
+  T& at(const Key& key) {
+    return const_cast<T&>(std::as_const(*this).at(key));
+  }
+
+  const T& at(const Key& key) const;
+
+  /* Access to mapped value. Value-initialized one is inserted if there is no such key. */
+  T& operator[](const Key& key) { return try_emplace(key).first->second; }
+  T& operator[](Key&& key) { return try_emplace(std::move(key)).first->second; }
+
+  /* Iterator to the first element. */
+  iterator begin() { return iterator(tree.begin()); }
+  const_iterator begin()  const { return tree.begin(); }
+  const_iterator cbegin() const { return tree.cbegin(); }
+
+  /* Past-end iterator. */
+  iterator end() { return iterator(tree.end()); }
+  const_iterator end()  const { return tree.end(); }
+  const_iterator cend() const { return tree.cend(); }
+
+  /* Reverse iterators. */
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  const_reverse_iterator rbegin()  const { return tree.rbegin(); }
+  const_reverse_iterator crbegin() const { return tree.crbegin(); }
+
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rend()  const { return tree.rend(); }
+  const_reverse_iterator crend() const { return tree.crend(); }
+
+  /* Checks whether the container is empty */
+  bool empty() const { return tree.empty(); }
+  /* Returns the number of elements */
+  size_type size() const { return tree.size(); }
+
+  /* Clear contents of the map. */
+  void clear() noexcept { tree.clear(); }
+
+  /*
+   * Insertion of key-value pair. Returns iterator to inserted element
+   * or to element with equivalent key, which is left unchanged.
+   */
+  std::pair<iterator, bool> insert(const value_type& value) { return insert_value(value); }
+  std::pair<iterator, bool> insert(value_type&& value) { return insert_value(std::move(value)); }
+
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last) { tree.insert(first, last); }
+  void insert(std::initializer_list<value_type> init) { tree.insert(init); }
+
+  /*
+   * Insert element constructed from 'args' if there is no such key.
+   * Nothing is allocated and args are not moved from otherwise.
+   */
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args) {
+    return try_emplace_key(key, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(Key&& key, Args&&... args) {
+    return try_emplace_key(std::move(key), std::forward<Args>(args)...);
+  }
+
+  /* Same as above, but position is searched just prior to 'hint' first. */
+  template <typename... Args>
+  iterator try_emplace(const_iterator hint, const Key& key, Args&&... args) {
+    return try_emplace_key_hint(hint, key, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args>
+  iterator try_emplace(const_iterator hint, Key&& key, Args&&... args) {
+    return try_emplace_key_hint(hint, std::move(key), std::forward<Args>(args)...);
+  }
+
+  /* Insert element or assign to mapped value of the existing one in place. */
+  template <typename M>
+  std::pair<iterator, bool> insert_or_assign(const Key& key, M&& obj) {
+    return insert_or_assign_key(key, std::forward<M>(obj));
+  }
+
+  template <typename M>
+  std::pair<iterator, bool> insert_or_assign(Key&& key, M&& obj) {
+    return insert_or_assign_key(std::move(key), std::forward<M>(obj));
+  }
+
+  /* Emplacement - key-value pair is constructed in node from 'args'. */
+  template <typename... Args>
+  std::pair<iterator, bool> emplace(Args&&... args);
+
+  /*
+   * Erasure - element pointed by a iterator, a range of elements
+   * defined by two iterators and element with a specific key.
+   */
+  iterator erase(iterator pos) { return iterator(tree.erase(pos)); }
+  iterator erase(const_iterator pos) { return iterator(tree.erase(pos)); }
+  iterator erase(const_iterator first, const_iterator last) {
+    return iterator(tree.erase(first, last));
+  }
+
+  bool erase(const Key& key);
+
+  /* Node extraction and insertion without reallocation, see RBTREE::rbtree. */
+  node_type extract(const_iterator pos) { return tree.extract(pos); }
+
+  node_type extract(const Key& key) {
+
+    auto it = tree.find(key);
+    return (it == tree.end())? node_type() : tree.extract(it);
+  }
+
+  insert_return_type insert(node_type&& nh) {
+
+    auto res = tree.insert(std::move(nh));
+    return insert_return_type{iterator(res.position), res.inserted, std::move(res.node)};
+  }
+
+  iterator insert(const_iterator hint, node_type&& nh) {
+    return iterator(tree.insert(hint, std::move(nh)));
+  }
+
+  /* Move elements with keys, not present in this map, from 'source'. */
+  void merge(rbmap& source) { tree.merge(source.tree); }
+  void merge(rbmap&& source) { tree.merge(source.tree); }
+
+  /* Swap contents of two maps. */
+  void swap(rbmap& that) noexcept(noexcept(tree.swap(that.tree))) { tree.swap(that.tree); }
+
+  /* Lookup by key. Keys of other types are accepted only with transparent comparator. */
+  iterator find(const Key& key) { return iterator(tree.find(key)); }
+  const_iterator find(const Key& key) const { return tree.find(key); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  iterator find(const K& key) { return iterator(tree.find(key)); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  const_iterator find(const K& key) const { return tree.find(key); }
+
+  bool contains(const Key& key) const { return tree.contains(key); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  bool contains(const K& key) const { return tree.contains(key); }
+
+  size_type count(const Key& key) const { return (contains(key))? 1 : 0; }
+
+  /* Returns an iterator to the first element with key not less than the given key */
+  iterator lower_bound(const Key& key) { return iterator(tree.lower_bound(key)); }
+  const_iterator lower_bound(const Key& key) const { return tree.lower_bound(key); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  const_iterator lower_bound(const K& key) const { return tree.lower_bound(key); }
+
+  /* Returns an iterator to the first element with key greater than the given key */
+  iterator upper_bound(const Key& key) { return iterator(tree.upper_bound(key)); }
+  const_iterator upper_bound(const Key& key) const { return tree.upper_bound(key); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  const_iterator upper_bound(const K& key) const { return tree.upper_bound(key); }
+
+  /* Returns range of elements matching a specific key */
+  std::pair<iterator, iterator> equal_range(const Key& key) {
+    return std::make_pair(lower_bound(key), upper_bound(key));
+  }
+
+  std::pair<const_iterator, const_iterator> equal_range(const Key& key) const {
+    return tree.equal_range(key);
+  }
+
+  /* Order statistics, see RBTREE::rbtree. */
+  iterator select(size_type index) { return iterator(tree.select(index)); }
+  const_iterator select(size_type index) const { return tree.select(index); }
+
+  size_type rank(const_iterator pos) const { return tree.rank(pos); }
+
+  difference_type distance(const_iterator first, const_iterator second) const {
+    return tree.distance(first, second);
+  }
+
+  difference_type distance(const Key& first, const Key& second) const {
+    return tree.distance(first, second);
+  }
+
+  size_type less_than(const Key& key) const { return tree.less_than(key); }
+  size_type count_range(const Key& lo, const Key& hi) const { return tree.count_range(lo, hi); }
+
+  /* Returns the function that compares keys. */
+  key_compare key_comp() const { return tree.key_comp().comp; }
+  /* Returns the function that compares elements by keys. */
+  value_compare value_comp() const { return tree.key_comp(); }
+
+private:
+
+  /* Insert value if there is no element with equivalent key. */
+  template <typename V>
+  std::pair<iterator, bool> insert_value(V&& value);
+
+  template <typename K, typename... Args>
+  std::pair<iterator, bool> try_emplace_key(K&& key, Args&&... args);
+
+  template <typename K, typename... Args>
+  iterator try_emplace_key_hint(const_iterator hint, K&& key, Args&&... args);
+
+  template <typename K, typename M>
+  std::pair<iterator, bool> insert_or_assign_key(K&& key, M&& obj);
+};
+
+/* Equality comparison between two maps. */
+template <typename Key, typename T, typename Compare, typename Allocator, typename NodeSize>
+bool operator==(const rbmap<Key, T, Compare, Allocator, NodeSize>& lhs,
+                const rbmap<Key, T, Compare, Allocator, NodeSize>& rhs) {
+
+  return (lhs.size() == rhs.size())
+       && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+template <typename Key, typename T, typename Compare, typename Allocator, typename NodeSize>
+const T& rbmap<Key, T, Compare, Allocator, NodeSize>::at(const Key& key) const {
+
+  auto it = find(key);
+  if (it == end()) {
+    throw std::out_of_range("RBTREE::rbmap::at: no element with given key");
+  }
+
+  return it->second;
+}
+
+template <typename Key, typename T, typename Compare, typename Allocator, typename NodeSize>
+template <typename... Args>
+std::pair<typename rbmap<Key, T, Compare, Allocator, NodeSize>::iterator, bool>
+rbmap<Key, T, Compare, Allocator, NodeSize>::emplace(Args&&... args) {
+
+  node* nd = tree.create_node(std::in_place, std::forward<Args>(args)...);
+
+  auto pos = tree.find_insert_pos(nd->value.first);
+  if (pos.equiv != nullptr) {
+
+    tree.destroy_node(nd);
+    return std::make_pair(iterator(const_iterator(pos.equiv)), false);
+  }
+
+  tree.link_node(nd, pos);
+  return std::make_pair(iterator(const_iterator(nd)), true);
+}
+
+template <typename Key, typename T, typename Compare, typename Allocator, typename NodeSize>
+bool rbmap<Key, T, Compare, Allocator, NodeSize>::erase(const Key& key) {
+
+  auto it = tree.find(key);
+  if (it == tree.end()) {
+    return false;
+  }
+
+  tree.erase(it);
+  return true;
+}
+
+template <typename Key, typename T, typename Compare, typename Allocator, typename NodeSize>
+template <typename V>
+std::pair<typename rbmap<Key, T, Compare, Allocator, NodeSize>::iterator, bool>
+rbmap<Key, T, Compare, Allocator, NodeSize>::insert_value(V&& value) {
+
+  auto pos = tree.find_insert_pos(value.first);
+  if (pos.equiv != nullptr) {
+    return std::make_pair(iterator(const_iterator(pos.equiv)), false);
+  }
+
+  node* nd = tree.create_node(std::forward<V>(value));
+  tree.link_node(nd, pos);
+  return std::make_pair(iterator(const_iterator(nd)), true);
+}
+
+/*
+ * Position is found by the key itself, node is allocated
+ * only if there is no element with equivalent key.
+ */
+template <typename Key, typename T, typename Compare, typename Allocator, typename NodeSize>
+template <typename K, typename... Args>
+std::pair<typename rbmap<Key, T, Compare, Allocator, NodeSize>::iterator, bool>
+rbmap<Key, T, Compare, Allocator, NodeSize>::try_emplace_key(K&& key, Args&&... args) {
+
+  auto pos = tree.find_insert_pos(key);
+  if (pos.equiv != nullptr) {
+    return std::make_pair(iterator(const_iterator(pos.equiv)), false);
+  }
+
+  node* nd = tree.create_node(std::in_place, std::piecewise_construct,
+                              std::forward_as_tuple(std::forward<K>(key)),
+                              std::forward_as_tuple(std::forward<Args>(args)...));
+  tree.link_node(nd, pos);
+  return std::make_pair(iterator(const_iterator(nd)), true);
+}
+
+template <typename Key, typename T, typename Compare, typename Allocator, typename NodeSize>
+template <typename K, typename... Args>
+typename rbmap<Key, T, Compare, Allocator, NodeSize>::iterator
+rbmap<Key, T, Compare, Allocator, NodeSize>::try_emplace_key_hint(const_iterator hint, K&& key,
+                                                                  Args&&... args) {
+
+  auto pos = tree.find_insert_pos(hint, key);
+  if (pos.equiv != nullptr) {
+    return iterator(const_iterator(pos.equiv));
+  }
+
+  node* nd = tree.create_node(std::in_place, std::piecewise_construct,
+                              std::forward_as_tuple(std::forward<K>(key)),
+                              std::forward_as_tuple(std::forward<Args>(args)...));
+  tree.link_node(nd, pos);
+  return iterator(const_iterator(nd));
+}
+
+/* Key is not moved from, if element is already present. */
+template <typename Key, typename T, typename Compare, typename Allocator, typename NodeSize>
+template <typename K, typename M>
+std::pair<typename rbmap<Key, T, Compare, Allocator, NodeSize>::iterator, bool>
+rbmap<Key, T, Compare, Allocator, NodeSize>::insert_or_assign_key(K&& key, M&& obj) {
+
+  auto pos = tree.find_insert_pos(key);
+  if (pos.equiv != nullptr) {
+
+    pos.equiv->value.second = std::forward<M>(obj);
+    return std::make_pair(iterator(const_iterator(pos.equiv)), false);
+  }
+
+  node* nd = tree.create_node(std::in_place, std::forward<K>(key), std::forward<M>(obj));
+  tree.link_node(nd, pos);
+  return std::make_pair(iterator(const_iterator(nd)), true);
+}
+
+}; /* namespace RBTREE */
@@ -0,0 +1,334 @@
+#pragma once
+
+#include <utility>
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <initializer_list>
+
+#include "rbtree.hpp"
+
+namespace RBTREE {
+
+/*
+ * Red-black tree storing equivalent elements.
+ * Equivalent elements are kept in order of insertion. Subtree sizes
+ * are used to count elements with given key in O(log n), without
+ * iterating over the run of equivalent elements.
+ */
+template <typename Key, typename Compare = std::less<Key>,
+                        typename Allocator = std::allocator<Key>,
+                        typename NodeSize = std::size_t>
+class rbmultiset {
+
+public:
+
+  using key_type        = Key;
+  using value_type      = Key;
+  using size_type       = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using key_compare     = Compare;
+  using allocator_type  = Allocator;
+
+  using const_reference = const key_type&;
+  using const_pointer   = const key_type*;
+
+private:
+
+  /* Underlying tree, its node linking machinery is reused. */
+  using tree_type = rbtree<Key, Compare, Allocator, NodeSize>;
+  tree_type tree;
+
+  using node = typename tree_type::node;
+
+public:
+
+  /* Bidirectional iterator. */
+  using const_iterator         = typename tree_type::const_iterator;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  /* Node handle, owning extracted node. */
+  using node_type = typename tree_type::node_type;
+
+  /* Default ctor. */
+  rbmultiset(const Compare& compare = Compare(), const Allocator& alloc = Allocator())
+  : tree(compare, alloc) {}
+
+  explicit rbmultiset(const Allocator& alloc)
+  : rbmultiset(Compare(), alloc) {}
+
+  /* Ctor from range defined by two iterators. */
+  template <typename InputIt>
+  rbmultiset(InputIt first, InputIt last, const Compare& compare = Compare(),
+                                          const Allocator& alloc = Allocator())
+  : rbmultiset(compare, alloc) {
+
+    insert(first, last);
+  }
+
+  template <typename InputIt>
+  rbmultiset(InputIt first, InputIt last, const Allocator& alloc)
+  : rbmultiset(first, last, Compare(), alloc) {}
+
+  rbmultiset(std::initializer_list<key_type> init, const Compare& compare = Compare(),
+                                                   const Allocator& alloc = Allocator())
+  : rbmultiset(init.begin(), init.end(), compare, alloc) {}
+
+  rbmultiset(std::initializer_list<key_type> init, const Allocator& alloc)
+  : rbmultiset(init.begin(), init.end(), Compare(), alloc) {}
+
+  /* Copy and move ctors with allocator. */
+  rbmultiset(const rbmultiset& that, const Allocator& alloc)
+  : tree(that.tree, alloc) {}
+
+  rbmultiset(rbmultiset&& that, const Allocator& alloc)
+  : tree(std::move(that.tree), alloc) {}
+
+  /* Returns copy of the allocator associated with the multiset. */
+  allocator_type get_allocator() const noexcept { return tree.get_allocator(); }
+
+  /* Iterators. */
+  const_iterator cbegin() const { return tree.cbegin(); }
+  const_iterator begin()  const { return tree.begin(); }
+
+  const_reverse_iterator crbegin() const { return tree.crbegin(); }
+  const_reverse_iterator rbegin()  const { return tree.rbegin(); }
+
+  const_iterator cend() const { return tree.cend(); }
+  const_iterator end()  const { return tree.end(); }
+
+  const_reverse_iterator crend() const { return tree.crend(); }
+  const_reverse_iterator rend()  const { return tree.rend(); }
+
+  /* Checks whether the container is empty */
+  bool empty() const { return tree.empty(); }
+  /* Returns the number of elements */
+  size_type size() const { return tree.size(); }
+
+  /* Clear contents of the multiset. */
+  void clear() noexcept { tree.clear(); }
+
+  /* Insertion. Element is placed after all equivalent ones. */
+  const_iterator insert(key_type&& key) { return emplace(std::move(key)); }
+  const_iterator insert(const key_type& key) { return emplace(key); }
+
+  /* Insertion as close as possible to the position just prior to 'hint'. */
+  const_iterator insert(const_iterator hint, key_type&& key) { return emplace_hint(hint, std::move(key)); }
+  const_iterator insert(const_iterator hint, const key_type& key) { return emplace_hint(hint, key); }
+
+  /* Sorted range is built in linear time if the multiset is empty. */
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last);
+  void insert(std::initializer_list<key_type> init) { insert(init.begin(), init.end()); }
+
+  /* Emplacement - constructing element in-place. */
+  template <typename... Args>
+  const_iterator emplace(Args&&... args);
+
+  template <typename... Args>
+  const_iterator emplace_hint(const_iterator hint, Args&&... args);
+
+  /*
+   * Erasure - element pointed by a iterator, a range of elements
+   * defined by two iterators and all elements with a specific key.
+   */
+  const_iterator erase(const_iterator pos) { return tree.erase(pos); }
+  const_iterator erase(const_iterator first, const_iterator last) { return tree.erase(first, last); }
+  size_type erase(const key_type& key);
+
+  /* 
+   * Node extraction and insertion without reallocation, see RBTREE::rbtree.
+   * Node is always linked, since equivalent elements are allowed.
+   */
+  node_type extract(const_iterator pos) { return tree.extract(pos); }
+
+  node_type extract(const key_type& key) {
+
+    auto it = find(key);
+    return (it == end())? node_type() : tree.extract(it);
+  }
+
+  const_iterator insert(node_type&& nh);
+  const_iterator insert(const_iterator hint, node_type&& nh);
+
+  /* Move all elements from 'source'. */
+  void merge(rbmultiset& source);
+  void merge(rbmultiset&& source) { merge(source); }
+
+  /* Swap contents of two multisets. */
+  void swap(rbmultiset& that) noexcept(noexcept(tree.swap(that.tree))) { tree.swap(that.tree); }
+
+  /* Find any element with key equivalent to a given argument. */
+  const_iterator find(const key_type& key) const { return tree.find(key); }
+  bool contains(const key_type& key) const { return tree.contains(key); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  const_iterator find(const K& key) const { return tree.find(key); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  bool contains(const K& key) const { return tree.contains(key); }
+
+  /* Number of elements with key equivalent to a given one. O(log n). */
+  size_type count(const key_type& key) const { return tree.count_equiv(key); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  size_type count(const K& key) const { return tree.count_equiv(key); }
+
+  /* Returns an iterator to the first element not less than the given key */
+  const_iterator lower_bound(const key_type& key) const { return tree.lower_bound(key); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  const_iterator lower_bound(const K& key) const { return tree.lower_bound(key); }
+
+  /* Returns an iterator to the first element greater than the given key */
+  const_iterator upper_bound(const key_type& key) const { return tree.upper_bound(key); }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  const_iterator upper_bound(const K& key) const { return tree.upper_bound(key); }
+
+  /* Returns range of elements matching a specific key. Both ends are found in O(log n). */
+  std::pair<const_iterator, const_iterator> equal_range(const key_type& key) const {
+    return tree.equal_range(key);
+  }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  std::pair<const_iterator, const_iterator> equal_range(const K& key) const {
+    return tree.equal_range(key);
+  }
+
+  /* Order statistics, see RBTREE::rbtree. */
+  const_iterator select(size_type index) const { return tree.select(index); }
+  size_type rank(const_iterator pos) const { return tree.rank(pos); }
+
+  difference_type distance(const_iterator first, const_iterator second) const {
+    return tree.distance(first, second);
+  }
+
+  difference_type distance(const key_type& first, const key_type& second) const {
+    return tree.distance(first, second);
+  }
+
+  size_type less_than(const key_type& key) const { return tree.less_than(key); }
+  size_type count_range(const key_type& lo, const key_type& hi) const { return tree.count_range(lo, hi); }
+
+  /* Returns the function that compares keys. */
+  key_compare key_comp() const { return tree.key_comp(); }
+};
+
+/* Equality comparison between two multisets. */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool operator==(const rbmultiset<Key, Compare, Allocator, NodeSize>& lhs,
+                const rbmultiset<Key, Compare, Allocator, NodeSize>& rhs) {
+
+  return (lhs.size() == rhs.size())
+       && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+/*
+ * Every element is inserted with end() as a hint,
+ * so sorted ranges are inserted without descents from the root.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename InputIt>
+void rbmultiset<Key, Compare, Allocator, NodeSize>::insert(InputIt first, InputIt last) {
+
+  if constexpr (std::is_base_of_v<std::forward_iterator_tag,
+                                  typename std::iterator_traits<InputIt>::iterator_category>) {
+
+    if (empty() && std::is_sorted(first, last, tree.key_comp())) {
+
+      tree.build_sorted(first, static_cast<size_type>(std::distance(first, last)));
+      return;
+    }
+  }
+
+  for (; first != last; ++first) {
+    emplace_hint(cend(), *first);
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename... Args>
+typename rbmultiset<Key, Compare, Allocator, NodeSize>::const_iterator
+rbmultiset<Key, Compare, Allocator, NodeSize>::emplace(Args&&... args) {
+
+  node* nd = tree.create_node(std::in_place, std::forward<Args>(args)...);
+  tree.link_node(nd, tree.find_insert_pos_equal(nd->value));
+  return const_iterator(nd);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename... Args>
+typename rbmultiset<Key, Compare, Allocator, NodeSize>::const_iterator
+rbmultiset<Key, Compare, Allocator, NodeSize>::emplace_hint(const_iterator hint, Args&&... args) {
+
+  node* nd = tree.create_node(std::in_place, std::forward<Args>(args)...);
+  tree.link_node(nd, tree.find_insert_pos_equal(hint, nd->value));
+  return const_iterator(nd);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbmultiset<Key, Compare, Allocator, NodeSize>::const_iterator
+rbmultiset<Key, Compare, Allocator, NodeSize>::insert(node_type&& nh) {
+
+  return insert(cend(), std::move(nh));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbmultiset<Key, Compare, Allocator, NodeSize>::const_iterator
+rbmultiset<Key, Compare, Allocator, NodeSize>::insert(const_iterator hint, node_type&& nh) {
+
+  if (nh.empty()) {
+    return cend();
+  }
+
+  assert(*nh.alloc == tree.root.get_allocator());
+
+  auto pos = (hint == cend())? tree.find_insert_pos_equal(nh.value()) 
+                             : tree.find_insert_pos_equal(hint, nh.value());
+  node* nd = nh.release();
+  tree.link_node(nd, pos);
+  return const_iterator(nd);
+}
+
+/* Nodes are relinked if allocators are equal, otherwise values are moved. */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbmultiset<Key, Compare, Allocator, NodeSize>::merge(rbmultiset& source) {
+
+  if (&source == this) {
+    return;
+  }
+
+  const bool relink = (tree.root.get_allocator() == source.tree.root.get_allocator());
+
+  while (!source.empty()) {
+
+    auto nd = const_cast<node*>(static_cast<const node*>(source.tree.leftmost));
+    auto pos = tree.find_insert_pos_equal(nd->value);
+
+    if (relink) {
+      tree.link_node(source.tree.unlink_node(nd), pos);
+
+    } else {
+
+      tree.link_node(tree.create_node(std::move(nd->value)), pos);
+      source.tree.delete_node(nd);
+    }
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbmultiset<Key, Compare, Allocator, NodeSize>::size_type
+rbmultiset<Key, Compare, Allocator, NodeSize>::erase(const key_type& key) {
+
+  auto [first, last] = equal_range(key);
+  size_type erased = static_cast<size_type>(tree.distance(first, last));
+
+  tree.erase(first, last);
+  return erased;
+}
+
+}; /* namespace RBTREE */
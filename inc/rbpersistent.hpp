@@ -0,0 +1,915 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <tuple>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <initializer_list>
+
+#include "rbtree.hpp"
+
+namespace RBTREE {
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+class rbpersistent;
+
+namespace DETAIL {
+
+/*
+ * Node of the persistent tree. Nodes are never changed after creation
+ * and are shared between versions of the tree, so there are no parent
+ * pointers and threads - node could have many parents.
+ */
+template <typename Key, typename Size>
+struct persistent_node {
+
+  using key_type  = Key;
+  using size_type = Size;
+
+  /* Children are reference-counted, reference counts are atomic. */
+  using link = std::shared_ptr<const persistent_node>;
+
+  link left;
+  link right;
+
+  size_type size;
+  bool black;
+
+  key_type value;
+
+  template <typename K>
+  persistent_node(link lft, K&& key, bool is_black, link rgt)
+  : left(std::move(lft)),
+    right(std::move(rgt)),
+    size(1 + subtree_size(left.get()) + subtree_size(right.get())),
+    black(is_black),
+    value(std::forward<K>(key)) {}
+
+  static size_type subtree_size(const persistent_node* nd) noexcept {
+    return (nd != nullptr)? nd->size : 0;
+  }
+
+  static bool is_red(const persistent_node* nd) noexcept { return (nd != nullptr && !nd->black); }
+};
+
+/*
+ * Iterator of the persistent tree. Since nodes have no parent pointers,
+ * path from the root to the current node is kept in the iterator.
+ * Empty path means end iterator.
+ */
+template <typename Node>
+class persistent_iter {
+
+  using node = Node;
+  using size_type = typename node::size_type;
+
+  /* Height of a red-black tree is at most twice its black height. */
+  static constexpr std::size_t max_depth = 2 * std::numeric_limits<size_type>::digits;
+
+  const node* root_ = nullptr;
+  std::array<const node*, max_depth> path_;
+  std::size_t depth_ = 0;
+
+  const node* top() const { return path_[depth_ - 1]; }
+
+  /* Push given node and its leftmost (rightmost) descendants to the path. */
+  void push_leftmost(const node* nd) {
+
+    for (; nd != nullptr; nd = nd->left.get()) {
+      path_[depth_++] = nd;
+    }
+  }
+
+  void push_rightmost(const node* nd) {
+
+    for (; nd != nullptr; nd = nd->right.get()) {
+      path_[depth_++] = nd;
+    }
+  }
+
+public:
+
+  using iterator_category = std::bidirectional_iterator_tag;
+  using difference_type   = std::ptrdiff_t;
+  using value_type        = typename node::key_type;
+  using pointer           = const value_type*;
+  using reference         = const value_type&;
+
+  persistent_iter() noexcept = default;
+
+  explicit persistent_iter(const node* root) noexcept
+  : root_(root) {}
+
+  reference operator*() const { return top()->value; }
+  pointer operator->() const { return &top()->value; }
+
+  persistent_iter& operator++();
+  persistent_iter& operator--();
+
+  persistent_iter operator++(int) { auto temp(*this); operator++(); return temp; }
+  persistent_iter operator--(int) { auto temp(*this); operator--(); return temp; }
+
+  /* Number of elements preceding the current one, computed from the path. */
+  size_type rank() const;
+
+  friend bool operator==(const persistent_iter& lhs, const persistent_iter& rhs) {
+
+    return (lhs.depth_ == 0 || rhs.depth_ == 0)? (lhs.depth_ == rhs.depth_)
+                                               : (lhs.top() == rhs.top());
+  }
+
+  template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+  friend class ::RBTREE::rbpersistent;
+
+  template <typename N>
+  friend class persistent_reverse_iter;
+};
+
+/*
+ * Reverse iterator of the persistent tree. Unlike std::reverse_iterator, 
+ * it is kept at the element itself, so dereference does not copy the path.
+ * Iterator at the end position is the reverse end.
+ */
+template <typename Node>
+class persistent_reverse_iter {
+
+  persistent_iter<Node> it_;
+
+public:
+
+  using iterator_category = std::bidirectional_iterator_tag;
+  using difference_type   = std::ptrdiff_t;
+  using value_type        = typename persistent_iter<Node>::value_type;
+  using pointer           = typename persistent_iter<Node>::pointer;
+  using reference         = typename persistent_iter<Node>::reference;
+
+  persistent_reverse_iter() noexcept = default;
+
+  explicit persistent_reverse_iter(const persistent_iter<Node>& it) noexcept
+  : it_(it) {}
+
+  reference operator*() const { return *it_; }
+  pointer operator->() const { return it_.operator->(); }
+
+  persistent_reverse_iter& operator++() { --it_; return *this; }
+  persistent_reverse_iter& operator--();
+
+  persistent_reverse_iter operator++(int) { auto temp(*this); operator++(); return temp; }
+  persistent_reverse_iter operator--(int) { auto temp(*this); operator--(); return temp; }
+
+  /* Iterator to the element following the current one, as std::reverse_iterator::base(). */
+  persistent_iter<Node> base() const;
+
+  friend bool operator==(const persistent_reverse_iter& lhs, const persistent_reverse_iter& rhs) {
+    return (lhs.it_ == rhs.it_);
+  }
+};
+
+template <typename Node>
+persistent_iter<Node>& persistent_iter<Node>::operator++() {
+
+  const node* right = top()->right.get();
+  if (right != nullptr) {
+
+    push_leftmost(right);
+    return *this;
+  }
+
+  /* Climb while current node is a right child. */
+  while (depth_ > 1 && path_[depth_ - 2]->right.get() == top()) {
+    --depth_;
+  }
+
+  --depth_;
+  return *this;
+}
+
+template <typename Node>
+persistent_iter<Node>& persistent_iter<Node>::operator--() {
+
+  if (depth_ == 0) {
+
+    push_rightmost(root_);
+    return *this;
+  }
+
+  const node* left = top()->left.get();
+  if (left != nullptr) {
+
+    push_rightmost(left);
+    return *this;
+  }
+
+  while (depth_ > 1 && path_[depth_ - 2]->left.get() == top()) {
+    --depth_;
+  }
+
+  --depth_;
+  return *this;
+}
+
+template <typename Node>
+persistent_reverse_iter<Node>& persistent_reverse_iter<Node>::operator--() {
+
+  if (it_.depth_ == 0) {
+
+    it_.push_leftmost(it_.root_);
+    return *this;
+  }
+
+  ++it_;
+  return *this;
+}
+
+template <typename Node>
+persistent_iter<Node> persistent_reverse_iter<Node>::base() const {
+
+  persistent_iter<Node> it(it_);
+
+  if (it.depth_ == 0) {
+    it.push_leftmost(it.root_);
+  } else {
+    ++it;
+  }
+
+  return it;
+}
+
+template <typename Node>
+typename persistent_iter<Node>::size_type persistent_iter<Node>::rank() const {
+
+  if (depth_ == 0) {
+    return node::subtree_size(root_);
+  }
+
+  size_type rank = node::subtree_size(top()->left.get());
+
+  for (std::size_t i = 1; i < depth_; ++i) {
+    if (path_[i - 1]->right.get() == path_[i]) {
+      rank += node::subtree_size(path_[i - 1]->left.get()) + 1;
+    }
+  }
+
+  return rank;
+}
+
+}; /* namespace DETAIL */
+
+/*
+ * Persistent red-black tree. Updates copy only nodes on the paths they touch,
+ * O(log n) per update, and share the rest with previous versions.
+ * Copying the tree (and taking a snapshot) is O(1).
+ * Insertion and erasure are built on split and join of immutable subtrees.
+ *
+ * Snapshot could be read by other threads while the source is modified,
+ * since shared nodes are never changed. Node is freed by the thread
+ * dropping the last reference to it, so allocator should be thread-safe then.
+ * Iterators are invalidated by modifications of the tree they were taken from,
+ * but iterators of snapshots are not.
+ */
+template <typename Key, typename Compare = std::less<Key>,
+                        typename Allocator = std::allocator<Key>,
+                        typename NodeSize = std::size_t>
+class rbpersistent {
+
+public:
+
+  using key_type        = Key;
+  using value_type      = Key;
+  using size_type       = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using key_compare     = Compare;
+  using allocator_type  = Allocator;
+
+  using const_reference = const key_type&;
+  using const_pointer   = const key_type*;
+
+private:
+
+  using node = dtl::persistent_node<key_type, NodeSize>;
+  using link = typename node::link;
+
+  /* Allocator rebound to node type, control blocks are allocated with it as well. */
+  using node_allocator_type = typename std::allocator_traits<Allocator>::template rebind_alloc<node>;
+
+  link root;
+  [[no_unique_address]] node_allocator_type alloc;
+  Compare cmp;
+
+public:
+
+  /* Bidirectional iterator. */
+  using const_iterator         = dtl::persistent_iter<node>;
+  using const_reverse_iterator = dtl::persistent_reverse_iter<node>;
+
+  /* Default ctor. */
+  rbpersistent(const Compare& compare = Compare(), const Allocator& allocator = Allocator())
+  : alloc(allocator), cmp(compare) {}
+
+  explicit rbpersistent(const Allocator& allocator)
+  : rbpersistent(Compare(), allocator) {}
+
+  /* Ctor from range defined by two iterators. */
+  template <typename InputIt>
+  rbpersistent(InputIt first, InputIt last, const Compare& compare = Compare(),
+                                            const Allocator& allocator = Allocator())
+  : rbpersistent(compare, allocator) {
+
+    for (; first != last; ++first) {
+      insert(*first);
+    }
+  }
+
+  /* Ctor from sorted range without equivalent elements. Tree is built in linear time. */
+  template <typename ForwardIt>
+  rbpersistent(sorted_unique_t, ForwardIt first, ForwardIt last, const Compare& compare = Compare(),
+                                                                 const Allocator& allocator = Allocator())
+  : rbpersistent(compare, allocator) {
+
+    assert(std::adjacent_find(first, last, [this](const key_type& lhs, const key_type& rhs) {
+      return !cmp(lhs, rhs);
+    }) == last);
+
+    build_sorted(first, static_cast<size_type>(std::distance(first, last)));
+  }
+
+  rbpersistent(std::initializer_list<key_type> init, const Compare& compare = Compare(),
+                                                     const Allocator& allocator = Allocator())
+  : rbpersistent(init.begin(), init.end(), compare, allocator) {}
+
+  /* Copy shares all nodes with the source. O(1). */
+  rbpersistent(const rbpersistent& that) = default;
+  rbpersistent(rbpersistent&& that) noexcept = default;
+
+  rbpersistent& operator=(const rbpersistent& that) = default;
+  rbpersistent& operator=(rbpersistent&& that) noexcept = default;
+
+  /* Snapshot of the current version, not affected by later updates of this tree. O(1). */
+  rbpersistent snapshot() const { return *this; }
+
+  /* Returns copy of the allocator associated with the tree. */
+  allocator_type get_allocator() const noexcept { return allocator_type(alloc); }
+
+  /* Iterators. */
+  const_iterator cbegin() const;
+  const_iterator begin()  const { return cbegin(); }
+
+  const_reverse_iterator crbegin() const { return const_reverse_iterator(std::prev(cend())); }
+  const_reverse_iterator rbegin()  const { return crbegin(); }
+
+  const_iterator cend() const { return const_iterator(root.get()); }
+  const_iterator end()  const { return cend(); }
+
+  const_reverse_iterator crend() const { return const_reverse_iterator(cend()); }
+  const_reverse_iterator rend()  const { return crend(); }
+
+  /* Checks whether the container is empty */
+  bool empty() const { return (root == nullptr); }
+  /* Returns the number of elements */
+  size_type size() const { return node::subtree_size(root.get()); }
+
+  /* Clear contents of the tree. Nodes shared with snapshots stay alive. */
+  void clear() noexcept { root.reset(); }
+
+  /* Insertion. Returns whether element was inserted. Copies O(log n) nodes. */
+  bool insert(const key_type& key) { return emplace(key); }
+  bool insert(key_type&& key) { return emplace(std::move(key)); }
+
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last) {
+
+    for (; first != last; ++first) {
+      insert(*first);
+    }
+  }
+
+  void insert(std::initializer_list<key_type> init) { insert(init.begin(), init.end()); }
+
+  /* Erase element with given key. Returns number of erased elements. Copies O(log n) nodes. */
+  size_type erase(const key_type& key);
+
+  /* Swap contents of two trees. */
+  void swap(rbpersistent& that) noexcept;
+
+  /* Find element with key equivalent to a given argument. */
+  const_iterator find(const key_type& key) const;
+  bool contains(const key_type& key) const { return (find(key) != cend()); }
+
+  /* Returns an iterator to the first element not less than the given key */
+  const_iterator lower_bound(const key_type& key) const;
+
+  /* Returns an iterator to the first element greater than the given key */
+  const_iterator upper_bound(const key_type& key) const;
+
+  /* Order statistics in O(log n), see RBTREE::rbtree. */
+  const_iterator select(size_type index) const;
+  size_type rank(const_iterator pos) const { return pos.rank(); }
+  size_type less_than(const key_type& key) const;
+
+  /* Number of elements in range [lo, hi). */
+  size_type count_range(const key_type& lo, const key_type& hi) const {
+    return (cmp(lo, hi))? less_than(hi) - less_than(lo) : 0;
+  }
+
+  /* Distance between positions of two keys, see RBTREE::rbtree. */
+  difference_type distance(const key_type& first, const key_type& second) const {
+    return static_cast<difference_type>(less_than(second)) - static_cast<difference_type>(less_than(first));
+  }
+
+  /* Returns the function that compares keys. */
+  key_compare key_comp() const { return cmp; }
+
+  /* Validate red-black properties and subtree sizes of the tree. */
+  bool debug_validate() const;
+
+private:
+
+  /* Subtree with given black height, its root could be red. */
+  struct piece_t {
+
+    link root;
+    size_type bh = 0;
+  };
+
+  template <typename K>
+  link make_node(link left, K&& key, bool black, link right) const {
+    return std::allocate_shared<node>(alloc, std::move(left), std::forward<K>(key), black, std::move(right));
+  }
+
+  template <typename K>
+  bool emplace(K&& key);
+
+  /* Black height of the tree. */
+  size_type black_height() const;
+
+  /* Copy of the piece with black root. */
+  piece_t blacken(piece_t piece) const;
+
+  /* Result of join_right() or join_left() as a piece: red root with red child is repainted. */
+  piece_t joined_piece(link joined, size_type bh) const;
+
+  /*
+   * Join pieces and element 'key' lying between them into a single piece.
+   * Only nodes on the spine of the taller piece are copied.
+   */
+  template <typename K>
+  piece_t join(piece_t lhs, K&& key, piece_t rhs) const;
+
+  /* Join pieces without middle element, greatest element of 'lhs' is used as a middle one. */
+  piece_t join(piece_t lhs, piece_t rhs) const;
+
+  /*
+   * Descend along the right spine of 'subtree' with black height 'bh' to the black node
+   * with black height of 'rhs' and put there a red node. Root of 'rhs' should be black.
+   * Returned subtree could have red root with red right child.
+   */
+  template <typename K>
+  link join_right(const link& subtree, size_type bh, K&& key, const piece_t& rhs) const;
+
+  template <typename K>
+  link join_left(const piece_t& lhs, K&& key, const link& subtree, size_type bh) const;
+
+  /* Split subtree into elements less than 'key', equivalent element (if any) and greater elements. */
+  std::tuple<piece_t, link, piece_t> split(const link& subtree, size_type bh, const key_type& key) const;
+
+  /* Split greatest element off the subtree. */
+  std::pair<piece_t, link> split_last(const link& subtree, size_type bh) const;
+
+  template <typename ForwardIt>
+  void build_sorted(ForwardIt first, size_type count);
+
+  template <typename ForwardIt>
+  link build_sorted_subtree(ForwardIt& it, size_type count, size_type depth, size_type red_depth) const;
+
+  /* Returns black height of valid subtree, or nothing. */
+  bool debug_validate_subtree(const node* subtree, size_type& bh) const;
+};
+
+/* Equality comparison between two trees. */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool operator==(const rbpersistent<Key, Compare, Allocator, NodeSize>& lhs,
+                const rbpersistent<Key, Compare, Allocator, NodeSize>& rhs) {
+
+  return (lhs.size() == rhs.size())
+       && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::const_iterator
+rbpersistent<Key, Compare, Allocator, NodeSize>::cbegin() const {
+
+  const_iterator it(root.get());
+  it.push_leftmost(root.get());
+  return it;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbpersistent<Key, Compare, Allocator, NodeSize>::swap(rbpersistent& that) noexcept {
+
+  using std::swap;
+
+  swap(root, that.root);
+  swap(cmp, that.cmp);
+
+  if constexpr (std::allocator_traits<node_allocator_type>::propagate_on_container_swap::value) {
+    swap(alloc, that.alloc);
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::const_iterator
+rbpersistent<Key, Compare, Allocator, NodeSize>::find(const key_type& key) const {
+
+  auto it = lower_bound(key);
+  return (it == cend() || cmp(key, *it))? cend() : it;
+}
+
+/* Path is cut back to the last node, at which descent went left. */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::const_iterator
+rbpersistent<Key, Compare, Allocator, NodeSize>::lower_bound(const key_type& key) const {
+
+  const_iterator it(root.get());
+  std::size_t found = 0;
+
+  for (const node* cur = root.get(); cur != nullptr; ) {
+
+    it.path_[it.depth_++] = cur;
+
+    if (cmp(cur->value, key)) {
+      cur = cur->right.get();
+    } else {
+
+      found = it.depth_;
+      cur = cur->left.get();
+    }
+  }
+
+  it.depth_ = found;
+  return it;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::const_iterator
+rbpersistent<Key, Compare, Allocator, NodeSize>::upper_bound(const key_type& key) const {
+
+  const_iterator it(root.get());
+  std::size_t found = 0;
+
+  for (const node* cur = root.get(); cur != nullptr; ) {
+
+    it.path_[it.depth_++] = cur;
+
+    if (!cmp(key, cur->value)) {
+      cur = cur->right.get();
+    } else {
+
+      found = it.depth_;
+      cur = cur->left.get();
+    }
+  }
+
+  it.depth_ = found;
+  return it;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::const_iterator
+rbpersistent<Key, Compare, Allocator, NodeSize>::select(size_type index) const {
+
+  const_iterator it(root.get());
+  if (index >= size()) {
+    return it;
+  }
+
+  const node* cur = root.get();
+
+  while (true) {
+
+    it.path_[it.depth_++] = cur;
+    size_type left_size = node::subtree_size(cur->left.get());
+
+    if (index < left_size) {
+      cur = cur->left.get();
+
+    } else if (index > left_size) {
+
+      index -= left_size + 1;
+      cur = cur->right.get();
+
+    } else {
+      return it;
+    }
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::size_type
+rbpersistent<Key, Compare, Allocator, NodeSize>::less_than(const key_type& key) const {
+
+  size_type less = 0;
+
+  for (const node* cur = root.get(); cur != nullptr; ) {
+
+    if (cmp(cur->value, key)) {
+
+      less += node::subtree_size(cur->left.get()) + 1;
+      cur = cur->right.get();
+
+    } else {
+      cur = cur->left.get();
+    }
+  }
+
+  return less;
+}
+
+/* Element is inserted by splitting the tree by its key and joining parts back with new node. */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+bool rbpersistent<Key, Compare, Allocator, NodeSize>::emplace(K&& key) {
+
+  if (contains(key)) {
+    return false;
+  }
+
+  auto [lhs, equiv, rhs] = split(root, black_height(), key);
+  assert(equiv == nullptr);
+
+  root = join(std::move(lhs), std::forward<K>(key), std::move(rhs)).root;
+
+  assert(debug_validate());
+  return true;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::size_type
+rbpersistent<Key, Compare, Allocator, NodeSize>::erase(const key_type& key) {
+
+  if (!contains(key)) {
+    return 0;
+  }
+
+  auto [lhs, equiv, rhs] = split(root, black_height(), key);
+  assert(equiv != nullptr);
+
+  root = join(std::move(lhs), std::move(rhs)).root;
+
+  assert(debug_validate());
+  return 1;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::size_type
+rbpersistent<Key, Compare, Allocator, NodeSize>::black_height() const {
+
+  size_type bh = 0;
+
+  for (const node* cur = root.get(); cur != nullptr; cur = cur->left.get()) {
+    bh += (cur->black)? 1 : 0;
+  }
+
+  return bh;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::piece_t
+rbpersistent<Key, Compare, Allocator, NodeSize>::blacken(piece_t piece) const {
+
+  if (!node::is_red(piece.root.get())) {
+    return piece;
+  }
+
+  const node* nd = piece.root.get();
+  return piece_t{make_node(nd->left, nd->value, true, nd->right), piece.bh + 1};
+}
+
+/*
+ * Functional version of join used by RBTREE::rbtree: taller piece is descended,
+ * new red node is placed there, red-red violations are fixed by rotations on the way back.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::piece_t
+rbpersistent<Key, Compare, Allocator, NodeSize>::join(piece_t lhs, K&& key, piece_t rhs) const {
+
+  if (lhs.bh > rhs.bh) {
+    rhs = blacken(std::move(rhs));
+  } else if (lhs.bh < rhs.bh) {
+    lhs = blacken(std::move(lhs));
+  }
+
+  if (lhs.bh == rhs.bh) {
+
+    bool black = node::is_red(lhs.root.get()) || node::is_red(rhs.root.get());
+    return piece_t{make_node(std::move(lhs.root), std::forward<K>(key), black, std::move(rhs.root)),
+                   lhs.bh + ((black)? 1 : 0)};
+  }
+
+  if (lhs.bh > rhs.bh) {
+
+    return joined_piece(join_right(lhs.root, lhs.bh, std::forward<K>(key), rhs), lhs.bh);
+  }
+
+  return joined_piece(join_left(lhs, std::forward<K>(key), rhs.root, rhs.bh), rhs.bh);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::piece_t
+rbpersistent<Key, Compare, Allocator, NodeSize>::joined_piece(link joined, size_type bh) const {
+
+  const node* nd = joined.get();
+  if (node::is_red(nd) && (node::is_red(nd->left.get()) || node::is_red(nd->right.get()))) {
+    return blacken(piece_t{std::move(joined), bh});
+  }
+
+  return piece_t{std::move(joined), bh};
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::piece_t
+rbpersistent<Key, Compare, Allocator, NodeSize>::join(piece_t lhs, piece_t rhs) const {
+
+  if (lhs.root == nullptr) {
+    return rhs;
+  }
+
+  if (rhs.root == nullptr) {
+    return lhs;
+  }
+
+  auto [rest, last] = split_last(lhs.root, lhs.bh);
+  return join(std::move(rest), last->value, std::move(rhs));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::link
+rbpersistent<Key, Compare, Allocator, NodeSize>::join_right(const link& subtree, size_type bh, K&& key, const piece_t& rhs) const {
+
+  if (!node::is_red(subtree.get()) && bh == rhs.bh) {
+    return make_node(subtree, std::forward<K>(key), false, rhs.root);
+  }
+
+  const node* nd = subtree.get();
+  link right = join_right(nd->right, bh - ((nd->black)? 1 : 0), std::forward<K>(key), rhs);
+
+  /* Red right child with red right child under black node - rotate left. */
+  if (nd->black && node::is_red(right.get()) && node::is_red(right->right.get())) {
+
+    const node* red = right->right.get();
+    return make_node(make_node(nd->left, nd->value, true, right->left), right->value, false,
+                     make_node(red->left, red->value, true, red->right));
+  }
+
+  return make_node(nd->left, nd->value, nd->black, std::move(right));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::link
+rbpersistent<Key, Compare, Allocator, NodeSize>::join_left(const piece_t& lhs, K&& key, const link& subtree, size_type bh) const {
+
+  if (!node::is_red(subtree.get()) && bh == lhs.bh) {
+    return make_node(lhs.root, std::forward<K>(key), false, subtree);
+  }
+
+  const node* nd = subtree.get();
+  link left = join_left(lhs, std::forward<K>(key), nd->left, bh - ((nd->black)? 1 : 0));
+
+  if (nd->black && node::is_red(left.get()) && node::is_red(left->left.get())) {
+
+    const node* red = left->left.get();
+    return make_node(make_node(red->left, red->value, true, red->right), left->value, false,
+                     make_node(left->right, nd->value, true, nd->right));
+  }
+
+  return make_node(std::move(left), nd->value, nd->black, nd->right);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::tuple<typename rbpersistent<Key, Compare, Allocator, NodeSize>::piece_t,
+           typename rbpersistent<Key, Compare, Allocator, NodeSize>::link,
+           typename rbpersistent<Key, Compare, Allocator, NodeSize>::piece_t>
+rbpersistent<Key, Compare, Allocator, NodeSize>::split(const link& subtree, size_type bh, const key_type& key) const {
+
+  if (subtree == nullptr) {
+    return {};
+  }
+
+  const node* nd = subtree.get();
+  size_type child_bh = bh - ((nd->black)? 1 : 0);
+
+  if (cmp(key, nd->value)) {
+
+    auto [lo, equiv, hi] = split(nd->left, child_bh, key);
+    return {std::move(lo), std::move(equiv), join(std::move(hi), nd->value, piece_t{nd->right, child_bh})};
+  }
+
+  if (cmp(nd->value, key)) {
+
+    auto [lo, equiv, hi] = split(nd->right, child_bh, key);
+    return {join(piece_t{nd->left, child_bh}, nd->value, std::move(lo)), std::move(equiv), std::move(hi)};
+  }
+
+  return {piece_t{nd->left, child_bh}, subtree, piece_t{nd->right, child_bh}};
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::pair<typename rbpersistent<Key, Compare, Allocator, NodeSize>::piece_t,
+          typename rbpersistent<Key, Compare, Allocator, NodeSize>::link>
+rbpersistent<Key, Compare, Allocator, NodeSize>::split_last(const link& subtree, size_type bh) const {
+
+  const node* nd = subtree.get();
+  size_type child_bh = bh - ((nd->black)? 1 : 0);
+
+  if (nd->right == nullptr) {
+    return {piece_t{nd->left, child_bh}, subtree};
+  }
+
+  auto [rest, last] = split_last(nd->right, child_bh);
+  return {join(piece_t{nd->left, child_bh}, nd->value, std::move(rest)), std::move(last)};
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename ForwardIt>
+void rbpersistent<Key, Compare, Allocator, NodeSize>::build_sorted(ForwardIt first, size_type count) {
+
+  if (count == 0) {
+    return;
+  }
+
+  /* All levels are full except the deepest one, its nodes are painted red. */
+  size_type red_depth = static_cast<size_type>(std::bit_width(count)) - 1;
+  root = blacken(piece_t{build_sorted_subtree(first, count, 0, red_depth)}).root;
+
+  assert(debug_validate());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename ForwardIt>
+typename rbpersistent<Key, Compare, Allocator, NodeSize>::link
+rbpersistent<Key, Compare, Allocator, NodeSize>::build_sorted_subtree(ForwardIt& it, size_type count,
+                                                                      size_type depth, size_type red_depth) const {
+
+  if (count == 0) {
+    return nullptr;
+  }
+
+  size_type left_count = count / 2;
+  link left = build_sorted_subtree(it, left_count, depth + 1, red_depth);
+
+  const key_type& key = *it;
+  ++it;
+
+  link right = build_sorted_subtree(it, count - left_count - 1, depth + 1, red_depth);
+  return make_node(std::move(left), key, (depth != red_depth), std::move(right));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool rbpersistent<Key, Compare, Allocator, NodeSize>::debug_validate() const {
+
+  size_type bh = 0;
+  return debug_validate_subtree(root.get(), bh);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool rbpersistent<Key, Compare, Allocator, NodeSize>::debug_validate_subtree(const node* subtree, size_type& bh) const {
+
+  if (subtree == nullptr) {
+
+    bh = 0;
+    return true;
+  }
+
+  const node* left  = subtree->left.get();
+  const node* right = subtree->right.get();
+
+  size_type left_bh = 0, right_bh = 0;
+  if (!debug_validate_subtree(left, left_bh) || !debug_validate_subtree(right, right_bh)) {
+    return false;
+  }
+
+  bool valid = (left_bh == right_bh)
+            && (subtree->black || (!node::is_red(left) && !node::is_red(right)))
+            && (subtree->size == 1 + node::subtree_size(left) + node::subtree_size(right))
+            && (left  == nullptr || cmp(left->value, subtree->value))
+            && (right == nullptr || cmp(subtree->value, right->value));
+
+  if (!valid) {
+    std::cerr << "Debug validation: persistent node " << subtree << " is invalid. \n";
+  }
+
+  bh = left_bh + ((subtree->black)? 1 : 0);
+  return valid;
+}
+
+}; /* namespace RBTREE */
@@ -3,11 +3,17 @@
 #include <ios>
 #include <new>
 #include <stack>
+#include <span>
+#include <array>
 #include <tuple>
+#include <future>
+#include <thread>
+#include <vector>
 #include <string>
 #include <cstdio>
 #include <fstream>
 #include <sstream>
+#include <bit>
 #include <cstdint>
 #include <cstdlib>
 #include <cassert>
@@ -15,28 +21,90 @@
 #include <cstddef>
 #include <iterator>
 #include <iostream>
+#include <algorithm>
 #include <stdexcept>
+#include <system_error>
 #include <functional>
 #include <type_traits>
 #include <initializer_list>
 
 #include "node.hpp"
 #include "iter.hpp"
+#include "pool.hpp"
+#include "node_handle.hpp"
 
 namespace RBTREE {
 
 namespace dtl = DETAIL;
 
-/* Red-black tree. */
-template <typename Key, typename Compare = std::less<Key>> 
+namespace DETAIL {
+
+/* Comparators allowing lookup by keys of types other than the key type. */
+template <typename Compare>
+concept transparent_compare = requires { typename Compare::is_transparent; };
+
+/* Prefetch memory for reading, no-op if compiler has no builtin for it. */
+inline void prefetch(const void* ptr) noexcept {
+
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(ptr, 0, 3);
+#else
+  (void)ptr;
+#endif
+}
+
+}; /* namespace DETAIL */
+
+/* 
+ * Tag showing that range passed to the tree is sorted 
+ * according to the comparator and contains no equivalent elements.
+ */
+struct sorted_unique_t { explicit sorted_unique_t() = default; };
+inline constexpr sorted_unique_t sorted_unique{};
+
+/* Tag selecting parallel versions of operations. */
+struct parallel_t { explicit parallel_t() = default; };
+inline constexpr parallel_t parallel{};
+
+/* Order of nodes in memory after compaction. */
+enum class node_layout { IN_ORDER, VAN_EMDE_BOAS };
+
+template <typename Key, typename T, typename Compare, typename Allocator, typename NodeSize>
+class rbmap;
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+class rbmultiset;
+
+/* 
+ * Red-black tree. 
+ * 'NodeSize' is type used for storing subtree sizes in nodes - 
+ * std::uint32_t could be used for more compact nodes, if tree 
+ * never holds more than 2^32 - 1 elements.
+ */
+template <typename Key, typename Compare = std::less<Key>, 
+                        typename Allocator = std::allocator<Key>,
+                        typename NodeSize = std::size_t> 
 class rbtree {
 
+  /* Map is built on top of the tree and uses its node linking machinery. */
+  template <typename MKey, typename T, typename MCompare, typename MAllocator, typename MNodeSize>
+  friend class rbmap;
+
+  /* Trees with other comparators are merged by relinking their nodes. */
+  template <typename TKey, typename TCompare, typename TAllocator, typename TNodeSize>
+  friend class rbtree;
+
+  /* Multiset links equivalent elements using the same machinery. */
+  template <typename MKey, typename MCompare, typename MAllocator, typename MNodeSize>
+  friend class rbmultiset;
+
 public:
 
   using key_type        = Key;
   using size_type       = std::size_t;
   using difference_type = std::ptrdiff_t;
   using key_compare     = Compare;    
+  using allocator_type  = Allocator;
 
   using const_reference = const key_type&;
   using const_pointer = const key_type*;
@@ -44,21 +112,19 @@ public:
 private:
 
   /* Node structure */
-  using node = dtl::node_t<key_type>;
+  using node = dtl::node_t<key_type, NodeSize>;
   
-  /* Subtree copy struct type. */
-  using subtree_copy_type = typename node::subtree_copy_t;
-
-  /* Subtree info struct type. */
-  using subtree_info_type = typename node::subtree_info_t;
-
   /* Static end node type used for implementing post-end iterator */
   using end_node = typename node::end_node;
 
-  /* Root. */
-  using root_type = dtl::root<node>;
+  /* Root. Owns nodes of the tree and allocator rebound to node type. */
+  using root_type = dtl::root<node, Allocator>;
   root_type root;
 
+  /* Node allocator type and its traits. */
+  using node_allocator_type = typename root_type::allocator_type;
+  using node_alloc_traits   = typename root_type::alloc_traits;
+
   /* Dynamically updated leftmost node pointer for constant complexity begin(). */
   end_node* leftmost = root.end_node_ptr();
   /* Dynamically updated rightmost node pointer for constant complexity iter incrementing. */
@@ -79,36 +145,87 @@ public:
   using const_iterator = dtl::const_iter<node>;
   using const_reverse_iterator = std::reverse_iterator<const_iterator>;
 
+  /* Node handle, owning extracted node, and result of its insertion. */
+  using node_type = dtl::node_handle<node, Allocator>;
+  using insert_return_type = dtl::insert_return<const_iterator, node_type>;
+
   /* Default ctor. */
-  rbtree(const Compare& compare = Compare()) 
-  noexcept(std::is_nothrow_copy_constructible_v<Compare>)
-  : cmp(compare) {}
+  rbtree(const Compare& compare = Compare(), const Allocator& alloc = Allocator()) 
+  noexcept(std::is_nothrow_copy_constructible_v<Compare> &&
+           std::is_nothrow_copy_constructible_v<Allocator>)
+  : root(nullptr, node_allocator_type(alloc)), 
+    cmp(compare) {}
+
+  explicit rbtree(const Allocator& alloc)
+  noexcept(std::is_nothrow_default_constructible_v<Compare> &&
+           std::is_nothrow_copy_constructible_v<Allocator>)
+  : rbtree(Compare(), alloc) {}
 
   /* Ctor from range defined by two iterators. */
   template <typename InputIt>
-  rbtree(InputIt first, InputIt last, const Compare& compare = Compare())
-  : cmp(compare) {
+  rbtree(InputIt first, InputIt last, const Compare& compare = Compare(), 
+                                      const Allocator& alloc = Allocator())
+  : rbtree(compare, alloc) {
 
-    for (; first != last; ++first) {
-      insert(*first);
+    insert(first, last);
+  }
+
+  template <typename InputIt>
+  rbtree(InputIt first, InputIt last, const Allocator& alloc)
+  : rbtree(first, last, Compare(), alloc) {}
+
+  /* 
+   * Ctor from sorted range without equivalent elements. 
+   * For forward iterators tree is built in linear time.
+   */
+  template <typename InputIt>
+  rbtree(sorted_unique_t, InputIt first, InputIt last, const Compare& compare = Compare(), 
+                                                       const Allocator& alloc = Allocator())
+  : rbtree(compare, alloc) {
+
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, 
+                                    typename std::iterator_traits<InputIt>::iterator_category>) {
+      build_sorted(first, static_cast<size_type>(std::distance(first, last)));
+    } else {
+      insert(first, last);
     }
   }
 
-  rbtree(std::initializer_list<key_type> init, const Compare& compare = Compare())
-  : rbtree(init.begin(), init.end(), compare) {}
+  template <typename InputIt>
+  rbtree(sorted_unique_t tag, InputIt first, InputIt last, const Allocator& alloc)
+  : rbtree(tag, first, last, Compare(), alloc) {}
+
+  rbtree(std::initializer_list<key_type> init, const Compare& compare = Compare(), 
+                                               const Allocator& alloc = Allocator())
+  : rbtree(init.begin(), init.end(), compare, alloc) {}
+
+  rbtree(std::initializer_list<key_type> init, const Allocator& alloc)
+  : rbtree(init.begin(), init.end(), Compare(), alloc) {}
 
   /* Copy ctor. */
   rbtree(const rbtree& that)
-  : cmp(that.cmp) {
+  : rbtree(that, node_alloc_traits::select_on_container_copy_construction(
+                                                   that.root.get_allocator())) {}
 
-    subtree_copy_type copy;
-    that.copy_subtree(copy, that.root.get());
-    
-    root = std::move(copy.root);
-    leftmost = (copy.leftmost)? copy.leftmost : end_node_ptr();
-    rightmost = (copy.rightmost)? copy.rightmost : end_node_ptr();
+  /* Copy ctor with allocator. */
+  rbtree(const rbtree& that, const Allocator& alloc)
+  : root(nullptr, node_allocator_type(alloc)),
+    cmp(that.cmp) {
+
+    copy_nodes(that, 1);
+  }
+
+  /* 
+   * Parallel copy ctor. Subtrees below the top levels of the tree are copied 
+   * by up to 'threads' tasks (0 - number of hardware threads). Nodes are allocated 
+   * concurrently only if allocator is always equal, otherwise copy is made by the calling thread.
+   */
+  rbtree(parallel_t, const rbtree& that, std::size_t threads = 0)
+  : root(nullptr, node_alloc_traits::select_on_container_copy_construction(
+                                                   that.root.get_allocator())),
+    cmp(that.cmp) {
 
-    node::stitch_subtree(root.get());
+    copy_nodes(that, threads);
   }
 
   /* Move ctor. */
@@ -123,23 +240,63 @@ public:
     relink_side_nodes(that);
   }
 
+  /* 
+   * Move ctor with allocator. If allocators are not equal, 
+   * elements are moved one by one into nodes allocated with 'alloc'.
+   */
+  rbtree(rbtree&& that, const Allocator& alloc)
+  : rbtree(that.cmp, alloc) {
+
+    if (root.get_allocator() == that.root.get_allocator()) {
+      swap_contents(that);
+    } else {
+      move_elements(that);
+    }
+  }
+
   /* Copy assignment. */
   rbtree& operator=(const rbtree& that) {
 
     if (this == &that)
       return *this;
 
-    auto temp{that};
-    swap(temp);
+    constexpr bool propagate = node_alloc_traits::propagate_on_container_copy_assignment::value;
+    rbtree temp(that, (propagate)? Allocator(that.root.get_allocator()) : get_allocator());
+
+    if constexpr (propagate) {
+
+      clear();
+      root.get_allocator() = that.root.get_allocator();
+    }
+
+    swap_contents(temp);
+    cmp = that.cmp;
 
     return *this;
   }
 
   /* Move assignment. */
   rbtree& operator=(rbtree&& that) 
-  noexcept(noexcept(swap(std::declval<rbtree&>()))) {
+  noexcept(node_alloc_traits::propagate_on_container_move_assignment::value ||
+           node_alloc_traits::is_always_equal::value) {
+
+    if constexpr (node_alloc_traits::propagate_on_container_move_assignment::value) {
+
+      clear();
+      root.get_allocator() = that.root.get_allocator();
+      swap_contents(that);
+
+    } else if (node_alloc_traits::is_always_equal::value 
+            || root.get_allocator() == that.root.get_allocator()) {
+      swap_contents(that);
 
-    swap(that);
+    } else {
+
+      clear();
+      move_elements(that);
+    }
+
+    std::swap(cmp, that.cmp);
     return *this;
   }
 
@@ -148,10 +305,29 @@ public:
   /* Insertion. */
   std::pair<const_iterator, bool> insert(key_type&& key);
   std::pair<const_iterator, bool> insert(const key_type& key);
+
+  /* 
+   * Insertion as close as possible to the position just prior to 'hint'.
+   * If hint is correct, no descent from the root is performed.
+   * Returns iterator to inserted element or to equivalent element already in the tree.
+   */
+  const_iterator insert(const_iterator hint, key_type&& key);
+  const_iterator insert(const_iterator hint, const key_type& key);
+
   template <typename InputIt>
   void insert(InputIt first, InputIt last);
   void insert(std::initializer_list<key_type> init);
 
+  /* 
+   * Merge sorted range of m elements into the tree in O(m log(n/m + 1)). Elements going 
+   * between the same neighbours are linked as one balanced subtree, sizes and colors 
+   * are fixed once per node on the paths to such places. Elements equivalent to present 
+   * ones are skipped. Unsorted range or one with equivalent elements is inserted 
+   * element by element. Returns number of inserted elements.
+   */
+  template <typename ForwardIt>
+  size_type insert_sorted(ForwardIt first, ForwardIt last);
+
   /* 
    * Emplacement - constructing element in-place. 
    * Args are forwarded to constructor of element.
@@ -159,6 +335,10 @@ public:
   template< class... Args >
   std::pair<const_iterator, bool> emplace( Args&&... args );
 
+  /* Emplacement using hint, see insert(hint, key) above. */
+  template< class... Args >
+  const_iterator emplace_hint(const_iterator hint, Args&&... args);
+
   /* 
    * Erasure - element pointed by a iterator, a range of elements
    * defined by two iterators and element with a specific key.
@@ -167,16 +347,81 @@ public:
   const_iterator erase(const_iterator first, const_iterator last);
   bool erase(const key_type& key);
 
-  /* Swap contents of two trees. No copying of elements are performed. */
+  /* 
+   * Unlink node from the tree and pass its ownership to node handle. 
+   * Node is neither deallocated nor copied. Empty handle is returned if there is no such key.
+   */
+  node_type extract(const_iterator pos);
+  node_type extract(const key_type& key);
+
+  /* 
+   * Link node owned by node handle. Allocator of the handle should be equal
+   * to the allocator of the tree. If equivalent element is present, node is 
+   * returned back in 'node' member of the result.
+   */
+  insert_return_type insert(node_type&& nh);
+  const_iterator insert(const_iterator hint, node_type&& nh);
+
+  /* 
+   * Move nodes, which keys are not present in this tree, from 'source'.
+   * Nodes are relinked if allocators are equal, otherwise values are moved.
+   */
+  template <typename Compare2>
+  void merge(rbtree<Key, Compare2, Allocator, NodeSize>& source);
+
+  template <typename Compare2>
+  void merge(rbtree<Key, Compare2, Allocator, NodeSize>&& source) { merge(source); }
+
+  /* 
+   * Split tree into elements less than 'key' and all the others in O(log n). 
+   * Nodes are relinked into the returned trees, this tree becomes empty.
+   */
+  std::pair<rbtree, rbtree> split(const key_type& key);
+
+  /* 
+   * Join two trees: all keys of 'lhs' should be less than 'key' (if given)
+   * and all keys of 'rhs'. Takes O(log n) if allocators of the trees are equal,
+   * otherwise elements of 'rhs' are moved one by one.
+   * Resulting tree uses comparator and allocator of 'lhs'.
+   */
+  static rbtree join(rbtree&& lhs, rbtree&& rhs);
+  static rbtree join(rbtree&& lhs, const key_type& key, rbtree&& rhs);
+  static rbtree join(rbtree&& lhs, key_type&& key, rbtree&& rhs);
+
+  /* 
+   * Set operations, result is kept in this tree. Based on split and join, 
+   * take O(m log(n/m + 1)) for trees of sizes m <= n. With 'threads' > 1 
+   * independent halves of the recursion are processed in parallel, 
+   * 0 means number of hardware threads. Nodes are freed by the calling
+   * thread after the parallel part is done, so allocator is not shared between threads.
+   */
+
+  /* Add elements of 'other' absent in this tree. Nodes of 'other' are relinked, it becomes empty. */
+  void union_with(rbtree&& other, std::size_t threads = 1);
+  void union_with(const rbtree& other, std::size_t threads = 1);
+
+  /* Keep only elements present in 'other'. */
+  void intersect_with(const rbtree& other, std::size_t threads = 1);
+
+  /* Erase elements present in 'other'. */
+  void difference_with(const rbtree& other, std::size_t threads = 1);
+
+  /* 
+   * Swap contents of two trees. No copying of elements are performed. 
+   * Allocators are swapped only if they propagate on container swap.
+   */
   void swap(rbtree& that) 
-  noexcept(std::is_nothrow_swappable_v<root_type> &&
-           std::is_nothrow_swappable_v<Compare>) {
+  noexcept(std::is_nothrow_swappable_v<Compare>) {
 
-    std::swap(root, that.root);
-    swap_side_nodes(that);
+    swap_contents(that);
     std::swap(cmp, that.cmp);
   }
 
+  /* Returns copy of the allocator associated with the tree. */
+  allocator_type get_allocator() const noexcept { 
+    return allocator_type(root.get_allocator()); 
+  }
+
   /* Find element with key equivalent to a given argument. */
   const_iterator find (const key_type& key) const {
     return const_iterator(find_equiv_node(root.get(), key));
@@ -186,6 +431,20 @@ public:
     return (find_equiv_node(root.get(), key) != end_node_ptr());
   }
 
+  /* 
+   * Heterogeneous lookup overloads. Available only if comparator 
+   * is transparent, so probe is compared with keys without conversion.
+   */
+  template <typename K> requires dtl::transparent_compare<Compare>
+  const_iterator find(const K& key) const {
+    return const_iterator(find_equiv_node(root.get(), key));
+  }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  bool contains(const K& key) const {
+    return (find_equiv_node(root.get(), key) != end_node_ptr());
+  }
+
   /* 
    * NOTE: no 'iterator' member type defined since 
    * no elements should be changed. Changing keys of elements
@@ -218,14 +477,75 @@ public:
   /* Clear contents of the tree. */
   void clear() noexcept;
 
+  /* 
+   * Clear contents of the tree, freeing subtrees in up to 'threads' tasks 
+   * (0 - number of hardware threads). Same restriction on allocator as for parallel copy applies.
+   */
+  void clear(std::size_t threads) noexcept;
+
+  /* 
+   * Move nodes into fresh memory allocated in given order: in-order for scans, 
+   * van Emde Boas (recursively split by levels) for lookups. Shape of the tree is kept, 
+   * iterators are invalidated. Allocators with 'allocate_sequential' (pool_allocator) 
+   * place the nodes in one contiguous block, others get them allocated back-to-back.
+   */
+  void compact(node_layout layout = node_layout::IN_ORDER);
+
+  /* 
+   * Incremental in-order compaction: move at most 'budget' nodes starting from 
+   * the one with index 'from'. Returns index to continue from, size() when the pass is done.
+   */
+  size_type compact_step(size_type from, size_type budget);
+
   /* Distance between two nodes, defined by keys. */
 
   difference_type distance(const_iterator first, const_iterator second) const {
-    return static_cast<difference_type>(less_than(*second) - less_than(*first));
+    return static_cast<difference_type>(rank_node(second.node_ptr_)) 
+         - static_cast<difference_type>(rank_node(first.node_ptr_));
   }
 
   difference_type distance(const key_type& first, const key_type& second) const {
-    return static_cast<difference_type>(less_than(second) - less_than(first));
+    return distance_keys(first, second);
+  }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  difference_type distance(const K& first, const K& second) const {
+    return distance_keys(first, second);
+  }
+
+  /* Number of elements less than the given key. Computed in a single descent. */
+  size_type less_than(const key_type& key) const {
+    return less_than_in(root.get(), key);
+  }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  size_type less_than(const K& key) const {
+    return less_than_in(root.get(), key);
+  }
+
+  /* 
+   * Number of elements in range [lo, hi). Both bounds are searched 
+   * in one descent until their paths diverge.
+   */
+  size_type count_range(const key_type& lo, const key_type& hi) const {
+    return count_range_keys(lo, hi);
+  }
+
+  template <typename K> requires dtl::transparent_compare<Compare>
+  size_type count_range(const K& lo, const K& hi) const {
+    return count_range_keys(lo, hi);
+  }
+
+  /* 
+   * Order statistics: iterator to the element with given index in sorted order
+   * (past-end iterator if index is out of range) and index of the element.
+   */
+  const_iterator select(size_type index) const {
+    return (index < size())? const_iterator(node::select_desc(root.get(), index)) : cend();
+  }
+
+  size_type rank(const_iterator pos) const {
+    return rank_node(pos.node_ptr_);
   }
 
   /* Returns an iterator to the first element not less than the given key */
@@ -233,16 +553,84 @@ public:
     return const_iterator(find_lower_bound_node(root.get(), key));
   }
 
+  template <typename K> requires dtl::transparent_compare<Compare>
+  const_iterator lower_bound(const K& key) const {
+    return const_iterator(find_lower_bound_node(root.get(), key));
+  }
+
   /* Returns an iterator to the first element greater than the given key */
   const_iterator upper_bound(const Key& key) const {
     return const_iterator(find_upper_bound_node(root.get(), key));
   }
 
+  template <typename K> requires dtl::transparent_compare<Compare>
+  const_iterator upper_bound(const K& key) const {
+    return const_iterator(find_upper_bound_node(root.get(), key));
+  }
+
+  /* 
+   * Visit elements in range [lo, hi) in order. Number of elements is found 
+   * from subtree sizes, so elements are not compared with 'hi'. Before 'f' is called, 
+   * successor is found by descent into the right subtree or by thread, and right 
+   * children of the nodes on that descent, visited later, are prefetched.
+   */
+  template <typename F>
+  void for_each_in_range(const key_type& lo, const key_type& hi, F f) const {
+
+    size_type count = count_range_keys(lo, hi);
+    if (count != 0) {
+      visit_nodes(static_cast<const node*>(find_lower_bound_node(root.get(), lo)), count, f);
+    }
+  }
+
+  /* Copy elements in range [lo, hi) to 'out'. */
+  template <typename OutputIt>
+  OutputIt copy_range(const key_type& lo, const key_type& hi, OutputIt out) const {
+
+    for_each_in_range(lo, hi, [&](const key_type& key) { *out = key; ++out; });
+    return out;
+  }
+
+  /* Copy elements in range [lo, hi) to vector of the exact size. */
+  std::vector<key_type> copy_range(const key_type& lo, const key_type& hi) const {
+
+    std::vector<key_type> keys;
+    size_type count = count_range_keys(lo, hi);
+
+    if (count != 0) {
+
+      keys.reserve(count);
+      visit_nodes(static_cast<const node*>(find_lower_bound_node(root.get(), lo)), count, 
+                  [&](const key_type& key) { keys.push_back(key); });
+    }
+
+    return keys;
+  }
+
+  /* 
+   * Batched lookups: result for 'keys[i]' is written to 'out[i]', 'out' should be 
+   * at least as long as 'keys'. Descents for 'batch_lanes' keys are advanced in lock-step, 
+   * prefetching the next node of each, so that their cache misses overlap.
+   */
+  void lower_bound_many(std::span<const key_type> keys, std::span<const_iterator> out) const;
+  void find_many(std::span<const key_type> keys, std::span<const_iterator> out) const;
+  void contains_many(std::span<const key_type> keys, std::span<bool> out) const;
+  void less_than_many(std::span<const key_type> keys, std::span<size_type> out) const;
+
+  /* 'out[i]' is distance(first[i], second[i]). */
+  void distance_many(std::span<const key_type> first, std::span<const key_type> second, 
+                     std::span<difference_type> out) const;
+
   /* Returns range of elements matching a specific key */
   std::pair<const_iterator,const_iterator> equal_range(const Key& key) const {
     return std::make_pair(lower_bound(key), upper_bound(key));
   }
 
+  template <typename K> requires dtl::transparent_compare<Compare>
+  std::pair<const_iterator,const_iterator> equal_range(const K& key) const {
+    return std::make_pair(lower_bound(key), upper_bound(key));
+  }
+
   /* Returns the function that compares keys. */
   key_compare key_comp() const { return cmp; }
 
@@ -255,6 +643,23 @@ public:
 
 private:
 
+  /* Swap nodes (and allocators, if they propagate) of two trees. */
+  void swap_contents(rbtree& that) noexcept;
+
+  /* Move elements of 'that' one by one into nodes allocated by this tree. */
+  void move_elements(rbtree& that);
+
+  /* Allocate and construct node using allocator of the tree. */
+  template <typename... Args>
+  node* create_node(Args&&... args) {
+    return node::create(root.get_allocator(), std::forward<Args>(args)...);
+  }
+
+  /* Destroy and deallocate node using allocator of the tree. */
+  void destroy_node(node* nd) noexcept {
+    node::destroy(root.get_allocator(), nd);
+  }
+
   /* Helpers for swapping leftmost and rightmost node pointers. */
   void swap_side_nodes(rbtree& that) noexcept;
   void swap_leftmost(rbtree& that) noexcept;
@@ -265,8 +670,48 @@ private:
   void relink_leftmost(const rbtree& that) noexcept;
   void relink_rightmost(const rbtree& that) noexcept;
 
-  /* Make a copy of subtree. */
-  void copy_subtree(subtree_copy_type& subtree_copy, const node* subtree) const;
+  /* 
+   * Nodes are allocated and freed by several threads only with allocators, 
+   * which are always equal: those are supposed to be stateless and thread-safe.
+   */
+  static constexpr bool concurrent_alloc = node_alloc_traits::is_always_equal::value;
+
+  /* Copy nodes of 'that' into the empty tree. Threads are stitched on the way, in the same pass. */
+  void copy_nodes(const rbtree& that, std::size_t threads);
+
+  /* 
+   * Copy children of 'src' under its linked copy 'dst'. Extreme nodes of the subtree 
+   * are stitched to 'pred' and 'succ'. Halves are copied in parallel up to recursion depth 'depth'.
+   */
+  void copy_children(const node* src, node* dst, end_node* pred, end_node* succ, size_type depth);
+
+  /* Free subtree, halves are freed in parallel up to recursion depth 'depth'. */
+  void free_nodes(node* subtree, size_type depth) noexcept;
+
+  /* Number of levels in subtree. */
+  static size_type subtree_height(const node* subtree) {
+    return (subtree == nullptr)? 0 : 1 + std::max(subtree_height(subtree->get_left()), subtree_height(subtree->get_right()));
+  }
+
+  /* Append nodes of subtree with given number of levels in van Emde Boas order. */
+  static void veb_order(node* subtree, size_type height, std::vector<node*>& order);
+
+  /* Move nodes into memory allocated in order they are listed. */
+  void relocate_nodes(const std::vector<node*>& order);
+
+  /* Call 'f' for 'count' elements starting from 'first'. */
+  template <typename F>
+  static void visit_nodes(const node* first, size_type count, F&& f);
+
+  /* Number of descents advanced together by batched lookups. */
+  static constexpr std::size_t batch_lanes = 16;
+
+  /* 
+   * Find lower bounds of 'keys' in lock-step, calling 'visit(i, bound, less)' for each key. 
+   * Number of smaller elements 'less' is counted only if 'CountLess' is set.
+   */
+  template <bool CountLess, typename Visit>
+  void lower_bound_batch(std::span<const key_type> keys, Visit visit) const;
 
   /* Equivalence relationship deduced from compare function. */
   bool equiv(const key_type& lhs, const key_type& rhs) const {
@@ -283,16 +728,185 @@ private:
   void right_rotate(node* subtree_root);
   void left_rotate (node* subtree_root);
 
+  /* 
+   * Position for linking new node, found in a single descent: 
+   * parent to attach to and its side. If node with equivalent 
+   * key is present, 'equiv' points to it and no linking should be done.
+   */
+  struct insert_pos_t {
+
+    node* parent = nullptr;
+    bool on_right = false;
+    node* equiv  = nullptr;
+  };
+
+  /* Find position for inserting node with given key. */
+  template <typename K>
+  insert_pos_t find_insert_pos(const K& key);
+
+  /* Check whether range is sorted and contains no equivalent elements. */
+  template <typename ForwardIt>
+  bool is_sorted_unique(ForwardIt first, ForwardIt last) const;
+
+  /* 
+   * Build perfectly balanced tree from 'count' sorted unique elements 
+   * in linear time. Tree should be empty.
+   */
+  template <typename ForwardIt>
+  void build_sorted(ForwardIt first, size_type count);
+
+  /* 
+   * Build subtree from 'count' elements starting from 'it' in in-order, 
+   * range of detached nodes is linked as is. 
+   * Nodes on 'red_depth' level are painted red, others are black. 
+   * 'prev' is the last node built, used for stitching.
+   */
+  template <typename ForwardIt>
+  node* build_sorted_subtree(ForwardIt& it, size_type count, size_type depth, 
+                                            size_type red_depth, end_node*& prev);
+
+  /* Free subtree, not linked into the tree. */
+  void free_detached(node* subtree) noexcept;
+
+  /* 
+   * Find position for inserting node with given key just prior to 'hint'. 
+   * Falls back to descent from the root if the hint is wrong.
+   */
+  template <typename K>
+  insert_pos_t find_insert_pos(const_iterator hint, const K& key);
+
+  /* 
+   * Find position for inserting node with given key after all equivalent ones.
+   * Never reports equivalent node, used for storing duplicates.
+   */
+  template <typename K>
+  insert_pos_t find_insert_pos_equal(const K& key);
+
+  /* Same as above, but position just prior to 'hint' is checked first. */
+  template <typename K>
+  insert_pos_t find_insert_pos_equal(const_iterator hint, const K& key);
+
+  /* Insert node using hint. Node is destroyed if equivalent one is present. */
+  const_iterator insert_node(const_iterator hint, node* inserting);
+
   /* Insert node and perform fixes to maintain invariants of the RB-tree. */
   bool insert_node(node* inserting);  
-  /* Insert node into a tree just like in a regular BST tree. */
-  bool insert_node_bst(node* subtree_root, node* inserting);
+  /* Link node at position found with find_insert_pos() and rebalance the tree. */
+  void link_node(node* inserting, const insert_pos_t& pos);
   
-  /* Fixing functions used on insertion. */
-  void insert_rb_fix(node* inserted);
+  /* 
+   * Fixing functions used on insertion. 
+   * insert_rb_fix() returns true if root was repainted black, 
+   * i.e. black height of the tree grew.
+   */
+  bool insert_rb_fix(node* inserted);
   node* parent_grand_recolor(node* parent);
   node* uncle_parent_grand_recolor(node* uncle, node* parent);
 
+  /* Ranges of at most this length are erased element by element. */
+  static constexpr size_type short_range_erase_max = 32;
+
+  /* Subproblem size, starting from which halves of the recursion are run in parallel. */
+  static constexpr size_type parallel_grain = size_type{1} << 14;
+
+  /* 
+   * Subtree being split or joined: root is black, 'bh' is number of 
+   * black nodes on path from the root to any leaf. While pieces are processed,
+   * threads of their extreme nodes are not maintained. 
+   * Extreme nodes 'min' and 'max' are optional: if they are tracked, 
+   * joins stitch them to the middle node, so pieces could be joined 
+   * in order different from the original one.
+   */
+  struct piece_t {
+
+    node* root = nullptr;
+    size_type bh = 0;
+
+    node* min = nullptr;
+    node* max = nullptr;
+  };
+
+  /* Black height of the tree. */
+  size_type black_height() const;
+
+  /* Subtree with given black height as a piece. Red root is repainted black. */
+  static piece_t make_piece(node* subtree, size_type bh, node* min = nullptr, 
+                                                         node* max = nullptr);
+
+  /* Unlink all nodes of the tree as a piece with tracked extremes. Tree becomes empty. */
+  piece_t release_piece();
+
+  /* 
+   * Split subtree with black height 'bh' into its first 'index' elements,
+   * detached element with given index and the rest. Index should be less 
+   * than size of the subtree. Root of the tree is used as a scratch while joining.
+   */
+  std::tuple<piece_t, node*, piece_t> split_pieces(node* subtree, size_type bh, size_type index);
+
+  /* 
+   * Join pieces with detached node 'mid' between them: 'mid' is linked into 
+   * the inner spine of the piece with greater black height at the node with 
+   * black height of another one, then red-red violation is fixed as on insertion. 
+   * Takes O(difference of black heights + 1).
+   */
+  piece_t join_pieces(piece_t lhs, node* mid, piece_t rhs);
+
+  /* Join pieces with tracked extremes, greatest element of 'lhs' is used as a middle one. */
+  piece_t join_pieces(piece_t lhs, piece_t rhs);
+
+  /* 
+   * Split piece with tracked extremes into elements less than 'key', 
+   * detached equivalent element (nullptr if there is none) and greater elements. 
+   * Extremes of the parts are tracked.
+   */
+  std::tuple<piece_t, node*, piece_t> split_pieces(piece_t piece, const key_type& key);
+  std::tuple<piece_t, node*, piece_t> split_pieces(node* subtree, size_type bh, const key_type& key, 
+                                                   node*& pred, node*& succ);
+
+  /* 
+   * Merge detached nodes [first, last), sorted and unique, into subtree with black height 'bh'. 
+   * Extremes of the result are tracked only if they are merged nodes, threads of the 
+   * untouched extremes are valid. Nodes equivalent to present ones are destroyed.
+   */
+  piece_t merge_nodes(node* subtree, size_type bh, node* const* first, node* const* last);
+
+  /* 
+   * Recursive set operations on pieces with tracked extremes. 
+   * Roots of detached subtrees to be destroyed are appended to 'garbage'.
+   * Halves of operations are spawned as tasks up to recursion depth 'depth'.
+   */
+  piece_t union_pieces(piece_t lhs, piece_t rhs, std::vector<node*>& garbage, size_type depth);
+  piece_t intersect_pieces(piece_t lhs, const node* rhs, std::vector<node*>& garbage, size_type depth);
+  piece_t difference_pieces(piece_t lhs, const node* rhs, std::vector<node*>& garbage, size_type depth);
+
+  /* 
+   * Run two independent halves of a set operation. If 'spawn' is set, the first one 
+   * is run as a separate task on a scratch tree, since root of the tree is used as a scratch by joins.
+   */
+  template <typename LeftOp, typename RightOp>
+  std::pair<piece_t, piece_t> fork_pieces(bool spawn, LeftOp left_op, RightOp right_op, 
+                                          std::vector<node*>& garbage);
+
+  /* Run two independent operations, the first one as a separate task if 'spawn' is set. */
+  template <typename LeftOp, typename RightOp>
+  static void fork(bool spawn, LeftOp left_op, RightOp right_op);
+
+  /* Recursion depth, up to which tasks are spawned for given number of threads. */
+  static size_type parallel_depth(std::size_t threads);
+
+  /* Link piece as contents of the empty tree and stitch its extreme nodes to the end node. */
+  void adopt_piece(piece_t piece);
+
+  /* Destroy all nodes of the piece. Tree should be empty, its root is used as a scratch. */
+  void free_piece(piece_t piece) noexcept;
+  void free_pieces(const std::vector<node*>& roots) noexcept;
+
+  /* Join trees with equal allocators and detached node 'mid' between them. */
+  static rbtree join_with(rbtree&& lhs, node* mid, rbtree&& rhs);
+
+  /* Unlink given node from the tree, node is not destroyed and could be linked again. */
+  node* unlink_node(node* unlinking);
+
   /* Delete given node and perform fixes to maintain invariants of the RB-tree. */
   void delete_node(node* deleting);  
 
@@ -311,19 +925,46 @@ private:
   void  delete_rb_update_leftmost(node* z, node* x);
   void  delete_rb_update_rightmost(node* z, node* x);
 
-  /* Helper function for finding nodes. */
-  const end_node* find_equiv_node(const node* subtree_root, key_type key) const;
+  /* 
+   * Helper function for finding nodes. 
+   * 'K' is either key type or any type comparable with it by transparent comparator.
+   */
+  template <typename K>
+  const end_node* find_equiv_node(const node* subtree_root, const K& key) const;
 
-  const end_node* find_lower_bound_node(const node* subtree_root, key_type key) const;
-  const end_node* find_upper_bound_node(const node* subtree_root, key_type key) const;
+  template <typename K>
+  const end_node* find_lower_bound_node(const node* subtree_root, const K& key) const;
+  template <typename K>
+  const end_node* find_upper_bound_node(const node* subtree_root, const K& key) const;
   
   /* Increase subtree size for each node in route from nd to root by 1. */
   void incr_subtree_sizes(end_node* nd);
   /* Decrease subtree size for each node in route from nd to root by 1. */
   void decr_subtree_sizes(end_node* nd);
 
-  /* Get number of element smaller thatn given. */
-  size_type less_than(const key_type& key) const;
+  /* Get number of elements in subtree smaller than given key. */
+  template <typename K>
+  size_type less_than_in(const node* subtree_root, const K& key) const;
+
+  /* Get number of elements in subtree not greater than given key. */
+  template <typename K>
+  size_type not_greater_in(const node* subtree_root, const K& key) const;
+
+  /* 
+   * Number of elements equivalent to the key. Descent is done until the first 
+   * equivalent element, then both ends of the run are counted using subtree sizes.
+   */
+  template <typename K>
+  size_type count_equiv(const K& key) const;
+
+  /* Common implementation of distance() and count_range() for any probe type. */
+  template <typename K>
+  difference_type distance_keys(const K& first, const K& second) const;
+  template <typename K>
+  size_type count_range_keys(const K& lo, const K& hi) const;
+
+  /* Get number of elements preceding given node. For end node it is size of the tree. */
+  size_type rank_node(const end_node* nd) const;
 
   /* Validate tree - checks its rRB-properties. */
   bool debug_validate() const;
@@ -336,62 +977,83 @@ private:
                              const std::string& graph_name);
 }; 
 
+/* Red-black tree with nodes placed in slab arena. */
+template <typename Key, typename Compare = std::less<Key>>
+using pool_rbtree = rbtree<Key, Compare, pool_allocator<Key>>;
+
 /* Equality comparison between two trees. */
-template <typename Key, typename Compare>
-bool operator==(const rbtree<Key, Compare>& lhs, const rbtree<Key, Compare>& rhs) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool operator==(const rbtree<Key, Compare, Allocator, NodeSize>& lhs, const rbtree<Key, Compare, Allocator, NodeSize>& rhs) {
 
   return (lhs.size() == rhs.size()) 
        && std::equal(lhs.begin(), lhs.end(), rhs.begin());
 }
 
 /* Equality comparison betweeb tree and initilizer_list. */
-template <typename Key, typename Compare>
-bool operator==(const rbtree<Key, Compare>& lhs, const std::initializer_list<Key>& rhs) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool operator==(const rbtree<Key, Compare, Allocator, NodeSize>& lhs, const std::initializer_list<Key>& rhs) {
 
   return (lhs.size() == rhs.size()) 
        && std::equal(lhs.begin(), lhs.end(), rhs.begin());
 }
 
 /* Equality comparison betweeb tree and initilizer_list. */
-template <typename Key, typename Compare>
-bool operator==(const std::initializer_list<Key>& lhs, const rbtree<Key, Compare>& rhs) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool operator==(const std::initializer_list<Key>& lhs, const rbtree<Key, Compare, Allocator, NodeSize>& rhs) {
 
   return (lhs.size() == rhs.size()) 
        && std::equal(lhs.begin(), lhs.end(), rhs.begin());
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::swap_side_nodes(rbtree& that) noexcept {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::swap_contents(rbtree& that) noexcept {
 
-  swap_leftmost(that);
-  swap_rightmost(that);
+  root.swap(that.root);
+  swap_side_nodes(that);
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::swap_leftmost(rbtree& that) noexcept {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::move_elements(rbtree& that) {
 
-  std::swap(leftmost, that.leftmost);
-  relink_leftmost(that);
-  that.relink_leftmost(*this);
+  for (auto it = that.cbegin(), end = that.cend(); it != end; ++it) {
+    insert(cend(), std::move(const_cast<key_type&>(*it)));
+  }
+
+  that.clear();
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::swap_rightmost(rbtree& that) noexcept {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::swap_side_nodes(rbtree& that) noexcept {
+
+  swap_leftmost(that);
+  swap_rightmost(that);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::swap_leftmost(rbtree& that) noexcept {
+
+  std::swap(leftmost, that.leftmost);
+  relink_leftmost(that);
+  that.relink_leftmost(*this);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::swap_rightmost(rbtree& that) noexcept {
 
   std::swap(rightmost, that.rightmost);
   relink_rightmost(that);
   that.relink_rightmost(*this);
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::relink_side_nodes(const rbtree& that) noexcept {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::relink_side_nodes(const rbtree& that) noexcept {
 
   relink_leftmost(that);  
   relink_rightmost(that);  
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::relink_leftmost(const rbtree& that) noexcept {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::relink_leftmost(const rbtree& that) noexcept {
 
   if (leftmost == that.end_node_ptr()) {
     leftmost = end_node_ptr();
@@ -400,8 +1062,8 @@ void rbtree<Key, Compare>::relink_leftmost(const rbtree& that) noexcept {
   }
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::relink_rightmost(const rbtree& that) noexcept {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::relink_rightmost(const rbtree& that) noexcept {
 
   if (rightmost == that.end_node_ptr()) {
     rightmost = end_node_ptr();
@@ -410,149 +1072,1583 @@ void rbtree<Key, Compare>::relink_rightmost(const rbtree& that) noexcept {
   }
 }
 
-template <typename Key, typename Compare>
-std::pair<typename rbtree<Key, Compare>::const_iterator, bool>
-rbtree<Key, Compare>::insert(key_type&& key) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::pair<typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator, bool>
+rbtree<Key, Compare, Allocator, NodeSize>::insert(key_type&& key) {
   
-  if (find_equiv_node(root.get(), key) != end_node_ptr()) {
+  auto pos = find_insert_pos(key);
+  if (pos.equiv != nullptr) {
     return std::make_pair(cend(), false);
   } 
 
-  node* nd = new node(std::move(key));
-  insert_node(nd);
-  return std::make_pair(const_iterator(nd), true);
+  node* nd = create_node(std::move(key));
+  link_node(nd, pos);
+  return std::make_pair(const_iterator(nd), true);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::pair<typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator, bool>
+rbtree<Key, Compare, Allocator, NodeSize>::insert(const key_type& key) {
+
+  auto pos = find_insert_pos(key);
+  if (pos.equiv != nullptr) {
+    return std::make_pair(cend(), false);
+  }
+
+  node* nd = create_node(key);
+  link_node(nd, pos);
+  return std::make_pair(const_iterator(nd), true);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator
+rbtree<Key, Compare, Allocator, NodeSize>::insert(const_iterator hint, key_type&& key) {
+
+  auto pos = find_insert_pos(hint, key);
+  if (pos.equiv != nullptr) {
+    return const_iterator(pos.equiv);
+  }
+
+  node* nd = create_node(std::move(key));
+  link_node(nd, pos);
+  return const_iterator(nd);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator
+rbtree<Key, Compare, Allocator, NodeSize>::insert(const_iterator hint, const key_type& key) {
+
+  auto pos = find_insert_pos(hint, key);
+  if (pos.equiv != nullptr) {
+    return const_iterator(pos.equiv);
+  }
+
+  node* nd = create_node(key);
+  link_node(nd, pos);
+  return const_iterator(nd);
+}
+
+/* 
+ * Every element is inserted with end() as a hint, 
+ * so sorted ranges are inserted without descents from the root.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename InputIt>
+void rbtree<Key, Compare, Allocator, NodeSize>::insert(InputIt first, InputIt last) {
+
+  if constexpr (std::is_base_of_v<std::forward_iterator_tag, 
+                                  typename std::iterator_traits<InputIt>::iterator_category>) {
+    
+    if (empty() && is_sorted_unique(first, last)) {
+      
+      build_sorted(first, static_cast<size_type>(std::distance(first, last)));
+      return;
+    }
+  }
+
+  for (auto it = first; it != last; ++it) {
+    insert(cend(), *it);
+  }
+}
+
+/* 
+ * Nodes are created before the tree is changed, so that it is left intact if 
+ * construction throws. Merging itself only relinks nodes.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename ForwardIt>
+typename rbtree<Key, Compare, Allocator, NodeSize>::size_type 
+rbtree<Key, Compare, Allocator, NodeSize>::insert_sorted(ForwardIt first, ForwardIt last) {
+
+  size_type prev_size = size();
+
+  if (first == last) {
+    return 0;
+  }
+
+  if (empty() || !is_sorted_unique(first, last)) {
+
+    insert(first, last);
+    return size() - prev_size;
+  }
+
+  std::vector<node*> nodes;
+  nodes.reserve(static_cast<std::size_t>(std::distance(first, last)));
+
+  try {
+
+    for (; first != last; ++first) {
+      nodes.push_back(create_node(*first));
+    }
+
+  } catch (...) {
+
+    for (node* nd : nodes) {
+      destroy_node(nd);
+    }
+    throw;
+  }
+
+  piece_t piece = release_piece();
+  adopt_piece(merge_nodes(piece.root, piece.bh, nodes.data(), nodes.data() + nodes.size()));
+
+  assert(debug_validate());
+  return size() - prev_size;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::insert(std::initializer_list<key_type> init) {
+  insert(init.begin(), init.end());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template< class... Args >
+std::pair<typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator, bool> 
+rbtree<Key, Compare, Allocator, NodeSize>::emplace( Args&&... args ) {
+
+  node* nd = create_node(std::in_place, std::forward<Args>(args)...);
+  if (insert_node(nd)) {
+    return std::make_pair(const_iterator(nd), true);
+  }
+
+  destroy_node(nd);
+  return std::make_pair(cend(), false);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template< class... Args >
+typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator
+rbtree<Key, Compare, Allocator, NodeSize>::emplace_hint(const_iterator hint, Args&&... args) {
+
+  return insert_node(hint, create_node(std::in_place, std::forward<Args>(args)...));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator 
+rbtree<Key, Compare, Allocator, NodeSize>::erase(const_iterator pos) {
+
+  const_iterator next = std::next(pos);
+  delete_node(const_cast<node*>(static_cast<const node*>(pos.node_ptr_)));
+  return next;
+}
+
+/* 
+ * Range is cut out with two splits by index: the first element of the range
+ * and the rest of it are freed, 'last' is used to join remaining parts back.
+ * Takes O(log n + k), rebalancing is done only along split and join paths.
+ * Short ranges are erased element by element, which is cheaper for them.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator 
+rbtree<Key, Compare, Allocator, NodeSize>::erase(const_iterator first, const_iterator last) {
+
+  if (first == cbegin() && last == cend()) {
+
+    clear();
+    return cend();
+  }
+
+  size_type lo = rank(first);
+  size_type hi = (last == cend())? size() : rank(last);
+
+  if (hi - lo <= short_range_erase_max) {
+
+    while (first != last) {
+      first = erase(first);
+    }
+
+    return first;
+  }
+
+  auto [lhs, erased, rest] = split_pieces(root.get(), black_height(), lo);
+  root.set(nullptr);
+
+  auto lmax = node::get_rightmost_desc(lhs.root);
+  piece_t joined = lhs;
+
+  if (last == cend()) {
+    free_piece(rest);
+
+  } else {
+
+    auto [middle, mid, rhs] = split_pieces(rest.root, rest.bh, hi - lo - 1);
+    free_piece(middle);
+
+    joined = join_pieces(lhs, mid, rhs);
+
+    /* Neighbours of 'mid' and of the greatest remaining element before it were erased. */
+    if (!mid->has_left()) {
+      mid->stitch_left((lmax != nullptr)? static_cast<end_node*>(lmax) : end_node_ptr());
+    }
+
+    if (lmax != nullptr && !lmax->has_right()) {
+      lmax->stitch_right(mid);
+    }
+
+    if (lmax == nullptr) {
+      leftmost = mid;
+    }
+  }
+
+  destroy_node(erased);
+  root.set(joined.root);
+
+  /* Whole tree is never erased here, so the left part is not empty. */
+  if (last == cend()) {
+
+    lmax->stitch_right(end_node_ptr());
+    rightmost = lmax;
+  }
+
+  assert(debug_validate());
+  return last;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool rbtree<Key, Compare, Allocator, NodeSize>::erase(const key_type& key) {
+
+  const end_node* nd = find_equiv_node(root.get(), key);
+  if (nd == end_node_ptr()) {
+    return false;
+  }
+
+  delete_node(const_cast<node*>(static_cast<const node*>(nd)));
+  return true;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::node_type
+rbtree<Key, Compare, Allocator, NodeSize>::extract(const_iterator pos) {
+
+  node* nd = unlink_node(const_cast<node*>(static_cast<const node*>(pos.node_ptr_)));
+  return node_type(nd, root.get_allocator());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::node_type
+rbtree<Key, Compare, Allocator, NodeSize>::extract(const key_type& key) {
+
+  const end_node* nd = find_equiv_node(root.get(), key);
+  if (nd == end_node_ptr()) {
+    return node_type();
+  }
+
+  return extract(const_iterator(nd));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::insert_return_type
+rbtree<Key, Compare, Allocator, NodeSize>::insert(node_type&& nh) {
+
+  if (nh.empty()) {
+    return insert_return_type{cend(), false, node_type()};
+  }
+
+  assert(*nh.alloc == root.get_allocator());
+
+  auto pos = find_insert_pos(nh.value());
+  if (pos.equiv != nullptr) {
+    return insert_return_type{const_iterator(pos.equiv), false, std::move(nh)};
+  }
+
+  node* nd = nh.release();
+  link_node(nd, pos);
+  return insert_return_type{const_iterator(nd), true, node_type()};
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator
+rbtree<Key, Compare, Allocator, NodeSize>::insert(const_iterator hint, node_type&& nh) {
+
+  if (nh.empty()) {
+    return cend();
+  }
+
+  assert(*nh.alloc == root.get_allocator());
+
+  auto pos = find_insert_pos(hint, nh.value());
+  if (pos.equiv != nullptr) {
+    return const_iterator(pos.equiv);
+  }
+
+  node* nd = nh.release();
+  link_node(nd, pos);
+  return const_iterator(nd);
+}
+
+/* 
+ * Unlinking node does not invalidate iterators to other nodes, 
+ * so source is traversed once.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename Compare2>
+void rbtree<Key, Compare, Allocator, NodeSize>::merge(rbtree<Key, Compare2, Allocator, NodeSize>& source) {
+
+  if (static_cast<const void*>(&source) == static_cast<const void*>(this)) {
+    return;
+  }
+
+  const bool relink = (root.get_allocator() == source.root.get_allocator());
+
+  for (auto it = source.cbegin(), end_it = source.cend(); it != end_it;) {
+
+    auto nd = const_cast<node*>(static_cast<const node*>(it.node_ptr_));
+    ++it;
+
+    auto pos = find_insert_pos(nd->value);
+    if (pos.equiv != nullptr) {
+      continue;
+    }
+
+    if (relink) {
+      link_node(source.unlink_node(nd), pos);
+
+    } else {
+      
+      link_node(create_node(std::move(nd->value)), pos);
+      source.delete_node(nd);
+    }
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::pair<rbtree<Key, Compare, Allocator, NodeSize>, rbtree<Key, Compare, Allocator, NodeSize>>
+rbtree<Key, Compare, Allocator, NodeSize>::split(const key_type& key) {
+
+  std::pair<rbtree, rbtree> parts{rbtree(cmp, get_allocator()), rbtree(cmp, get_allocator())};
+  size_type index = less_than(key);
+
+  if (index == 0) {
+    parts.second.swap_contents(*this);
+
+  } else if (index == size()) {
+    parts.first.swap_contents(*this);
+
+  } else {
+
+    auto [lo, nd, hi] = split_pieces(root.get(), black_height(), index);
+    hi = join_pieces(piece_t{}, nd, hi);
+
+    root.set(nullptr);
+    leftmost = rightmost = end_node_ptr();
+
+    parts.first.adopt_piece(lo);
+    parts.second.adopt_piece(hi);
+  }
+
+  assert(parts.first.debug_validate() && parts.second.debug_validate());
+  return parts;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+rbtree<Key, Compare, Allocator, NodeSize> 
+rbtree<Key, Compare, Allocator, NodeSize>::join(rbtree&& lhs, rbtree&& rhs) {
+
+  rbtree res(std::move(lhs));
+
+  if (rhs.empty()) {
+    return res;
+  }
+
+  if (!(res.root.get_allocator() == rhs.root.get_allocator())) {
+
+    res.move_elements(rhs);
+    return res;
+  }
+
+  if (res.empty()) {
+
+    res.swap_contents(rhs);
+    return res;
+  }
+
+  /* The least element of 'rhs' is used as a middle one. */
+  node* mid = rhs.unlink_node(static_cast<node*>(rhs.leftmost));
+  return join_with(std::move(res), mid, std::move(rhs));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+rbtree<Key, Compare, Allocator, NodeSize> 
+rbtree<Key, Compare, Allocator, NodeSize>::join(rbtree&& lhs, const key_type& key, rbtree&& rhs) {
+
+  rbtree res(std::move(lhs));
+  node* mid = res.create_node(key);
+
+  if (!(res.root.get_allocator() == rhs.root.get_allocator())) {
+
+    res.link_node(mid, res.find_insert_pos(res.cend(), mid->value));
+    res.move_elements(rhs);
+    return res;
+  }
+
+  return join_with(std::move(res), mid, std::move(rhs));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+rbtree<Key, Compare, Allocator, NodeSize> 
+rbtree<Key, Compare, Allocator, NodeSize>::join(rbtree&& lhs, key_type&& key, rbtree&& rhs) {
+
+  rbtree res(std::move(lhs));
+  node* mid = res.create_node(std::move(key));
+
+  if (!(res.root.get_allocator() == rhs.root.get_allocator())) {
+
+    res.link_node(mid, res.find_insert_pos(res.cend(), mid->value));
+    res.move_elements(rhs);
+    return res;
+  }
+
+  return join_with(std::move(res), mid, std::move(rhs));
+}
+
+/* 
+ * Only threads at the boundaries of the joined trees are changed: 
+ * threads of inner nodes point to the same neighbours as before.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+rbtree<Key, Compare, Allocator, NodeSize> 
+rbtree<Key, Compare, Allocator, NodeSize>::join_with(rbtree&& lhs, node* mid, rbtree&& rhs) {
+
+  rbtree res(std::move(lhs));
+
+  assert(res.empty() || res.cmp(static_cast<node*>(res.rightmost)->value, mid->value));
+  assert(rhs.empty() || res.cmp(mid->value, static_cast<node*>(rhs.leftmost)->value));
+
+  bool lhs_empty = res.empty();
+  bool rhs_empty = rhs.empty();
+
+  auto lmin = static_cast<node*>(res.leftmost);
+  auto lmax = static_cast<node*>(res.rightmost);
+  auto rmin = static_cast<node*>(rhs.leftmost);
+  auto rmax = static_cast<node*>(rhs.rightmost);
+
+  piece_t lhs_piece{res.root.get(), res.black_height()};
+  piece_t rhs_piece{rhs.root.get(), rhs.black_height()};
+
+  rhs.root.set(nullptr);
+  rhs.leftmost = rhs.rightmost = rhs.end_node_ptr();
+
+  piece_t joined = res.join_pieces(lhs_piece, mid, rhs_piece);
+  res.root.set(joined.root);
+
+  if (!lhs_empty && !lmax->has_right()) {
+    lmax->stitch_right(mid);
+  }
+
+  if (!rhs_empty && !rmin->has_left()) {
+    rmin->stitch_left(mid);
+  }
+
+  res.leftmost  = (lhs_empty)? mid : lmin;
+  res.rightmost = (rhs_empty)? mid : rmax;
+
+  res.leftmost->stitch_left(res.end_node_ptr());
+  static_cast<node*>(res.rightmost)->stitch_right(res.end_node_ptr());
+
+  assert(res.debug_validate());
+  return res;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::size_type 
+rbtree<Key, Compare, Allocator, NodeSize>::black_height() const {
+
+  size_type bh = 0;
+
+  for (const node* cur = root.get(); cur != nullptr; cur = cur->get_left()) {
+    if (cur->is_black()) {
+      ++bh;
+    }
+  }
+
+  return bh;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t 
+rbtree<Key, Compare, Allocator, NodeSize>::make_piece(node* subtree, size_type bh, node* min, node* max) {
+
+  if (subtree == nullptr) {
+    return piece_t{};
+  }
+
+  if (subtree->is_red()) {
+
+    subtree->paint(node::color::BLACK);
+    ++bh;
+  }
+
+  return piece_t{subtree, bh, min, max};
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t 
+rbtree<Key, Compare, Allocator, NodeSize>::release_piece() {
+
+  if (empty()) {
+    return piece_t{};
+  }
+
+  piece_t piece{root.get(), black_height(), static_cast<node*>(leftmost), 
+                                            static_cast<node*>(rightmost)};
+  root.set(nullptr);
+  leftmost = rightmost = end_node_ptr();
+
+  return piece;
+}
+
+/* 
+ * Subtree is split along the path to the element with given index: 
+ * parts hanging off the path are joined into two pieces. 
+ * Costs of joins telescope, so split takes O(log n) in total.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::tuple<typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t, 
+           typename rbtree<Key, Compare, Allocator, NodeSize>::node*,
+           typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t>
+rbtree<Key, Compare, Allocator, NodeSize>::split_pieces(node* subtree, size_type bh, size_type index) {
+
+  assert(index < node::subtree_size(subtree));
+
+  size_type child_bh = bh - ((subtree->is_black())? 1 : 0);
+
+  node* left  = subtree->get_left();
+  node* right = subtree->get_right();
+  size_type left_size = node::subtree_size(left);
+
+  if (left_size < index) {
+
+    auto [lo, nd, hi] = split_pieces(right, child_bh, index - left_size - 1);
+    return {join_pieces(make_piece(left, child_bh), subtree, lo), nd, hi};
+  }
+
+  if (left_size > index) {
+
+    auto [lo, nd, hi] = split_pieces(left, child_bh, index);
+    return {lo, nd, join_pieces(hi, subtree, make_piece(right, child_bh))};
+  }
+
+  return {make_piece(left, child_bh), subtree, make_piece(right, child_bh)};
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t 
+rbtree<Key, Compare, Allocator, NodeSize>::join_pieces(piece_t lhs, node* mid, piece_t rhs) {
+
+  mid->detach();
+
+  if (lhs.max != nullptr) {
+    lhs.max->stitch_right(mid);
+  }
+
+  if (rhs.min != nullptr) {
+    rhs.min->stitch_left(mid);
+  }
+
+  node* min = (lhs.root != nullptr)? lhs.min : mid;
+  node* max = (rhs.root != nullptr)? rhs.max : mid;
+
+  if (lhs.bh == rhs.bh) {
+
+    if (lhs.root != nullptr) {
+      mid->tie_left(lhs.root);
+    } else {
+      mid->stitch_left(nullptr);
+    }
+
+    if (rhs.root != nullptr) {
+      mid->tie_right(rhs.root);
+    } else {
+      mid->stitch_right(nullptr);
+    }
+
+    mid->size = static_cast<typename node::size_type>(
+                1 + node::subtree_size(lhs.root) + node::subtree_size(rhs.root));
+    mid->paint(node::color::BLACK);
+
+    return piece_t{mid, lhs.bh + 1, min, max};
+  }
+
+  bool left_taller = (lhs.bh > rhs.bh);
+  const piece_t& taller  = (left_taller)? lhs : rhs;
+  const piece_t& shorter = (left_taller)? rhs : lhs;
+
+  /* Taller piece is linked as the tree, so that rotations on fixing could reach its root. */
+  root.set(taller.root);
+
+  node* parent = nullptr;
+  node* cur = taller.root;
+  size_type cur_bh = taller.bh;
+
+  while (cur != nullptr && !(cur->is_black() && cur_bh == shorter.bh)) {
+
+    if (cur->is_black()) {
+      --cur_bh;
+    }
+
+    parent = cur;
+    cur = (left_taller)? cur->get_right() : cur->get_left();
+  }
+
+  /* If 'cur' is a leaf, 'parent' is the extreme node of the taller piece - neighbour of 'mid'. */
+  if (left_taller) {
+
+    if (cur != nullptr) {
+      mid->tie_left(cur);
+    } else {
+      mid->stitch_left(parent);
+    }
+
+    if (rhs.root != nullptr) {
+      mid->tie_right(rhs.root);
+    } else {
+      mid->stitch_right(nullptr);
+    }
+
+    parent->tie_right(mid);
+
+  } else {
+
+    if (cur != nullptr) {
+      mid->tie_right(cur);
+    } else {
+      mid->stitch_right(parent);
+    }
+
+    if (lhs.root != nullptr) {
+      mid->tie_left(lhs.root);
+    } else {
+      mid->stitch_left(nullptr);
+    }
+
+    parent->tie_left(mid);
+  }
+
+  size_type added = 1 + node::subtree_size(shorter.root);
+  mid->size = static_cast<typename node::size_type>(added + node::subtree_size(cur));
+
+  for (node* nd = parent; ; nd = nd->parent()) {
+
+    nd->size += static_cast<typename node::size_type>(added);
+    if (is_root(nd)) {
+      break;
+    }
+  }
+
+  size_type bh = taller.bh + ((insert_rb_fix(mid))? 1 : 0);
+  return piece_t{root.get(), bh, min, max};
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t 
+rbtree<Key, Compare, Allocator, NodeSize>::join_pieces(piece_t lhs, piece_t rhs) {
+
+  if (rhs.root == nullptr) {
+    return lhs;
+  }
+
+  if (lhs.root == nullptr) {
+    return rhs;
+  }
+
+  /* Inner threads of the piece are valid, so predecessor of its greatest element is known. */
+  size_type lhs_size = node::subtree_size(lhs.root);
+  node* new_max = (lhs_size > 1)? static_cast<node*>(lhs.max->get_prev()) : nullptr;
+
+  auto [rest, max, none] = split_pieces(lhs.root, lhs.bh, lhs_size - 1);
+  assert(max == lhs.max && none.root == nullptr);
+
+  if (rest.root != nullptr) {
+
+    rest.min = lhs.min;
+    rest.max = new_max;
+  }
+
+  return join_pieces(rest, max, rhs);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::tuple<typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t, 
+           typename rbtree<Key, Compare, Allocator, NodeSize>::node*,
+           typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t>
+rbtree<Key, Compare, Allocator, NodeSize>::split_pieces(piece_t piece, const key_type& key) {
+
+  node* pred = nullptr;
+  node* succ = nullptr;
+
+  auto [lhs, equiv, rhs] = split_pieces(piece.root, piece.bh, key, pred, succ);
+
+  if (lhs.root != nullptr) {
+
+    lhs.min = piece.min;
+    lhs.max = pred;
+  }
+
+  if (rhs.root != nullptr) {
+
+    rhs.min = succ;
+    rhs.max = piece.max;
+  }
+
+  return {lhs, equiv, rhs};
+}
+
+/* 
+ * Same as split by index, but the path is chosen by key. Closest nodes 
+ * on both sides of the key are remembered on the way down.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::tuple<typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t, 
+           typename rbtree<Key, Compare, Allocator, NodeSize>::node*,
+           typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t>
+rbtree<Key, Compare, Allocator, NodeSize>::split_pieces(node* subtree, size_type bh, const key_type& key, node*& pred, node*& succ) {
+
+  if (subtree == nullptr) {
+    return {};
+  }
+
+  size_type child_bh = bh - ((subtree->is_black())? 1 : 0);
+
+  node* left  = subtree->get_left();
+  node* right = subtree->get_right();
+
+  if (cmp(key, subtree->value)) {
+
+    succ = subtree;
+    auto [lo, equiv, hi] = split_pieces(left, child_bh, key, pred, succ);
+    return {lo, equiv, join_pieces(hi, subtree, make_piece(right, child_bh))};
+  }
+
+  if (cmp(subtree->value, key)) {
+
+    pred = subtree;
+    auto [lo, equiv, hi] = split_pieces(right, child_bh, key, pred, succ);
+    return {join_pieces(make_piece(left, child_bh), subtree, lo), equiv, hi};
+  }
+
+  if (left != nullptr) {
+    pred = node::get_rightmost_desc(left);
+  }
+
+  if (right != nullptr) {
+    succ = node::get_leftmost_desc(right);
+  }
+
+  return {make_piece(left, child_bh), subtree, make_piece(right, child_bh)};
+}
+
+/* 
+ * Nodes are split by the subtree root and merged into its children, then 
+ * the root joins them back. Nodes going to an empty place are built into 
+ * a piece. So only nodes on the paths to the places of merged nodes are 
+ * rejoined: O(m log(n/m + 1)) of them. Each join takes O(1) plus difference 
+ * of black heights of the children, these differences sum up to O(m).
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t 
+rbtree<Key, Compare, Allocator, NodeSize>::merge_nodes(node* subtree, size_type bh, 
+                                                       node* const* first, node* const* last) {
+
+  if (first == last) {
+    return make_piece(subtree, bh);
+  }
+
+  if (subtree == nullptr) {
+
+    auto count = static_cast<size_type>(last - first);
+    size_type red_depth = static_cast<size_type>(std::bit_width(count)) - 1;
+
+    end_node* prev = end_node_ptr();
+    node* const* it = first;
+    node* built = build_sorted_subtree(it, count, 0, red_depth, prev);
+
+    return make_piece(built, red_depth, *first, *(last - 1));
+  }
+
+  size_type child_bh = bh - ((subtree->is_black())? 1 : 0);
+
+  node* left  = subtree->get_left();
+  node* right = subtree->get_right();
+
+  node* const* mid = std::partition_point(first, last, [this, subtree](const node* nd) {
+    return cmp(nd->value, subtree->value);
+  });
+
+  node* const* right_first = mid;
+
+  if (mid != last && !cmp(subtree->value, (*mid)->value)) {
+
+    destroy_node(*mid);
+    ++right_first;
+  }
+
+  piece_t lo = merge_nodes(left,  child_bh, first, mid);
+  piece_t hi = merge_nodes(right, child_bh, right_first, last);
+
+  return join_pieces(lo, subtree, hi);
+}
+
+/* 
+ * Root of 'rhs' splits 'lhs', then parts of 'lhs' are united with 
+ * subtrees of 'rhs' independently and joined back with the root.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t 
+rbtree<Key, Compare, Allocator, NodeSize>::union_pieces(piece_t lhs, piece_t rhs, std::vector<node*>& garbage, size_type depth) {
+
+  if (lhs.root == nullptr) {
+    return rhs;
+  }
+
+  if (rhs.root == nullptr) {
+    return lhs;
+  }
+
+  bool spawn = (depth > 0) 
+            && (node::subtree_size(lhs.root) + node::subtree_size(rhs.root) >= parallel_grain);
+  size_type next_depth = (depth > 0)? depth - 1 : 0;
+
+  node* mid = rhs.root;
+  node* mid_left  = mid->get_left();
+  node* mid_right = mid->get_right();
+
+  piece_t rhs_lo = make_piece(mid_left,  rhs.bh - 1, rhs.min, 
+                              (mid_left != nullptr)? node::get_rightmost_desc(mid_left) : nullptr);
+  piece_t rhs_hi = make_piece(mid_right, rhs.bh - 1, 
+                              (mid_right != nullptr)? node::get_leftmost_desc(mid_right) : nullptr, rhs.max);
+
+  piece_t lhs_lo, lhs_hi;
+  node* equiv = nullptr;
+  std::tie(lhs_lo, equiv, lhs_hi) = split_pieces(lhs, mid->value);
+
+  /* Element of this tree is kept. */
+  if (equiv != nullptr) {
+
+    mid->detach();
+    garbage.push_back(mid);
+    mid = equiv;
+  }
+
+  auto [lo, hi] = fork_pieces(spawn, 
+    [=](rbtree& self, std::vector<node*>& trash) { return self.union_pieces(lhs_lo, rhs_lo, trash, next_depth); },
+    [=](rbtree& self, std::vector<node*>& trash) { return self.union_pieces(lhs_hi, rhs_hi, trash, next_depth); },
+    garbage);
+
+  return join_pieces(lo, mid, hi);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t 
+rbtree<Key, Compare, Allocator, NodeSize>::intersect_pieces(piece_t lhs, const node* rhs, std::vector<node*>& garbage, size_type depth) {
+
+  if (lhs.root == nullptr) {
+    return piece_t{};
+  }
+
+  if (rhs == nullptr) {
+
+    garbage.push_back(lhs.root);
+    return piece_t{};
+  }
+
+  bool spawn = (depth > 0) 
+            && (node::subtree_size(lhs.root) + node::subtree_size(rhs) >= parallel_grain);
+  size_type next_depth = (depth > 0)? depth - 1 : 0;
+
+  piece_t lhs_lo, lhs_hi;
+  node* equiv = nullptr;
+  std::tie(lhs_lo, equiv, lhs_hi) = split_pieces(lhs, rhs->value);
+
+  const node* rhs_lo = rhs->get_left();
+  const node* rhs_hi = rhs->get_right();
+
+  auto [lo, hi] = fork_pieces(spawn, 
+    [=](rbtree& self, std::vector<node*>& trash) { return self.intersect_pieces(lhs_lo, rhs_lo, trash, next_depth); },
+    [=](rbtree& self, std::vector<node*>& trash) { return self.intersect_pieces(lhs_hi, rhs_hi, trash, next_depth); },
+    garbage);
+
+  return (equiv != nullptr)? join_pieces(lo, equiv, hi) : join_pieces(lo, hi);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t 
+rbtree<Key, Compare, Allocator, NodeSize>::difference_pieces(piece_t lhs, const node* rhs, std::vector<node*>& garbage, size_type depth) {
+
+  if (lhs.root == nullptr || rhs == nullptr) {
+    return lhs;
+  }
+
+  bool spawn = (depth > 0) 
+            && (node::subtree_size(lhs.root) + node::subtree_size(rhs) >= parallel_grain);
+  size_type next_depth = (depth > 0)? depth - 1 : 0;
+
+  piece_t lhs_lo, lhs_hi;
+  node* equiv = nullptr;
+  std::tie(lhs_lo, equiv, lhs_hi) = split_pieces(lhs, rhs->value);
+
+  if (equiv != nullptr) {
+
+    equiv->detach();
+    garbage.push_back(equiv);
+  }
+
+  const node* rhs_lo = rhs->get_left();
+  const node* rhs_hi = rhs->get_right();
+
+  auto [lo, hi] = fork_pieces(spawn, 
+    [=](rbtree& self, std::vector<node*>& trash) { return self.difference_pieces(lhs_lo, rhs_lo, trash, next_depth); },
+    [=](rbtree& self, std::vector<node*>& trash) { return self.difference_pieces(lhs_hi, rhs_hi, trash, next_depth); },
+    garbage);
+
+  return join_pieces(lo, hi);
+}
+
+/* 
+ * Task is run with std::async on a scratch tree, sharing comparator and 
+ * allocator with this one. If thread could not be started, both halves are run in place.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename LeftOp, typename RightOp>
+std::pair<typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t, 
+          typename rbtree<Key, Compare, Allocator, NodeSize>::piece_t>
+rbtree<Key, Compare, Allocator, NodeSize>::fork_pieces(bool spawn, LeftOp left_op, RightOp right_op, std::vector<node*>& garbage) {
+
+  if (spawn) {
+
+    rbtree scratch(cmp, get_allocator());
+    std::vector<node*> scratch_garbage;
+    std::future<piece_t> task;
+
+    try {
+      task = std::async(std::launch::async, [&] { return left_op(scratch, scratch_garbage); });
+    } catch (const std::system_error&) {}
+
+    if (task.valid()) {
+
+      piece_t hi = right_op(*this, garbage);
+      piece_t lo = task.get();
+
+      /* Pieces are not owned by the scratch tree. */
+      scratch.root.set(nullptr);
+
+      garbage.insert(garbage.end(), scratch_garbage.begin(), scratch_garbage.end());
+      return {lo, hi};
+    }
+  }
+
+  piece_t lo = left_op(*this, garbage);
+  piece_t hi = right_op(*this, garbage);
+  return {lo, hi};
+}
+
+/* If thread could not be started, both operations are run in place. */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename LeftOp, typename RightOp>
+void rbtree<Key, Compare, Allocator, NodeSize>::fork(bool spawn, LeftOp left_op, RightOp right_op) {
+
+  if (spawn) {
+
+    std::future<void> task;
+
+    try {
+      task = std::async(std::launch::async, left_op);
+    } catch (const std::system_error&) {}
+
+    if (task.valid()) {
+
+      right_op();
+      task.get();
+      return;
+    }
+  }
+
+  left_op();
+  right_op();
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::size_type 
+rbtree<Key, Compare, Allocator, NodeSize>::parallel_depth(std::size_t threads) {
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  /* Tasks are spawned a bit more than threads for better balance. */
+  return (threads > 1)? static_cast<size_type>(std::bit_width(threads - 1)) + 1 : 0;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::union_with(rbtree&& other, std::size_t threads) {
+
+  if (&other == this || other.empty()) {
+    return;
+  }
+
+  if (!(root.get_allocator() == other.root.get_allocator())) {
+
+    for (auto it = other.cbegin(), end_it = other.cend(); it != end_it; ++it) {
+      insert(std::move(const_cast<key_type&>(*it)));
+    }
+
+    other.clear();
+    return;
+  }
+
+  std::vector<node*> garbage;
+  piece_t united = union_pieces(release_piece(), other.release_piece(), garbage, parallel_depth(threads));
+
+  free_pieces(garbage);
+  adopt_piece(united);
+
+  assert(debug_validate());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::union_with(const rbtree& other, std::size_t threads) {
+
+  if (&other == this || other.empty()) {
+    return;
+  }
+
+  union_with(rbtree(other, get_allocator()), threads);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::intersect_with(const rbtree& other, std::size_t threads) {
+
+  if (&other == this || empty()) {
+    return;
+  }
+
+  if (other.empty()) {
+
+    clear();
+    return;
+  }
+
+  std::vector<node*> garbage;
+  piece_t common = intersect_pieces(release_piece(), other.root.get(), garbage, parallel_depth(threads));
+
+  free_pieces(garbage);
+  adopt_piece(common);
+
+  assert(debug_validate());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::difference_with(const rbtree& other, std::size_t threads) {
+
+  if (&other == this) {
+
+    clear();
+    return;
+  }
+
+  if (empty() || other.empty()) {
+    return;
+  }
+
+  std::vector<node*> garbage;
+  piece_t rest = difference_pieces(release_piece(), other.root.get(), garbage, parallel_depth(threads));
+
+  free_pieces(garbage);
+  adopt_piece(rest);
+
+  assert(debug_validate());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::adopt_piece(piece_t piece) {
+
+  root.set(piece.root);
+
+  if (piece.root == nullptr) {
+
+    leftmost = rightmost = end_node_ptr();
+    return;
+  }
+
+  node* min = node::get_leftmost_desc(piece.root);
+  node* max = node::get_rightmost_desc(piece.root);
+
+  min->stitch_left(end_node_ptr());
+  max->stitch_right(end_node_ptr());
+
+  leftmost  = min;
+  rightmost = max;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::free_piece(piece_t piece) noexcept {
+
+  /* Freeing stops at the parent of the subtree root, which is the end node. */
+  root.set(piece.root);
+  node::free_subtree(piece.root, end_node_ptr(), root.get_allocator());
+  root.set(nullptr);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::free_pieces(const std::vector<node*>& roots) noexcept {
+
+  for (node* subtree : roots) {
+    free_piece(piece_t{subtree});
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::clear() noexcept {
+
+  root.clear();
+  leftmost = root.end_node_ptr();
+  rightmost = root.end_node_ptr();
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::clear(std::size_t threads) noexcept {
+
+  if constexpr (concurrent_alloc) {
+    if (!empty()) {
+
+      free_nodes(root.get(), parallel_depth(threads));
+      root.set(nullptr);
+    }
+  }
+
+  clear();
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::compact(node_layout layout) {
+
+  if (empty()) {
+    return;
+  }
+
+  std::vector<node*> order;
+  order.reserve(size());
+
+  if (layout == node_layout::IN_ORDER) {
+
+    for (end_node* nd = leftmost; nd != end_node_ptr(); nd = static_cast<node*>(nd)->get_next()) {
+      order.push_back(static_cast<node*>(nd));
+    }
+
+  } else {
+
+    veb_order(root.get(), subtree_height(root.get()), order);
+  }
+
+  relocate_nodes(order);
+  assert(debug_validate());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::size_type 
+rbtree<Key, Compare, Allocator, NodeSize>::compact_step(size_type from, size_type budget) {
+
+  size_type last = std::min(size(), from + std::min(budget, size()));
+  if (from >= last) {
+    return std::min(from, size());
+  }
+
+  std::vector<node*> order;
+  order.reserve(last - from);
+
+  auto nd = const_cast<node*>(node::select_desc(root.get(), from));
+  for (size_type idx = from; idx != last; ++idx) {
+
+    order.push_back(nd);
+    nd = static_cast<node*>(nd->get_next());
+  }
+
+  relocate_nodes(order);
+  return last;
+}
+
+/* 
+ * Top half of the levels is laid out first, then subtrees hanging 
+ * from it from left to right, each one recursively in the same way.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::veb_order(node* subtree, size_type height, std::vector<node*>& order) {
+
+  if (subtree == nullptr) {
+    return;
+  }
+
+  if (height == 1) {
+    order.push_back(subtree);
+    return;
+  }
+
+  size_type top = height / 2;
+  veb_order(subtree, top, order);
+
+  /* Subtrees 'top' levels below, found with explicit stack in left to right order. */
+  std::vector<std::pair<node*, size_type>> pending{{subtree, 0}};
+
+  while (!pending.empty()) {
+
+    auto [nd, depth] = pending.back();
+    pending.pop_back();
+
+    if (depth == top) {
+      veb_order(nd, height - top, order);
+      continue;
+    }
+
+    if (node* right = nd->get_right(); right != nullptr) {
+      pending.emplace_back(right, depth + 1);
+    }
+
+    if (node* left = nd->get_left(); left != nullptr) {
+      pending.emplace_back(left, depth + 1);
+    }
+  }
+}
+
+/* 
+ * All memory is allocated first, so that freed old nodes are not reused 
+ * for the next ones. If allocation or moving a key throws, remaining 
+ * memory is freed and nodes moved so far stay at their new places.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::relocate_nodes(const std::vector<node*>& order) {
+
+  auto& alloc = root.get_allocator();
+
+  std::vector<node*> slots;
+  slots.reserve(order.size());
+
+  size_type idx = 0;
+
+  try {
+
+    if constexpr (requires (node_allocator_type& a, size_type n) { a.reserve(n); }) {
+      alloc.reserve(order.size());
+    }
+
+    while (slots.size() != order.size()) {
+
+      if constexpr (dtl::sequential_allocator<node_allocator_type>) {
+        slots.push_back(alloc.allocate_sequential());
+      } else {
+        slots.push_back(node_alloc_traits::allocate(alloc, 1));
+      }
+    }
+
+    for (; idx != order.size(); ++idx) {
+
+      node* old = order[idx];
+      node* nd  = node::relocate(alloc, old, slots[idx]);
+
+      if (leftmost == old) {
+        leftmost = nd;
+      }
+
+      if (rightmost == old) {
+        rightmost = nd;
+      }
+
+      destroy_node(old);
+    }
+
+  } catch (...) {
+
+    for (size_type rest = idx; rest != slots.size(); ++rest) {
+      node_alloc_traits::deallocate(alloc, slots[rest], 1);
+    }
+
+    throw;
+  }
+}
+
+/* 
+ * Copy is linked into the tree as it is built, so if allocation 
+ * throws, nodes made so far are freed by the destructor of the root.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::copy_nodes(const rbtree& that, std::size_t threads) {
+
+  const node* src = that.root.get();
+  if (src == nullptr) {
+    return;
+  }
+
+  root.set(create_node(*src));
+  copy_children(src, root.get(), end_node_ptr(), end_node_ptr(), 
+                (concurrent_alloc)? parallel_depth(threads) : 0);
+
+  leftmost  = node::get_leftmost_desc(root.get());
+  rightmost = node::get_rightmost_desc(root.get());
+}
+
+/* 
+ * Both children are created before the halves are forked, 
+ * so each task only writes to nodes of its own subtree.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::copy_children(const node* src, node* dst, end_node* pred, end_node* succ, size_type depth) {
+
+  const node* left  = src->get_left();
+  const node* right = src->get_right();
+
+  if (left != nullptr) {
+    dst->tie_left(create_node(*left));
+  } else {
+    dst->stitch_left(pred);
+  }
+
+  if (right != nullptr) {
+    dst->tie_right(create_node(*right));
+  } else {
+    dst->stitch_right(succ);
+  }
+
+  bool spawn = (depth > 0) && (src->size >= parallel_grain);
+  size_type next_depth = (depth > 0)? depth - 1 : 0;
+
+  fork(spawn, 
+    [=, this] { if (left  != nullptr) copy_children(left,  dst->get_left(),  pred, dst, next_depth); },
+    [=, this] { if (right != nullptr) copy_children(right, dst->get_right(), dst, succ, next_depth); });
+}
+
+/* Subtree root is freed last, after both tasks are joined, when it is a leaf already. */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::free_nodes(node* subtree, size_type depth) noexcept {
+
+  if (depth > 0 && subtree->size >= parallel_grain) {
+
+    /* Children are unhooked, so tasks do not touch the shared node. Their parent pointers are kept. */
+    node* left  = subtree->get_left();
+    node* right = subtree->get_right();
+
+    subtree->set_left(nullptr);
+    subtree->set_right(nullptr);
+
+    fork(true, 
+      [=, this] { if (left  != nullptr) free_nodes(left,  depth - 1); },
+      [=, this] { if (right != nullptr) free_nodes(right, depth - 1); });
+  }
+
+  node::free_subtree(subtree, subtree->parent_as_end(), root.get_allocator());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+const typename rbtree<Key, Compare, Allocator, NodeSize>::end_node* 
+rbtree<Key, Compare, Allocator, NodeSize>::find_equiv_node(const node* subtree_root, const K& key) const {
+
+  while (subtree_root != nullptr) {
+
+    if (cmp(key, subtree_root->value)) {
+      subtree_root = subtree_root->get_left();
+
+    } else if (cmp(subtree_root->value, key)) {
+      subtree_root = subtree_root->get_right();
+
+    } else {
+      return subtree_root;
+    }
+  }
+
+  return end_node_ptr();
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+const typename rbtree<Key, Compare, Allocator, NodeSize>::end_node* 
+rbtree<Key, Compare, Allocator, NodeSize>::find_lower_bound_node(const node* subtree_root, 
+                                                        const K& key) const {
+  
+  const end_node* res = end_node_ptr();
+  while (subtree_root != nullptr) {
+
+    if (!cmp(subtree_root->value, key)) {
+      res = std::exchange(subtree_root, subtree_root->get_left());
+    } else {
+      subtree_root = subtree_root->get_right();
+    }
+  }
+
+  return res;
+}
+
+/* 
+ * Range is known to be long enough, so the end node is never reached. 
+ * Nodes on the way down to the successor are visited in reverse order after it, 
+ * each one followed by its right subtree: right children are prefetched on the way, 
+ * well ahead of the time they are reached. Successors by threads are such nodes.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename F>
+void rbtree<Key, Compare, Allocator, NodeSize>::visit_nodes(const node* first, size_type count, F&& f) {
+
+  const node* nd = first;
+
+  for (; count > 1; --count) {
+
+    const node* next = nd->get_right_unsafe();
+
+    if (!nd->is_thread_right()) {
+      for (const node* left = next->get_left(); left != nullptr; left = next->get_left()) {
+
+        dtl::prefetch(next->get_right_unsafe());
+        next = left;
+      }
+
+      dtl::prefetch(next->get_right_unsafe());
+    }
+
+    f(nd->value);
+    nd = next;
+  }
+
+  f(nd->value);
 }
 
-template <typename Key, typename Compare>
-std::pair<typename rbtree<Key, Compare>::const_iterator, bool>
-rbtree<Key, Compare>::insert(const key_type& key) {
+/* 
+ * Size of the left subtree is not read on right turns, since the left child is not 
+ * prefetched: size of the node is added instead, and size of the right child 
+ * is subtracted on the next step, when it is already in cache.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <bool CountLess, typename Visit>
+void rbtree<Key, Compare, Allocator, NodeSize>::lower_bound_batch(std::span<const key_type> keys, Visit visit) const {
 
-  if (find_equiv_node(root.get(), key) != end_node_ptr()) {
-    return std::make_pair(cend(), false);
-  }
+  struct lane_t {
 
-  node* nd = new node(key);
-  insert_node(nd);
-  return std::make_pair(const_iterator(nd), true);
-}
+    const node* cur = nullptr;
+    const end_node* bound = nullptr;
+    size_type less = 0;
+    bool right_turn = false;
+  };
 
-template <typename Key, typename Compare>
-template <typename InputIt>
-void rbtree<Key, Compare>::insert(InputIt first, InputIt last) {
+  std::array<lane_t, batch_lanes> lanes;
 
-  for (auto it = first; it != last; ++it) {
-    insert(*it);
-  }
-}
+  for (std::size_t base = 0; base < keys.size(); base += batch_lanes) {
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::insert(std::initializer_list<key_type> init) {
-  insert(init.begin(), init.end());
-}
+    std::size_t width = std::min(batch_lanes, keys.size() - base);
+    for (std::size_t idx = 0; idx != width; ++idx) {
+      lanes[idx] = lane_t{root.get(), end_node_ptr(), 0, false};
+    }
 
-template <typename Key, typename Compare>
-template< class... Args >
-std::pair<typename rbtree<Key, Compare>::const_iterator, bool> 
-rbtree<Key, Compare>::emplace( Args&&... args ) {
+    for (bool active = !empty(); active; ) {
 
-  node* nd = new node(std::forward<Args>(args)...);
-  if (insert_node(nd)) {
-    return std::make_pair(const_iterator(nd), true);
-  }
+      active = false;
 
-  delete nd;
-  return std::make_pair(cend(), false);
-}
+      for (std::size_t idx = 0; idx != width; ++idx) {
 
-template <typename Key, typename Compare>
-typename rbtree<Key, Compare>::const_iterator 
-rbtree<Key, Compare>::erase(const_iterator pos) {
+        lane_t& lane = lanes[idx];
+        const node* cur = lane.cur;
 
-  const_iterator next = std::next(pos);
-  delete_node(const_cast<node*>(static_cast<const node*>(pos.node_ptr_)));
-  return next;
-}
+        if (cur == nullptr) {
+          continue;
+        }
+
+        if constexpr (CountLess) {
+          if (lane.right_turn) {
+            lane.less -= cur->size;
+          }
+        }
+
+        if (!cmp(cur->value, keys[base + idx])) {
+
+          lane.bound = cur;
+          lane.cur = cur->get_left();
+          lane.right_turn = false;
+
+        } else {
+
+          if constexpr (CountLess) {
+            lane.less += cur->size;
+          }
+
+          lane.cur = cur->get_right();
+          lane.right_turn = true;
+        }
 
-template <typename Key, typename Compare>
-typename rbtree<Key, Compare>::const_iterator 
-rbtree<Key, Compare>::erase(const_iterator first, const_iterator last) {
+        if (lane.cur != nullptr) {
+          dtl::prefetch(lane.cur);
+          active = true;
+        }
+      }
+    }
 
-  while (first != last) {
-    first = erase(first);
+    for (std::size_t idx = 0; idx != width; ++idx) {
+      visit(base + idx, lanes[idx].bound, lanes[idx].less);
+    }
   }
-  
-  return first;
 }
 
-template <typename Key, typename Compare>
-bool rbtree<Key, Compare>::erase(const key_type& key) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::lower_bound_many(std::span<const key_type> keys, 
+                                                                 std::span<const_iterator> out) const {
 
-  const end_node* nd = find_equiv_node(root.get(), key);
-  if (nd == end_node_ptr()) {
-    return false;
-  }
+  assert(out.size() >= keys.size());
 
-  delete_node(const_cast<node*>(static_cast<const node*>(nd)));
-  return true;
+  lower_bound_batch<false>(keys, [&](std::size_t idx, const end_node* bound, size_type) {
+    out[idx] = const_iterator(bound);
+  });
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::clear() noexcept {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::find_many(std::span<const key_type> keys, 
+                                                          std::span<const_iterator> out) const {
 
-  root.clear();
-  leftmost = root.end_node_ptr();
-  rightmost = root.end_node_ptr();
-}
+  assert(out.size() >= keys.size());
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::copy_subtree(subtree_copy_type& subtree_copy, const node* subtree) const {
+  lower_bound_batch<false>(keys, [&](std::size_t idx, const end_node* bound, size_type) {
 
-  subtree_info_type subtree_info{subtree, leftmost, rightmost, end_node_ptr()};
-  node::copy_subtree(subtree_copy, subtree_info);
+    bool found = (bound != end_node_ptr()) && !cmp(keys[idx], static_cast<const node*>(bound)->value);
+    out[idx] = (found)? const_iterator(bound) : cend();
+  });
 }
 
-template <typename Key, typename Compare>
-const typename rbtree<Key, Compare>::end_node* 
-rbtree<Key, Compare>::find_equiv_node(const node* subtree_root, key_type key) const {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::contains_many(std::span<const key_type> keys, 
+                                                              std::span<bool> out) const {
 
-  while (subtree_root != nullptr) {
+  assert(out.size() >= keys.size());
 
-    if (cmp(key, subtree_root->value)) {
-      subtree_root = subtree_root->get_left();
+  lower_bound_batch<false>(keys, [&](std::size_t idx, const end_node* bound, size_type) {
+    out[idx] = (bound != end_node_ptr()) && !cmp(keys[idx], static_cast<const node*>(bound)->value);
+  });
+}
 
-    } else if (cmp(subtree_root->value, key)) {
-      subtree_root = subtree_root->get_right();
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::less_than_many(std::span<const key_type> keys, 
+                                                               std::span<size_type> out) const {
 
-    } else {
-      return subtree_root;
-    }
-  }
+  assert(out.size() >= keys.size());
 
-  return end_node_ptr();
+  lower_bound_batch<true>(keys, [&](std::size_t idx, const end_node*, size_type less) {
+    out[idx] = less;
+  });
 }
 
-template <typename Key, typename Compare>
-const typename rbtree<Key, Compare>::end_node* 
-rbtree<Key, Compare>::find_lower_bound_node(const node* subtree_root, 
-                                                        key_type key) const {
-  
-  const end_node* res = end_node_ptr();
-  while (subtree_root != nullptr) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::distance_many(std::span<const key_type> first, 
+                                                              std::span<const key_type> second, 
+                                                              std::span<difference_type> out) const {
 
-    if (!cmp(subtree_root->value, key)) {
-      res = std::exchange(subtree_root, subtree_root->get_left());
-    } else {
-      subtree_root = subtree_root->get_right();
-    }
-  }
+  assert(second.size() == first.size() && out.size() >= first.size());
 
-  return res;
+  lower_bound_batch<true>(first, [&](std::size_t idx, const end_node*, size_type less) {
+    out[idx] = -static_cast<difference_type>(less);
+  });
+
+  lower_bound_batch<true>(second, [&](std::size_t idx, const end_node*, size_type less) {
+    out[idx] += static_cast<difference_type>(less);
+  });
 }
 
-template <typename Key, typename Compare>
-const typename rbtree<Key, Compare>::end_node* 
-rbtree<Key, Compare>::find_upper_bound_node(const node* subtree_root, 
-                                                        key_type key) const {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+const typename rbtree<Key, Compare, Allocator, NodeSize>::end_node* 
+rbtree<Key, Compare, Allocator, NodeSize>::find_upper_bound_node(const node* subtree_root, 
+                                                        const K& key) const {
 
   const end_node* res = end_node_ptr();
   while (subtree_root != nullptr) {
@@ -567,8 +2663,8 @@ rbtree<Key, Compare>::find_upper_bound_node(const node* subtree_root,
   return res;
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::transplant(node* u, node* v) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::transplant(node* u, node* v) {
 
   if (is_root(u)) {
     root.set(v);
@@ -581,8 +2677,8 @@ void rbtree<Key, Compare>::transplant(node* u, node* v) {
   }
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::right_rotate(node* subtree_root) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::right_rotate(node* subtree_root) {
 
   if (subtree_root == nullptr || !subtree_root->has_left())
     return;
@@ -618,8 +2714,8 @@ void rbtree<Key, Compare>::right_rotate(node* subtree_root) {
   rotating->size += 1 + ((subtree_root->has_right())? subtree_root->get_right_unsafe()->size : 0);
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::left_rotate(node* subtree_root) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::left_rotate(node* subtree_root) {
 
   if (subtree_root == nullptr || !subtree_root->has_right())
     return;
@@ -655,44 +2751,85 @@ void rbtree<Key, Compare>::left_rotate(node* subtree_root) {
   rotating->size += 1 + ((subtree_root->has_left())? subtree_root->get_left_unsafe()->size : 0);
 }
 
-template <typename Key, typename Compare>
-bool rbtree<Key, Compare>::insert_node(node* inserting) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool rbtree<Key, Compare, Allocator, NodeSize>::insert_node(node* inserting) {
 
-  if (empty()) {
+  auto pos = find_insert_pos(inserting->value);
+  if (pos.equiv != nullptr) {
+    return false;
+  }
+
+  link_node(inserting, pos);
+  return true;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::const_iterator
+rbtree<Key, Compare, Allocator, NodeSize>::insert_node(const_iterator hint, node* inserting) {
+
+  auto pos = find_insert_pos(hint, inserting->value);
+  if (pos.equiv != nullptr) {
+
+    destroy_node(inserting);
+    return const_iterator(pos.equiv);
+  }
+
+  link_node(inserting, pos);
+  return const_iterator(inserting);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::link_node(node* inserting, const insert_pos_t& pos) {
+
+  node* parent = pos.parent;
+
+  if (parent == nullptr) {
 
     root.set(inserting);
     leftmost = rightmost = inserting;
     inserting->paint(node::color::BLACK);
 
+    inserting->stitch_left(end_node_ptr());
+    inserting->stitch_right(end_node_ptr());
+
   } else {
-    
-    if (!insert_node_bst(root.get(), inserting)) {
-      return false;
-    }
 
-    incr_subtree_sizes(inserting->parent());
+    /* 
+     * New node is a leaf, so its neighbours are its parent and 
+     * the node, parent's thread on the same side pointed to.
+     */
+    if (pos.on_right) {
 
-    if (inserting == leftmost->get_left()) {
-      leftmost = inserting;
-    }
+      inserting->stitch_right(parent->tie_right(inserting));
+      inserting->stitch_left(parent);
+
+      if (parent == rightmost) {
+        rightmost = inserting;
+      }
+
+    } else {
+
+      inserting->stitch_left(parent->tie_left(inserting));
+      inserting->stitch_right(parent);
 
-    if (inserting == static_cast<node*>(rightmost)->get_right()) {
-      rightmost = inserting;
+      if (parent == leftmost) {
+        leftmost = inserting;
+      }
     }
+
+    incr_subtree_sizes(parent);
   }
 
-  inserting->stitch();
   insert_rb_fix(inserting);
 
   assert(debug_validate());
-  return true;
 }
 
-template <typename Key, typename Compare>
-typename rbtree<Key, Compare>::node* 
-rbtree<Key, Compare>::parent_grand_recolor(node* parent) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::node* 
+rbtree<Key, Compare, Allocator, NodeSize>::parent_grand_recolor(node* parent) {
 
-  using color_t = enum node::color;
+  using color_t = typename node::color;
 
   parent->paint(color_t::BLACK);
 
@@ -704,11 +2841,11 @@ rbtree<Key, Compare>::parent_grand_recolor(node* parent) {
   return grand;
 }
 
-template <typename Key, typename Compare>
-typename rbtree<Key, Compare>::node* 
-rbtree<Key, Compare>::uncle_parent_grand_recolor(node* uncle, node* parent) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::node* 
+rbtree<Key, Compare, Allocator, NodeSize>::uncle_parent_grand_recolor(node* uncle, node* parent) {
 
-  using color_t = enum node::color;
+  using color_t = typename node::color;
 
   uncle->paint(color_t::BLACK);
   parent->paint(color_t::BLACK);
@@ -721,8 +2858,8 @@ rbtree<Key, Compare>::uncle_parent_grand_recolor(node* uncle, node* parent) {
   return grand;
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::insert_rb_fix(node* new_node) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool rbtree<Key, Compare, Allocator, NodeSize>::insert_rb_fix(node* new_node) {
 
   node *uncle, *parent = new_node->parent();
 
@@ -772,62 +2909,283 @@ void rbtree<Key, Compare>::insert_rb_fix(node* new_node) {
     parent = new_node->parent();
   }
 
-  root.get()->paint(node::color::BLACK);
-}
+  node* root_node = root.get();
+  bool grown = root_node->is_red();
 
-template <typename Key, typename Compare>
-bool rbtree<Key, Compare>::insert_node_bst(node* subtree_root, node* inserting) {
+  root_node->paint(node::color::BLACK);
+  return grown;
+}
 
-  node* current = subtree_root;
-  node* parent = subtree_root->parent();
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbtree<Key, Compare, Allocator, NodeSize>::insert_pos_t
+rbtree<Key, Compare, Allocator, NodeSize>::find_insert_pos(const K& key) {
 
-  bool on_right = false;
+  insert_pos_t pos;
+  node* current = root.get();
 
   while (current != nullptr) {
 
-    parent = current;
+    pos.parent = current;
 
-    if (!cmp(inserting->value, current->value)) {
+    if (cmp(key, current->value)) {
 
-      on_right = true;
-      current = current->get_right();
+      pos.on_right = false;
+      current = current->get_left();
 
-    } else if (!cmp(current->value, inserting->value)) {
+    } else if (cmp(current->value, key)) {
 
-      on_right = false;
-      current = current->get_left();
+      pos.on_right = true;
+      current = current->get_right();
 
     } else {
-      return false;
+
+      pos.equiv = current;
+      break;
     }
   }
 
-  inserting->set_parent(parent);
+  return pos;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename ForwardIt>
+bool rbtree<Key, Compare, Allocator, NodeSize>::is_sorted_unique(ForwardIt first, ForwardIt last) const {
+
+  return std::adjacent_find(first, last, [this](const auto& lhs, const auto& rhs) {
+    return !cmp(lhs, rhs);
+  }) == last;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename ForwardIt>
+void rbtree<Key, Compare, Allocator, NodeSize>::build_sorted(ForwardIt first, size_type count) {
+
+  if (count == 0) {
+    return;
+  }
+
+  if constexpr (requires (node_allocator_type& alloc, size_type n) { alloc.reserve(n); }) {
+    root.get_allocator().reserve(count);
+  }
+
+  /* All levels are full except the deepest one, its nodes are painted red. */
+  size_type red_depth = static_cast<size_type>(std::bit_width(count)) - 1;
+
+  end_node* prev = end_node_ptr();
+  node* subtree = build_sorted_subtree(first, count, 0, red_depth, prev);
+
+  static_cast<node*>(prev)->stitch_right(end_node_ptr());
+  subtree->paint(node::color::BLACK);
+
+  root.set(subtree);
+  leftmost  = node::get_leftmost_desc(subtree);
+  rightmost = prev;
+
+  assert(debug_validate());
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename ForwardIt>
+typename rbtree<Key, Compare, Allocator, NodeSize>::node*
+rbtree<Key, Compare, Allocator, NodeSize>::build_sorted_subtree(ForwardIt& it, size_type count, size_type depth, 
+                                                                     size_type red_depth, end_node*& prev) {
+
+  if (count == 0) {
+    return nullptr;
+  }
+
+  size_type left_count = count / 2;
+  node* left = build_sorted_subtree(it, left_count, depth + 1, red_depth, prev);
 
-  if (on_right) {
-    parent->tie_right(inserting);
+  node* nd;
+  if constexpr (std::is_same_v<std::iter_value_t<ForwardIt>, node*>) {
+    nd = *it;
   } else {
-    parent->tie_left(inserting);
+    try {
+      nd = create_node(*it);
+    } catch (...) {
+      free_detached(left);
+      throw;
+    }
   }
 
-  return true;
+  ++it;
+
+  nd->size = static_cast<typename node::size_type>(count);
+  nd->paint((depth == red_depth)? node::color::RED : node::color::BLACK);
+
+  if (left != nullptr) {
+    nd->tie_left(left);
+  } else {
+    nd->stitch_left(prev);
+  }
+
+  /* Previous node in in-order has no right child. */
+  if (prev != end_node_ptr()) {
+    static_cast<node*>(prev)->stitch_right(nd);
+  }
+
+  prev = nd;
+
+  try {
+    nd->tie_right(build_sorted_subtree(it, count - left_count - 1, depth + 1, red_depth, prev));
+  } catch (...) {
+    free_detached(nd);
+    throw;
+  }
+
+  return nd;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::free_detached(node* subtree) noexcept {
+
+  if (subtree != nullptr) {
+    root_type temp(subtree, root.get_allocator());
+  }
+}
+
+/*
+ * Key fits just prior to the hint if it is between hint and its predecessor.
+ * New node is then attached either as left child of the hint or as right 
+ * child of the predecessor - one of them has the corresponding child missing.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbtree<Key, Compare, Allocator, NodeSize>::insert_pos_t
+rbtree<Key, Compare, Allocator, NodeSize>::find_insert_pos(const_iterator hint, const K& key) {
+
+  if (empty()) {
+    return insert_pos_t{};
+  }
+
+  auto hint_nd = const_cast<end_node*>(hint.node_ptr_);
+
+  if (hint_nd == end_node_ptr() || cmp(key, static_cast<node*>(hint_nd)->value)) {
+
+    if (hint_nd == leftmost) {
+      return insert_pos_t{static_cast<node*>(hint_nd), false, nullptr};
+    }
+
+    auto prev = static_cast<node*>((hint_nd == end_node_ptr())? 
+                                   rightmost : const_cast<end_node*>(std::prev(hint).node_ptr_));
+
+    if (cmp(prev->value, key)) {
+
+      if (!hint_nd->has_left()) {
+        return insert_pos_t{static_cast<node*>(hint_nd), false, nullptr};
+      }
+
+      return insert_pos_t{prev, true, nullptr};
+    }
+
+  } else {
+
+    auto hint_node = static_cast<node*>(hint_nd);
+
+    if (!cmp(hint_node->value, key)) {
+      return insert_pos_t{nullptr, false, hint_node};
+    }
+
+    if (hint_nd == rightmost) {
+      return insert_pos_t{hint_node, true, nullptr};
+    }
+
+    auto next = static_cast<node*>(const_cast<end_node*>(std::next(hint).node_ptr_));
+
+    if (cmp(key, next->value)) {
+
+      if (!hint_node->has_right()) {
+        return insert_pos_t{hint_node, true, nullptr};
+      }
+
+      return insert_pos_t{next, false, nullptr};
+    }
+  }
+
+  return find_insert_pos(key);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbtree<Key, Compare, Allocator, NodeSize>::insert_pos_t
+rbtree<Key, Compare, Allocator, NodeSize>::find_insert_pos_equal(const K& key) {
+
+  insert_pos_t pos;
+  node* current = root.get();
+
+  while (current != nullptr) {
+
+    pos.parent = current;
+    pos.on_right = !cmp(key, current->value);
+    current = (pos.on_right)? current->get_right() : current->get_left();
+  }
+
+  return pos;
+}
+
+/* 
+ * Key fits just prior to the hint if it is not greater than hint
+ * and not less than its predecessor.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbtree<Key, Compare, Allocator, NodeSize>::insert_pos_t
+rbtree<Key, Compare, Allocator, NodeSize>::find_insert_pos_equal(const_iterator hint, const K& key) {
+
+  if (empty()) {
+    return insert_pos_t{};
+  }
+
+  auto hint_nd = const_cast<end_node*>(hint.node_ptr_);
+
+  if (hint_nd == end_node_ptr() || !cmp(static_cast<node*>(hint_nd)->value, key)) {
+
+    if (hint_nd == leftmost) {
+      return insert_pos_t{static_cast<node*>(hint_nd), false, nullptr};
+    }
+
+    auto prev = static_cast<node*>((hint_nd == end_node_ptr())? 
+                                   rightmost : const_cast<end_node*>(std::prev(hint).node_ptr_));
+
+    if (!cmp(key, prev->value)) {
+
+      if (!hint_nd->has_left()) {
+        return insert_pos_t{static_cast<node*>(hint_nd), false, nullptr};
+      }
+
+      return insert_pos_t{prev, true, nullptr};
+    }
+  }
+
+  return find_insert_pos_equal(key);
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::delete_node(node* deleting) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::delete_node(node* deleting) {
 
   node* nd = delete_rb_fix(deleting);
+  destroy_node(nd);
+
+  assert(debug_validate());
+}
 
-  decr_subtree_sizes(nd);
-  delete nd;
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::node* 
+rbtree<Key, Compare, Allocator, NodeSize>::unlink_node(node* unlinking) {
+
+  node* nd = delete_rb_fix(unlinking);
+  nd->detach();
 
   assert(debug_validate());
+  return nd;
 }
 
-template <typename Key, typename Compare>
-std::pair<typename rbtree<Key, Compare>::node*, 
-          typename rbtree<Key, Compare>::node*>
-rbtree<Key, Compare>::get_y_and_its_decs(node* y) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::pair<typename rbtree<Key, Compare, Allocator, NodeSize>::node*, 
+          typename rbtree<Key, Compare, Allocator, NodeSize>::node*>
+rbtree<Key, Compare, Allocator, NodeSize>::get_y_and_its_decs(node* y) {
 
   if (!y->has_left()) {
     return std::make_pair(y, y->get_right());
@@ -845,12 +3203,12 @@ rbtree<Key, Compare>::get_y_and_its_decs(node* y) {
   }
 }
 
-template <typename Key, typename Compare>
-typename rbtree<Key, Compare>::node* 
-rbtree<Key, Compare>::delete_rb_rebalance_w_is_red(node* w, bool x_on_left, 
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::node* 
+rbtree<Key, Compare, Allocator, NodeSize>::delete_rb_rebalance_w_is_red(node* w, bool x_on_left, 
                                                          node* parent_of_x) {
 
-  using color_t = enum node::color;
+  using color_t = typename node::color;
 
   w->paint(color_t::BLACK);
   parent_of_x->paint(color_t::RED);
@@ -869,12 +3227,12 @@ rbtree<Key, Compare>::delete_rb_rebalance_w_is_red(node* w, bool x_on_left,
   return w;
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::delete_rb_rebalance(node* x, node* parent_of_x) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::delete_rb_rebalance(node* x, node* parent_of_x) {
 
-  using color_t = enum node::color;
+  using color_t = typename node::color;
 
-  while (!is_root(x) && (x == nullptr || x->color == color_t::BLACK)) {
+  while (!is_root(x) && (x == nullptr || x->is_black())) {
 
     auto parent_of_x_l = parent_of_x->get_left();
 
@@ -905,10 +3263,10 @@ void rbtree<Key, Compare>::delete_rb_rebalance(node* x, node* parent_of_x) {
       if (x_on_left) {
 
         auto w_r = w->get_right();
-        if (w_r == nullptr || w_r->color == color_t::BLACK) {
+        if (w_r == nullptr || w_r->is_black()) {
 
-          w->get_left()->color = color_t::BLACK;
-          w->color = color_t::RED;
+          w->get_left()->paint(color_t::BLACK);
+          w->paint(color_t::RED);
           right_rotate(w);
           w = parent_of_x->get_right();
         }
@@ -916,16 +3274,16 @@ void rbtree<Key, Compare>::delete_rb_rebalance(node* x, node* parent_of_x) {
       } else {
 
         auto w_l = w->get_left();
-        if (w_l == nullptr || w_l->color == color_t::BLACK) {
+        if (w_l == nullptr || w_l->is_black()) {
 
-          w->get_right()->color = color_t::BLACK;
-          w->color = color_t::RED;
+          w->get_right()->paint(color_t::BLACK);
+          w->paint(color_t::RED);
           left_rotate(w);
           w = parent_of_x->get_left();
         }
       }
 
-      w->color = parent_of_x->color;
+      w->paint(parent_of_x->get_color());
       parent_of_x->paint(color_t::BLACK);
 
       node* nd = (x_on_left)? w->get_right() : w->get_left();
@@ -943,12 +3301,12 @@ void rbtree<Key, Compare>::delete_rb_rebalance(node* x, node* parent_of_x) {
   }
 
   if (x != nullptr) {
-    x->color = color_t::BLACK;
+    x->paint(color_t::BLACK);
   }
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::delete_rb_update_leftmost(node* z, node* x) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::delete_rb_update_leftmost(node* z, node* x) {
 
   if (!z->has_right()) {
     
@@ -963,8 +3321,8 @@ void rbtree<Key, Compare>::delete_rb_update_leftmost(node* z, node* x) {
   }
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::delete_rb_update_rightmost(node* z, node* x) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::delete_rb_update_rightmost(node* z, node* x) {
 
   if (!z->has_left()) {
     
@@ -979,15 +3337,15 @@ void rbtree<Key, Compare>::delete_rb_update_rightmost(node* z, node* x) {
   }
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::update_stitches(end_node* prev, end_node* next) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::update_stitches(end_node* prev, end_node* next) {
 
   update_prev(prev);
   update_next(next);
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::update_prev(end_node* prev) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::update_prev(end_node* prev) {
 
   if (prev != end_node_ptr()) {
 
@@ -998,8 +3356,8 @@ void rbtree<Key, Compare>::update_prev(end_node* prev) {
   }
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::update_next(end_node* next) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::update_next(end_node* next) {
 
   if (next != end_node_ptr()) {
     auto nd = static_cast<node*>(next);
@@ -1009,9 +3367,9 @@ void rbtree<Key, Compare>::update_next(end_node* next) {
   }
 }
 
-template <typename Key, typename Compare>
-typename rbtree<Key, Compare>::node*
-rbtree<Key, Compare>::delete_rb_fix(node* z) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::node*
+rbtree<Key, Compare, Allocator, NodeSize>::delete_rb_fix(node* z) {
 
   auto next = z->get_next();
   auto prev = z->get_prev();
@@ -1019,8 +3377,16 @@ rbtree<Key, Compare>::delete_rb_fix(node* z) {
   node* parent_of_x = nullptr;
   auto [y, x] = get_y_and_its_decs(z);
 
+  /* 
+   * Sizes are fixed before relinking, so rotations 
+   * performed on rebalancing see consistent subtree sizes.
+   */
+  decr_subtree_sizes(y->parent_as_end());
+
   if (y != z) {
 
+    y->size = z->size;
+
     auto z_left = z->get_left_unsafe();
     z_left->set_parent(y); /* relink y in place of z, y is z's desc */
     y->set_left(z_left);
@@ -1043,7 +3409,9 @@ rbtree<Key, Compare>::delete_rb_fix(node* z) {
 
     transplant(z, y);
 
-    std::swap(y->color, z->color);
+    auto y_color = y->get_color();
+    y->paint(z->get_color());
+    z->paint(y_color);
     y = z; /* y now points to node to be actually deleted */
   
   } else {
@@ -1078,45 +3446,142 @@ rbtree<Key, Compare>::delete_rb_fix(node* z) {
   return z;
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::incr_subtree_sizes(end_node* nd) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::incr_subtree_sizes(end_node* nd) {
 
   node::incr_subtree_sizes(nd, end_node_ptr());
 }
 
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::decr_subtree_sizes(end_node* nd) {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::decr_subtree_sizes(end_node* nd) {
 
   node::decr_subtree_sizes(nd, end_node_ptr());
 }
 
-template <typename Key, typename Compare>
-typename rbtree<Key, Compare>::size_type 
-rbtree<Key, Compare>::less_than(const key_type& key) const {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbtree<Key, Compare, Allocator, NodeSize>::size_type 
+rbtree<Key, Compare, Allocator, NodeSize>::less_than_in(const node* cur, const K& key) const {
 
-  const end_node* current = find_lower_bound_node(root.get(), key);
+  size_type number = 0;
 
-  if (current == end_node_ptr()) {
-    return size();
-  }
+  while (cur != nullptr) {
 
-  size_type number = node::subtree_size(current->get_left());
+    if (cmp(cur->value, key)) {
 
-  while (current != end_node_ptr()) {
+      number += 1 + node::subtree_size(cur->get_left());
+      cur = cur->get_right();
 
-    auto nd = static_cast<const node*>(current);
-    if (nd->on_right()) {
-      number += 1 + node::subtree_size(nd->sibling());
+    } else {
+      cur = cur->get_left();
     }
+  }
+
+  return number;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbtree<Key, Compare, Allocator, NodeSize>::size_type 
+rbtree<Key, Compare, Allocator, NodeSize>::not_greater_in(const node* cur, const K& key) const {
 
-    current = static_cast<const node*>(current)->parent_as_end();
+  size_type number = 0;
+
+  while (cur != nullptr) {
+
+    if (!cmp(key, cur->value)) {
+
+      number += 1 + node::subtree_size(cur->get_left());
+      cur = cur->get_right();
+
+    } else {
+      cur = cur->get_left();
+    }
   }
 
   return number;
 }
 
-template <typename Key, typename Compare>
-bool rbtree<Key, Compare>::debug_validate() const {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbtree<Key, Compare, Allocator, NodeSize>::size_type 
+rbtree<Key, Compare, Allocator, NodeSize>::count_equiv(const K& key) const {
+
+  const node* cur = root.get();
+
+  while (cur != nullptr) {
+
+    if (cmp(cur->value, key)) {
+      cur = cur->get_right();
+
+    } else if (cmp(key, cur->value)) {
+      cur = cur->get_left();
+
+    } else {
+
+      /* Equivalent elements of the left subtree form its suffix, of the right one - prefix. */
+      const node* left = cur->get_left();
+      return 1 + node::subtree_size(left) - less_than_in(left, key) 
+               + not_greater_in(cur->get_right(), key);
+    }
+  }
+
+  return 0;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbtree<Key, Compare, Allocator, NodeSize>::difference_type 
+rbtree<Key, Compare, Allocator, NodeSize>::distance_keys(const K& first, const K& second) const {
+
+  if (cmp(first, second)) {
+    return static_cast<difference_type>(count_range_keys(first, second));
+  }
+
+  return -static_cast<difference_type>(count_range_keys(second, first));
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename K>
+typename rbtree<Key, Compare, Allocator, NodeSize>::size_type 
+rbtree<Key, Compare, Allocator, NodeSize>::count_range_keys(const K& lo, const K& hi) const {
+
+  if (!cmp(lo, hi)) {
+    return 0;
+  }
+
+  const node* cur = root.get();
+
+  /* Common part of the paths: both bounds are on the same side of the node. */
+  while (cur != nullptr) {
+
+    if (cmp(cur->value, lo)) {
+      cur = cur->get_right();
+
+    } else if (!cmp(cur->value, hi)) {
+      cur = cur->get_left();
+
+    } else {
+
+      /* lo <= cur < hi: paths diverge here. */
+      const node* left = cur->get_left();
+      return 1 + node::subtree_size(left) - less_than_in(left, lo) 
+               + less_than_in(cur->get_right(), hi);
+    }
+  }
+
+  return 0;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename rbtree<Key, Compare, Allocator, NodeSize>::size_type 
+rbtree<Key, Compare, Allocator, NodeSize>::rank_node(const end_node* nd) const {
+
+  return node::rank(nd);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool rbtree<Key, Compare, Allocator, NodeSize>::debug_validate() const {
 
   const node* root_node = root.get();
 
@@ -1126,7 +3591,7 @@ bool rbtree<Key, Compare>::debug_validate() const {
 
   bool res = true;
 
-  if (root_node->color != node::color::BLACK) {
+  if (!root_node->is_black()) {
 
     std::cerr << "Debug validation: root is not black. \n";
     res = false;
@@ -1152,8 +3617,8 @@ bool rbtree<Key, Compare>::debug_validate() const {
  * Generates file with name 'graph_name' in png format in current 
  * working directory. 
  */
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::graph_dump(const std::string& graph_name) const {
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::graph_dump(const std::string& graph_name) const {
 
   char dot_file_name[] = "graphXXXXXX";
   if (mkstemp(dot_file_name) == -1) {
@@ -1176,9 +3641,9 @@ void rbtree<Key, Compare>::graph_dump(const std::string& graph_name) const {
   remove(dot_file_name);
 }
 
-template <typename Key, typename Compare>
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
   template <typename CharT>
-  void rbtree<Key, Compare>::graph_dump(std::basic_ostream<CharT>& os) const {
+  void rbtree<Key, Compare, Allocator, NodeSize>::graph_dump(std::basic_ostream<CharT>& os) const {
 
     os << "digraph G{\n rankdir=TB;\n "
        << "node[ shape = doubleoctagon; style = filled ];\n"
@@ -1190,8 +3655,8 @@ template <typename Key, typename Compare>
   }
 
 /* Call dot to generate png image from txt source. */
-template <typename Key, typename Compare>
-void rbtree<Key, Compare>::generate_graph(const std::string& dot_file, 
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void rbtree<Key, Compare, Allocator, NodeSize>::generate_graph(const std::string& dot_file, 
                                           const std::string& graph_name) {
 
   std::string cmnd = "dot " + dot_file + " -Tpng -o " + graph_name;
@@ -1199,9 +3664,9 @@ void rbtree<Key, Compare>::generate_graph(const std::string& dot_file,
 }
 
 /* Write tree desctiption in dot format to temporary text file. */
-template <typename Key, typename Compare>
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
   template <typename CharT>
-  void rbtree<Key, Compare>::write_dot(std::basic_ostream<CharT>& os) const {
+  void rbtree<Key, Compare, Allocator, NodeSize>::write_dot(std::basic_ostream<CharT>& os) const {
 
     using std::size_t;
 
@@ -0,0 +1,434 @@
+#pragma once
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <cassert>
+#include <cstddef>
+#include <iterator>
+#include <optional>
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+
+#include "rbtree.hpp"
+
+namespace RBTREE {
+
+/*
+ * Ordered set range-partitioned across independently locked trees.
+ * Shard 'i' holds keys in [splitters[i - 1], splitters[i]), so writers
+ * of different key ranges do not contend. Since shards are ordered,
+ * global order statistics are local ones plus sizes of preceding shards,
+ * and merged order is concatenation of shards.
+ *
+ * Sizes of shards are read without locking other shards, so query running
+ * concurrently with writers sees each shard at its own moment.
+ * Iteration is not synchronized and should not run concurrently with writers.
+ */
+template <typename Key, typename Compare = std::less<Key>,
+                        typename Allocator = std::allocator<Key>,
+                        typename NodeSize = std::size_t>
+class sharded_rbtree {
+
+public:
+
+  using key_type        = Key;
+  using value_type      = Key;
+  using size_type       = std::size_t;
+  using difference_type = std::ptrdiff_t;
+  using key_compare     = Compare;
+  using allocator_type  = Allocator;
+
+  using tree_type = rbtree<Key, Compare, Allocator, NodeSize>;
+
+private:
+
+  static constexpr std::size_t cache_line = 64;
+
+  /* Shard is placed on its own cache lines, so locks of neighbours do not share them. */
+  struct alignas(cache_line) shard {
+
+    mutable std::mutex mtx;
+    tree_type tree;
+
+    /* Size of the tree, readable without the lock. */
+    std::atomic<size_type> size{0};
+
+    shard(const Compare& compare, const Allocator& alloc)
+    : tree(compare, alloc) {}
+  };
+
+  std::vector<key_type> splitters;
+  /* Shards are allocated separately, since they hold mutexes. */
+  std::vector<std::unique_ptr<shard>> shards;
+  std::size_t shard_count;
+
+  Compare cmp;
+
+  /* Index of the shard, key belongs to. */
+  std::size_t shard_of(const key_type& key) const {
+
+    return static_cast<std::size_t>(std::upper_bound(splitters.begin(), splitters.end(), key, cmp)
+                                  - splitters.begin());
+  }
+
+  /* Total size of shards preceding given one. */
+  size_type size_before(std::size_t idx) const;
+
+public:
+
+  class const_iterator;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  /*
+   * Ctor from sorted splitters without equivalent elements.
+   * Number of shards is number of splitters plus one.
+   */
+  explicit sharded_rbtree(std::vector<key_type> split_keys, const Compare& compare = Compare(),
+                                                           const Allocator& alloc = Allocator());
+
+  sharded_rbtree(std::initializer_list<key_type> split_keys, const Compare& compare = Compare(),
+                                                            const Allocator& alloc = Allocator())
+  : sharded_rbtree(std::vector<key_type>(split_keys), compare, alloc) {}
+
+  sharded_rbtree(const sharded_rbtree& that) = delete;
+  sharded_rbtree& operator=(const sharded_rbtree& that) = delete;
+
+  /* Number of shards. */
+  std::size_t shards_count() const noexcept { return shard_count; }
+
+  /* Writers, only the shard of the key is locked. */
+  bool insert(const key_type& key);
+  bool insert(key_type&& key);
+  size_type erase(const key_type& key);
+
+  /* Elements of the range are grouped by shards, so each shard is locked once. */
+  template <typename InputIt>
+  void insert(InputIt first, InputIt last);
+
+  void clear();
+
+  /* Readers. */
+  bool contains(const key_type& key) const;
+
+  size_type size() const { return size_before(shard_count); }
+  bool empty() const { return (size() == 0); }
+
+  /* Elements are returned by value, since they could be erased after the lock is released. */
+  std::optional<key_type> lower_bound(const key_type& key) const;
+
+  /*
+   * Global order statistics: local rank in the shard of the key
+   * plus sizes of all preceding shards.
+   */
+  size_type less_than(const key_type& key) const;
+
+  /*
+   * Elements in [lo, hi): tail of the shard of 'lo', sizes of the shards 
+   * in between and head of the shard of 'hi'. Each part is read once, so 
+   * the count is not a difference of two totals read at different moments.
+   */
+  size_type count_range(const key_type& lo, const key_type& hi) const;
+
+  difference_type distance(const key_type& first, const key_type& second) const {
+
+    return (cmp(second, first))? -static_cast<difference_type>(count_range(second, first)) 
+                               :  static_cast<difference_type>(count_range(first, second));
+  }
+
+  /* Element with given global index, nothing if index is out of range. */
+  std::optional<key_type> select(size_type index) const;
+
+  /* Shard with given index. Not synchronized. */
+  const tree_type& shard_tree(std::size_t idx) const { return shards[idx]->tree; }
+
+  /* Iteration over all shards in order. Not synchronized with writers. */
+  const_iterator cbegin() const;
+  const_iterator begin()  const { return cbegin(); }
+
+  const_iterator cend() const { return const_iterator(this, shard_count - 1, shards[shard_count - 1]->tree.cend()); }
+  const_iterator end()  const { return cend(); }
+
+  const_reverse_iterator crbegin() const { return const_reverse_iterator(cend()); }
+  const_reverse_iterator rbegin()  const { return crbegin(); }
+
+  const_reverse_iterator crend() const { return const_reverse_iterator(cbegin()); }
+  const_reverse_iterator rend()  const { return crend(); }
+
+  key_compare key_comp() const { return cmp; }
+};
+
+/*
+ * Iterator, chaining iterators of the shards. End iterator of non-last shard
+ * is never held: iterator is moved to the beginning of the next non-empty shard.
+ */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+class sharded_rbtree<Key, Compare, Allocator, NodeSize>::const_iterator {
+
+  using inner_iterator = typename tree_type::const_iterator;
+
+  const sharded_rbtree* set = nullptr;
+  std::size_t idx = 0;
+  inner_iterator it;
+
+  /* Skip ends of empty shards. */
+  void skip_forward() {
+
+    while (idx + 1 < set->shard_count && it == set->shards[idx]->tree.cend()) {
+      it = set->shards[++idx]->tree.cbegin();
+    }
+  }
+
+public:
+
+  using iterator_category = std::bidirectional_iterator_tag;
+  using difference_type   = std::ptrdiff_t;
+  using value_type        = Key;
+  using pointer           = const value_type*;
+  using reference         = const value_type&;
+
+  const_iterator() = default;
+
+  const_iterator(const sharded_rbtree* owner, std::size_t shard_idx, inner_iterator inner)
+  : set(owner), idx(shard_idx), it(inner) {
+
+    skip_forward();
+  }
+
+  reference operator*() const { return *it; }
+  pointer operator->() const { return &*it; }
+
+  const_iterator& operator++() {
+
+    ++it;
+    skip_forward();
+    return *this;
+  }
+
+  const_iterator& operator--() {
+
+    while (idx > 0 && it == set->shards[idx]->tree.cbegin()) {
+      it = set->shards[--idx]->tree.cend();
+    }
+
+    --it;
+    return *this;
+  }
+
+  const_iterator operator++(int) { auto temp(*this); operator++(); return temp; }
+  const_iterator operator--(int) { auto temp(*this); operator--(); return temp; }
+
+  friend bool operator==(const const_iterator& lhs, const const_iterator& rhs) {
+    return (lhs.idx == rhs.idx) && (lhs.it == rhs.it);
+  }
+};
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+sharded_rbtree<Key, Compare, Allocator, NodeSize>::sharded_rbtree(std::vector<key_type> split_keys,
+                                                                  const Compare& compare, const Allocator& alloc)
+: splitters(std::move(split_keys)),
+  shard_count(splitters.size() + 1),
+  cmp(compare) {
+
+  assert(std::adjacent_find(splitters.begin(), splitters.end(), [this](const key_type& lhs, const key_type& rhs) {
+    return !cmp(lhs, rhs);
+  }) == splitters.end());
+
+  shards.reserve(shard_count);
+  for (std::size_t i = 0; i < shard_count; ++i) {
+    shards.push_back(std::make_unique<shard>(compare, alloc));
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename sharded_rbtree<Key, Compare, Allocator, NodeSize>::size_type
+sharded_rbtree<Key, Compare, Allocator, NodeSize>::size_before(std::size_t idx) const {
+
+  size_type total = 0;
+  for (std::size_t i = 0; i < idx; ++i) {
+    total += shards[i]->size.load(std::memory_order_relaxed);
+  }
+
+  return total;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool sharded_rbtree<Key, Compare, Allocator, NodeSize>::insert(const key_type& key) {
+
+  shard& sh = *shards[shard_of(key)];
+  std::lock_guard lock(sh.mtx);
+
+  bool inserted = sh.tree.insert(key).second;
+  sh.size.store(sh.tree.size(), std::memory_order_relaxed);
+  return inserted;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool sharded_rbtree<Key, Compare, Allocator, NodeSize>::insert(key_type&& key) {
+
+  shard& sh = *shards[shard_of(key)];
+  std::lock_guard lock(sh.mtx);
+
+  bool inserted = sh.tree.insert(std::move(key)).second;
+  sh.size.store(sh.tree.size(), std::memory_order_relaxed);
+  return inserted;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename sharded_rbtree<Key, Compare, Allocator, NodeSize>::size_type
+sharded_rbtree<Key, Compare, Allocator, NodeSize>::erase(const key_type& key) {
+
+  shard& sh = *shards[shard_of(key)];
+  std::lock_guard lock(sh.mtx);
+
+  size_type erased = sh.tree.erase(key);
+  sh.size.store(sh.tree.size(), std::memory_order_relaxed);
+  return erased;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+template <typename InputIt>
+void sharded_rbtree<Key, Compare, Allocator, NodeSize>::insert(InputIt first, InputIt last) {
+
+  std::vector<std::vector<key_type>> groups(shard_count);
+  for (; first != last; ++first) {
+    groups[shard_of(*first)].push_back(*first);
+  }
+
+  for (std::size_t i = 0; i < shard_count; ++i) {
+
+    if (groups[i].empty()) {
+      continue;
+    }
+
+    shard& sh = *shards[i];
+    std::lock_guard lock(sh.mtx);
+
+    sh.tree.insert(std::make_move_iterator(groups[i].begin()), std::make_move_iterator(groups[i].end()));
+    sh.size.store(sh.tree.size(), std::memory_order_relaxed);
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+void sharded_rbtree<Key, Compare, Allocator, NodeSize>::clear() {
+
+  for (auto& sh : shards) {
+
+    std::lock_guard lock(sh->mtx);
+
+    sh->tree.clear();
+    sh->size.store(0, std::memory_order_relaxed);
+  }
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+bool sharded_rbtree<Key, Compare, Allocator, NodeSize>::contains(const key_type& key) const {
+
+  const shard& sh = *shards[shard_of(key)];
+  std::lock_guard lock(sh.mtx);
+
+  return sh.tree.contains(key);
+}
+
+/* If the shard of the key has no greater elements, bound is the first element of the next non-empty shard. */
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::optional<typename sharded_rbtree<Key, Compare, Allocator, NodeSize>::key_type>
+sharded_rbtree<Key, Compare, Allocator, NodeSize>::lower_bound(const key_type& key) const {
+
+  for (std::size_t i = shard_of(key); i < shard_count; ++i) {
+
+    const shard& sh = *shards[i];
+    std::lock_guard lock(sh.mtx);
+
+    auto it = sh.tree.lower_bound(key);
+    if (it != sh.tree.cend()) {
+      return *it;
+    }
+  }
+
+  return std::nullopt;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename sharded_rbtree<Key, Compare, Allocator, NodeSize>::size_type
+sharded_rbtree<Key, Compare, Allocator, NodeSize>::less_than(const key_type& key) const {
+
+  std::size_t idx = shard_of(key);
+  const shard& sh = *shards[idx];
+
+  size_type local = 0;
+  {
+    std::lock_guard lock(sh.mtx);
+    local = sh.tree.less_than(key);
+  }
+
+  return size_before(idx) + local;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename sharded_rbtree<Key, Compare, Allocator, NodeSize>::size_type
+sharded_rbtree<Key, Compare, Allocator, NodeSize>::count_range(const key_type& lo, const key_type& hi) const {
+
+  if (!cmp(lo, hi)) {
+    return 0;
+  }
+
+  std::size_t lo_idx = shard_of(lo);
+  std::size_t hi_idx = shard_of(hi);
+
+  if (lo_idx == hi_idx) {
+
+    const shard& sh = *shards[lo_idx];
+    std::lock_guard lock(sh.mtx);
+
+    return sh.tree.count_range(lo, hi);
+  }
+
+  size_type count = 0;
+  {
+    const shard& sh = *shards[lo_idx];
+    std::lock_guard lock(sh.mtx);
+
+    count += sh.tree.size() - sh.tree.less_than(lo);
+  }
+
+  for (std::size_t i = lo_idx + 1; i < hi_idx; ++i) {
+    count += shards[i]->size.load(std::memory_order_relaxed);
+  }
+
+  const shard& sh = *shards[hi_idx];
+  std::lock_guard lock(sh.mtx);
+
+  return count + sh.tree.less_than(hi);
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+std::optional<typename sharded_rbtree<Key, Compare, Allocator, NodeSize>::key_type>
+sharded_rbtree<Key, Compare, Allocator, NodeSize>::select(size_type index) const {
+
+  for (auto& sh : shards) {
+
+    std::lock_guard lock(sh->mtx);
+
+    size_type local_size = sh->tree.size();
+    if (index < local_size) {
+      return *sh->tree.select(index);
+    }
+
+    index -= local_size;
+  }
+
+  return std::nullopt;
+}
+
+template <typename Key, typename Compare, typename Allocator, typename NodeSize>
+typename sharded_rbtree<Key, Compare, Allocator, NodeSize>::const_iterator
+sharded_rbtree<Key, Compare, Allocator, NodeSize>::cbegin() const {
+
+  return const_iterator(this, 0, shards[0]->tree.cbegin());
+}
+
+}; /* namespace RBTREE */
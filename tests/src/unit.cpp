@@ -3,12 +3,60 @@
 #include <iostream>
 #include <iterator>
 #include <vector>
+#include <numeric>
+#include <set>
+#include <forward_list>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <string_view>
+#include <memory_resource>
 
 #include "rbtree.hpp"
+#include "rbmap.hpp"
+#include "rbmultiset.hpp"
+#include "rbpersistent.hpp"
+#include "rbconcurrent.hpp"
+#include "sharded_rbtree.hpp"
+#include "frozen_rbtree.hpp"
 
 using namespace RBTREE;
 using tree = rbtree<int>;
 
+namespace {
+
+/* Stateful allocator counting number of live allocations. */
+template <typename T>
+struct counting_allocator {
+
+  using value_type = T;
+
+  std::shared_ptr<long> live = std::make_shared<long>(0);
+
+  counting_allocator() = default;
+
+  template <typename U>
+  counting_allocator(const counting_allocator<U>& that) noexcept
+  : live(that.live) {}
+
+  T* allocate(std::size_t n) {
+    ++*live;
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* ptr, std::size_t n) noexcept {
+    --*live;
+    std::allocator<T>().deallocate(ptr, n);
+  }
+
+  template <typename U>
+  bool operator==(const counting_allocator<U>& that) const noexcept { 
+    return live == that.live; 
+  }
+};
+
+}; /* anonymous namespace */
+
 TEST(UNIT_TESTING, EMPTY_TREE) {
   tree t;
   EXPECT_EQ(t.size(), 0);
@@ -32,6 +80,35 @@ TEST(UNIT_TESTING, ITER_CTOR) {
   EXPECT_EQ(tv, ilist);
 }
 
+TEST(UNIT_TESTING, SORTED_CTOR) {
+
+  for (int n = 0; n < 70; ++n) {
+
+    std::vector<int> vec;
+    for (int i = 0; i < n; ++i) {
+      vec.push_back(i * 2);
+    }
+
+    tree t1(sorted_unique, vec.begin(), vec.end());
+    tree t2(vec.begin(), vec.end());
+
+    EXPECT_EQ(t1.size(), vec.size());
+    EXPECT_TRUE(std::equal(t1.begin(), t1.end(), vec.begin(), vec.end()));
+    EXPECT_TRUE(std::equal(t1.rbegin(), t1.rend(), vec.rbegin(), vec.rend()));
+    EXPECT_EQ(t1, t2);
+
+    t1.insert(-1);
+    t1.insert(n * 2 + 1);
+    EXPECT_EQ(t1.size(), vec.size() + 2);
+    EXPECT_EQ(t1.distance(t1.begin(), t1.end()), n + 2);
+  }
+
+  /* Unsorted range is still accepted by regular ctor. */
+  std::vector<int> vec = {3, 1, 2, 2};
+  tree t(vec.begin(), vec.end());
+  EXPECT_EQ(t, std::initializer_list<int>({1, 2, 3}));
+}
+
 TEST(UNIT_TESTING, ITERATORS) {
 
   auto ilist = {1, 2, 3, 4, 5};
@@ -100,6 +177,63 @@ TEST(UNIT_TESTING, INSERT) {
   EXPECT_TRUE(std::equal(t2.begin(), t2.end(), vec.begin()));
 }
 
+TEST(UNIT_TESTING, EMPLACE) {
+
+  tree t;
+
+  auto res1 = t.emplace(10);
+  EXPECT_NE(res1.first, t.end());
+  EXPECT_TRUE(res1.second);
+
+  auto res2 = t.emplace(10);
+  EXPECT_EQ(res2.first, t.end());
+  EXPECT_FALSE(res2.second);
+
+  for (int i = 0; i < 20; ++i) {
+    t.emplace(i % 7);
+  }
+
+  auto l = {0, 1, 2, 3, 4, 5, 6, 10};
+  EXPECT_EQ(t, l);
+  EXPECT_TRUE(std::equal(t.rbegin(), t.rend(), std::rbegin(l)));
+}
+
+TEST(UNIT_TESTING, INSERT_HINT) {
+
+  tree t;
+
+  for (int i = 0; i < 100; i += 2) {
+    t.insert(t.end(), i);
+  }
+
+  for (int i = 1; i < 100; i += 2) {
+    t.insert(t.lower_bound(i), i);
+  }
+
+  /* Wrong hints. */
+  t.insert(t.begin(), 1000);
+  t.insert(t.end(), -1000);
+
+  auto it = t.insert(t.begin(), 50);
+  EXPECT_EQ(*it, 50);
+  EXPECT_EQ(t.size(), 102);
+
+  std::vector<int> vec;
+  for (int i = 0; i < 100; ++i) {
+    vec.push_back(i);
+  }
+  vec.insert(vec.begin(), -1000);
+  vec.push_back(1000);
+
+  EXPECT_TRUE(std::equal(t.begin(), t.end(), vec.begin(), vec.end()));
+  EXPECT_TRUE(std::equal(t.rbegin(), t.rend(), vec.rbegin(), vec.rend()));
+
+  auto it2 = t.emplace_hint(t.find(10), 9);
+  EXPECT_EQ(it2, t.find(9));
+  EXPECT_EQ(*t.emplace_hint(t.end(), 500), 500);
+  EXPECT_EQ(t.size(), 103);
+}
+
 TEST(UNIT_TESTING, ERASE) {
 
   tree t = {10, 20, 30, 40, 50};
@@ -214,10 +348,1042 @@ TEST(UNIT_TESTING, DISTANCE) {
 
   EXPECT_EQ(t.distance(t.begin(), t.begin()), 0);
   EXPECT_EQ(t.distance(1, 1), 0);
+
+  EXPECT_EQ(t.distance(9, 1), -4);
+  EXPECT_EQ(t.distance(0, 10), 5);
+  EXPECT_EQ(t.distance(t.end(), t.begin()), -5);
+}
+
+TEST(UNIT_TESTING, COUNT_RANGE) {
+  
+  tree t = {1, 3, 5, 7, 9};
+
+  EXPECT_EQ(t.less_than(0), 0);
+  EXPECT_EQ(t.less_than(1), 0);
+  EXPECT_EQ(t.less_than(6), 3);
+  EXPECT_EQ(t.less_than(10), 5);
+
+  EXPECT_EQ(t.count_range(1, 9), 4);
+  EXPECT_EQ(t.count_range(0, 10), 5);
+  EXPECT_EQ(t.count_range(2, 8), 3);
+  EXPECT_EQ(t.count_range(4, 5), 0);
+  EXPECT_EQ(t.count_range(5, 5), 0);
+  EXPECT_EQ(t.count_range(9, 1), 0);
+  EXPECT_EQ(t.count_range(10, 20), 0);
+}
+
+TEST(UNIT_TESTING, ALLOCATOR) {
+
+  counting_allocator<int> alloc;
+
+  {
+    rbtree<int, std::less<int>, counting_allocator<int>> t({1, 2, 3, 4, 5}, alloc);
+    EXPECT_EQ(*alloc.live, 5);
+
+    auto copy = t;
+    EXPECT_EQ(copy, t);
+    EXPECT_EQ(*alloc.live, 10);
+
+    t.erase(3);
+    t.emplace(3);
+    EXPECT_EQ(*alloc.live, 10);
+
+    t.clear();
+    EXPECT_EQ(*alloc.live, 5);
+    EXPECT_EQ(t.get_allocator(), alloc);
+  }
+
+  EXPECT_EQ(*alloc.live, 0);
+
+  using pmr_tree = rbtree<int, std::less<int>, std::pmr::polymorphic_allocator<int>>;
+
+  std::pmr::monotonic_buffer_resource resource;
+  pmr_tree t1({5, 4, 3, 2, 1}, &resource);
+  pmr_tree t2(t1, &resource);
+  EXPECT_TRUE(std::equal(t1.begin(), t1.end(), t2.begin(), t2.end()));
+
+  /* Allocators are not propagated - elements are moved one by one. */
+  pmr_tree t3;
+  t3 = std::move(t1);
+  EXPECT_EQ(t3.size(), 5);
+  EXPECT_TRUE(t1.empty());
+  EXPECT_EQ(t3.get_allocator().resource(), std::pmr::get_default_resource());
+
+  t2 = std::move(t3);
+  EXPECT_EQ(t2.size(), 5);
+  EXPECT_EQ(t2.get_allocator().resource(), &resource);
+}
+
+TEST(UNIT_TESTING, POOL) {
+
+  pool_rbtree<int> t;
+  for (int i = 0; i < 1000; ++i) {
+    t.insert(i);
+  }
+
+  auto slabs = t.get_allocator().slab_count();
+  EXPECT_GT(slabs, 1);
+
+  /* Freed nodes are reused. */
+  t.erase(t.begin(), std::next(t.begin(), 500));
+  for (int i = 0; i < 500; ++i) {
+    t.insert(-i);
+  }
+  EXPECT_EQ(t.size(), 1000);
+  EXPECT_EQ(t.get_allocator().slab_count(), slabs);
+
+  /* Copy gets its own arena. */
+  auto copy = t;
+  EXPECT_EQ(copy, t);
+  EXPECT_NE(copy.get_allocator(), t.get_allocator());
+
+  t.clear();
+  EXPECT_TRUE(t.empty());
+  EXPECT_EQ(t.get_allocator().slab_count(), 0);
+
+  t.insert({3, 1, 2});
+  EXPECT_EQ(t, std::initializer_list<int>({1, 2, 3}));
+
+  t = std::move(copy);
+  EXPECT_EQ(t.size(), 1000);
+
+  pool_rbtree<std::string> strs = {"b", "a", "c"};
+  strs.clear();
+  EXPECT_TRUE(strs.empty());
+}
+
+TEST(UNIT_TESTING, SELECT_RANK) {
+
+  tree t;
+  for (int i = 0; i < 100; ++i) {
+    t.insert((i * 37) % 100);
+  }
+
+  for (int i = 0; i < 100; ++i) {
+
+    auto it = t.select(static_cast<tree::size_type>(i));
+    EXPECT_EQ(*it, i);
+    EXPECT_EQ(t.rank(it), i);
+    EXPECT_EQ(*(t.begin() + i), i);
+    EXPECT_EQ(*(t.end() - (100 - i)), i);
+    EXPECT_EQ(t.begin()[i], i);
+    EXPECT_EQ(it - t.begin(), i);
+    EXPECT_EQ(t.end() - it, 100 - i);
+
+    for (int j = 0; j < 100; j += 9) {
+      EXPECT_EQ(it + (j - i), t.select(static_cast<tree::size_type>(j)));
+    }
+
+    EXPECT_EQ(it + (100 - i), t.end());
+  }
+
+  EXPECT_EQ(t.select(100), t.end());
+  EXPECT_EQ(t.rank(t.end()), 100);
+  EXPECT_EQ(t.end() + 0, t.end());
+}
+
+TEST(UNIT_TESTING, COMPACT_NODE) {
+
+  using compact_tree = rbtree<int, std::less<int>, std::allocator<int>, std::uint32_t>;
+
+  compact_tree t;
+  for (int i = 0; i < 1000; ++i) {
+    t.insert((i * 7) % 1000);
+  }
+
+  for (int i = 0; i < 1000; i += 3) {
+    t.erase(i);
+  }
+
+  EXPECT_EQ(t.size(), 666);
+  EXPECT_EQ(*t.select(0), 1);
+  EXPECT_EQ(t.distance(t.begin(), t.end()), 666);
+
+  compact_tree t2(t);
+  EXPECT_EQ(t, t2);
+
+  auto it = t2.emplace_hint(t2.end(), 2000);
+  EXPECT_EQ(*it, 2000);
+  EXPECT_EQ(t2.rank(it), 666);
+}
+
+TEST(UNIT_TESTING, TRANSPARENT_LOOKUP) {
+
+  using namespace std::string_view_literals;
+  rbtree<std::string, std::less<>> t = {"apple", "banana", "cherry", "date"};
+
+  EXPECT_EQ(*t.find("banana"sv), "banana");
+  EXPECT_EQ(t.find("fig"sv), t.end());
+  EXPECT_TRUE(t.contains("cherry"sv));
+  EXPECT_FALSE(t.contains("apricot"sv));
+
+  EXPECT_EQ(*t.lower_bound("b"sv), "banana");
+  EXPECT_EQ(*t.upper_bound("banana"sv), "cherry");
+  EXPECT_EQ(t.equal_range("date"sv).first, t.find("date"sv));
+
+  EXPECT_EQ(t.less_than("c"sv), 2);
+  EXPECT_EQ(t.count_range("b"sv, "d"sv), 2);
+  EXPECT_EQ(t.distance("d"sv, "a"sv), -3);
+
+  /* Probe type, which is not convertible to the key type. */
+  struct length_less {
+    using is_transparent = void;
+    bool operator()(const std::string& lhs, const std::string& rhs) const { return lhs.size() < rhs.size(); }
+    bool operator()(const std::string& lhs, std::size_t rhs) const { return lhs.size() < rhs; }
+    bool operator()(std::size_t lhs, const std::string& rhs) const { return lhs < rhs.size(); }
+    bool operator()(std::size_t lhs, std::size_t rhs) const { return lhs < rhs; }
+  };
+
+  rbtree<std::string, length_less> by_len = {"a", "bbb", "cc", "ddddd"};
+  EXPECT_EQ(*by_len.find(std::size_t{3}), "bbb");
+  EXPECT_FALSE(by_len.contains(std::size_t{4}));
+  EXPECT_EQ(by_len.count_range(std::size_t{2}, std::size_t{5}), 2);
+}
+
+TEST(UNIT_TESTING, RBMAP) {
+
+  rbmap<int, std::string> m = {{3, "c"}, {1, "a"}, {2, "b"}};
+
+  EXPECT_EQ(m.size(), 3);
+  EXPECT_EQ(m[2], "b");
+  EXPECT_EQ(m.at(3), "c");
+  EXPECT_THROW(m.at(4), std::out_of_range);
+
+  /* Modification in place through operator[] and iterators. */
+  m[2] = "bb";
+  m.begin()->second += "a";
+  EXPECT_EQ(m.at(1), "aa");
+  EXPECT_EQ(m.at(2), "bb");
+
+  m[5];
+  EXPECT_EQ(m.size(), 4);
+  EXPECT_TRUE(m.at(5).empty());
+
+  /* try_emplace does not move from arguments if key is present. */
+  std::string value = "value";
+  auto [it, inserted] = m.try_emplace(1, std::move(value));
+  EXPECT_FALSE(inserted);
+  EXPECT_EQ(it->second, "aa");
+  EXPECT_EQ(value, "value");
+
+  EXPECT_TRUE(m.try_emplace(4, 3, 'd').second);
+  EXPECT_EQ(m.at(4), "ddd");
+  EXPECT_EQ(m.try_emplace(m.end(), 6, "f")->second, "f");
+
+  EXPECT_FALSE(m.insert_or_assign(4, "four").second);
+  EXPECT_EQ(m.at(4), "four");
+  EXPECT_TRUE(m.insert_or_assign(0, "zero").second);
+
+  EXPECT_FALSE(m.insert({1, "x"}).second);
+  EXPECT_TRUE(m.emplace(7, "g").second);
+  EXPECT_FALSE(m.emplace(7, "h").second);
+  EXPECT_EQ(m.at(7), "g");
+
+  /* Order statistics over keys. */
+  EXPECT_EQ(m.size(), 8);
+  EXPECT_EQ(m.select(4)->first, 4);
+  EXPECT_EQ(m.rank(m.find(6)), 6);
+  EXPECT_EQ(m.distance(1, 6), 5);
+  EXPECT_EQ(m.count_range(2, 5), 3);
+
+  std::vector<int> keys;
+  for (auto& [key, val] : m) {
+    keys.push_back(key);
+  }
+
+  EXPECT_EQ(keys, std::vector<int>({0, 1, 2, 3, 4, 5, 6, 7}));
+
+  EXPECT_TRUE(m.erase(3));
+  EXPECT_FALSE(m.erase(3));
+  EXPECT_EQ(m.erase(m.find(0))->first, 1);
+  EXPECT_EQ(m.size(), 6);
+
+  auto copy = m;
+  EXPECT_EQ(copy, m);
+  copy[1] = "changed";
+  EXPECT_FALSE(copy == m);
+}
+
+TEST(UNIT_TESTING, MULTISET) {
+
+  rbmultiset<int> ms = {5, 1, 3, 3, 1, 3};
+  std::multiset<int> ref = {5, 1, 3, 3, 1, 3};
+
+  EXPECT_EQ(ms.size(), 6);
+  EXPECT_TRUE(std::equal(ms.begin(), ms.end(), ref.begin(), ref.end()));
+
+  for (int i = 0; i < 200; ++i) {
+
+    int key = (i * 7) % 13;
+    ms.insert(key);
+    ref.insert(key);
+
+    if (i % 5 == 0) {
+      ms.insert(ms.find(key), key);
+      ref.insert(key);
+    }
+  }
+
+  for (int key = -1; key < 15; ++key) {
+
+    EXPECT_EQ(ms.count(key), ref.count(key));
+    auto [first, last] = ms.equal_range(key);
+    EXPECT_EQ(ms.distance(first, last), static_cast<std::ptrdiff_t>(ref.count(key)));
+    EXPECT_EQ(ms.rank(first), static_cast<std::size_t>(std::distance(ref.begin(), ref.lower_bound(key))));
+  }
+
+  EXPECT_EQ(ms.erase(3), ref.erase(3));
+  EXPECT_EQ(ms.count(3), 0);
+  EXPECT_TRUE(std::equal(ms.begin(), ms.end(), ref.begin(), ref.end()));
+
+  /* Equivalent elements are kept in order of insertion. */
+  using item = std::pair<int, int>;
+  auto by_first = [](const item& lhs, const item& rhs) { return lhs.first < rhs.first; };
+
+  rbmultiset<item, decltype(by_first)> events;
+  for (int i = 0; i < 10; ++i) {
+    events.emplace(i % 2, i);
+  }
+
+  EXPECT_EQ(events.count({1, 0}), 5);
+  int prev = -1;
+  for (auto it = events.lower_bound({1, 0}); it != events.end(); ++it) {
+    EXPECT_GT(it->second, prev);
+    prev = it->second;
+  }
+
+  /* Sorted range is accepted even with duplicates. */
+  std::vector<int> sorted = {1, 1, 2, 2, 2, 3};
+  rbmultiset<int> from_sorted(sorted.begin(), sorted.end());
+  EXPECT_EQ(from_sorted.count(2), 3);
+  EXPECT_EQ(*from_sorted.select(5), 3);
+}
+
+TEST(UNIT_TESTING, EXTRACT_MERGE) {
+
+  using alloc_tree = rbtree<int, std::less<int>, counting_allocator<int>>;
+
+  counting_allocator<int> alloc;
+  alloc_tree src({1, 2, 3, 4, 5}, alloc);
+  alloc_tree dst({4, 10}, alloc);
+  EXPECT_EQ(*alloc.live, 7);
+
+  /* Node is relinked, not reallocated. */
+  const int* addr = &*src.find(3);
+  auto nh = src.extract(3);
+  EXPECT_FALSE(nh.empty());
+  EXPECT_EQ(nh.value(), 3);
+  EXPECT_EQ(src.size(), 4);
+  EXPECT_EQ(src.rank(src.find(4)), 2);
+
+  auto res = dst.insert(std::move(nh));
+  EXPECT_TRUE(res.inserted);
+  EXPECT_TRUE(res.node.empty());
+  EXPECT_EQ(&*res.position, addr);
+  EXPECT_EQ(*alloc.live, 7);
+
+  /* Node with equivalent key is returned back. */
+  res = dst.insert(src.extract(src.find(4)));
+  EXPECT_FALSE(res.inserted);
+  EXPECT_EQ(res.node.value(), 4);
+  EXPECT_EQ(*res.position, 4);
+
+  res.node.value() = 6;
+  EXPECT_EQ(*dst.insert(dst.end(), std::move(res.node)), 6);
+  EXPECT_TRUE(src.extract(42).empty());
+
+  src.insert({4, 10});
+  dst.merge(src);
+  EXPECT_EQ(dst, std::initializer_list<int>({1, 2, 3, 4, 5, 6, 10}));
+  EXPECT_EQ(src, std::initializer_list<int>({4, 10}));
+  EXPECT_EQ(*alloc.live, 9);
+  EXPECT_EQ(dst.select(5), dst.find(6));
+
+  /* Node handle destroys not inserted node. */
+  {
+    auto dropped = dst.extract(dst.begin());
+  }
+  EXPECT_EQ(*alloc.live, 8);
+
+  /* Merge between map and multiset variants. */
+  rbmap<int, std::string> m1 = {{1, "a"}, {2, "b"}};
+  rbmap<int, std::string> m2 = {{2, "x"}, {3, "c"}};
+  auto mnh = m2.extract(3);
+  mnh.mapped() = "cc";
+  mnh.key() = 4;
+  m1.insert(std::move(mnh));
+  m1.merge(m2);
+  EXPECT_EQ(m1.at(4), "cc");
+  EXPECT_EQ(m1.at(2), "b");
+  EXPECT_EQ(m2.size(), 1);
+
+  rbmultiset<int> ms1 = {1, 2, 2};
+  rbmultiset<int> ms2 = {2, 3};
+  ms1.insert(ms2.extract(3));
+  ms1.merge(ms2);
+  EXPECT_TRUE(ms2.empty());
+  EXPECT_EQ(ms1.count(2), 3);
+  EXPECT_EQ(ms1.size(), 5);
+}
+
+TEST(UNIT_TESTING, SPLIT_JOIN) {
+
+  std::vector<int> keys(1000);
+  std::iota(keys.begin(), keys.end(), 0);
+
+  rbtree<int> t(keys.begin(), keys.end());
+  auto [lhs, rhs] = t.split(400);
+
+  EXPECT_TRUE(t.empty());
+  EXPECT_EQ(lhs.size(), 400);
+  EXPECT_EQ(rhs.size(), 600);
+  EXPECT_EQ(*lhs.rbegin(), 399);
+  EXPECT_EQ(*rhs.begin(), 400);
+  EXPECT_EQ(rhs.rank(rhs.find(700)), 300);
+  EXPECT_TRUE(std::equal(lhs.rbegin(), lhs.rend(), keys.rbegin() + 600));
+
+  /* Split by absent key and by key out of range. */
+  auto [lo, hi] = lhs.split(-1);
+  EXPECT_TRUE(lo.empty());
+  EXPECT_EQ(hi.size(), 400);
+
+  auto [evens, rest] = rbtree<int>({0, 2, 4, 6, 8}).split(5);
+  EXPECT_EQ(evens, std::initializer_list<int>({0, 2, 4}));
+  EXPECT_EQ(rest, std::initializer_list<int>({6, 8}));
+
+  /* Trees of very different heights. */
+  auto joined = rbtree<int>::join(std::move(hi), std::move(rhs));
+  EXPECT_TRUE(std::equal(joined.begin(), joined.end(), keys.begin(), keys.end()));
+  EXPECT_EQ(joined.select(999), std::prev(joined.end()));
+
+  auto small = rbtree<int>::join(rbtree<int>{-5, -3}, -2, rbtree<int>{});
+  auto all = rbtree<int>::join(std::move(small), -1, std::move(joined));
+  EXPECT_EQ(all.size(), 1004);
+  EXPECT_EQ(*all.begin(), -5);
+  EXPECT_EQ(all.distance(-3, 1), 4);
+
+  all.insert(-4);
+  all.erase(all.find(500));
+  EXPECT_EQ(all.rank(all.find(501)), 505);
+}
+
+TEST(UNIT_TESTING, ERASE_RANGE) {
+
+  std::vector<int> keys(1000);
+  std::iota(keys.begin(), keys.end(), 0);
+
+  rbtree<int> t(keys.begin(), keys.end());
+
+  /* Range in the middle, returned iterator points to the same node as 'last'. */
+  auto last = t.find(700);
+  auto it = t.erase(t.find(100), last);
+  EXPECT_EQ(it, last);
+  EXPECT_EQ(t.size(), 400);
+  EXPECT_EQ(*std::prev(it), 99);
+  EXPECT_EQ(t.rank(it), 100);
+  EXPECT_EQ(t.distance(50, 800), 150);
+
+  /* Prefix and suffix. */
+  EXPECT_EQ(t.erase(t.begin(), t.find(50)), t.find(50));
+  EXPECT_EQ(*t.begin(), 50);
+
+  EXPECT_EQ(t.erase(t.find(900), t.end()), t.end());
+  EXPECT_EQ(*t.rbegin(), 899);
+  EXPECT_EQ(t.size(), 250);
+
+  std::vector<int> expected;
+  std::copy(keys.begin() + 50, keys.begin() + 100, std::back_inserter(expected));
+  std::copy(keys.begin() + 700, keys.begin() + 900, std::back_inserter(expected));
+  EXPECT_TRUE(std::equal(t.begin(), t.end(), expected.begin(), expected.end()));
+  EXPECT_TRUE(std::equal(t.rbegin(), t.rend(), expected.rbegin(), expected.rend()));
+
+  t.insert(500);
+  EXPECT_EQ(t.rank(t.find(500)), 50);
+}
+
+TEST(UNIT_TESTING, SET_OPERATIONS) {
+
+  std::vector<int> even_keys(60000), third_keys(60000);
+  for (int i = 0; i < 60000; ++i) {
+
+    even_keys[static_cast<std::size_t>(i)]  = 2 * i;
+    third_keys[static_cast<std::size_t>(i)] = 3 * i;
+  }
+
+  /* Built in linear time. */
+  rbtree<int> evens(sorted_unique, even_keys.begin(), even_keys.end());
+  rbtree<int> thirds(sorted_unique, third_keys.begin(), third_keys.end());
+
+  /* Large enough to run halves of the recursion in parallel. */
+  rbtree<int> united(evens);
+  united.union_with(thirds, 4);
+  EXPECT_EQ(united.size(), 100000);
+  EXPECT_EQ(united.rank(united.find(9)), 6);
+
+  rbtree<int> common(evens);
+  common.intersect_with(thirds, 0);
+  EXPECT_EQ(common.size(), 20000);
+  EXPECT_EQ(*common.select(3), 18);
+  EXPECT_EQ(*common.rbegin(), 119994);
+
+  rbtree<int> diff(evens);
+  diff.difference_with(thirds);
+  EXPECT_EQ(diff.size(), 40000);
+  EXPECT_FALSE(diff.contains(6));
+  EXPECT_EQ(diff.distance(0, 12), 4);
+
+  /* Nodes of the source are relinked. */
+  rbtree<int> small = {1, 2, 3};
+  rbtree<int> other = {3, 5, 7};
+  const int* addr = &*other.find(5);
+
+  small.union_with(std::move(other));
+  EXPECT_TRUE(other.empty());
+  EXPECT_EQ(&*small.find(5), addr);
+  EXPECT_EQ(small, std::initializer_list<int>({1, 2, 3, 5, 7}));
+
+  small.intersect_with(rbtree<int>{});
+  EXPECT_TRUE(small.empty());
+}
+
+TEST(UNIT_TESTING, PARALLEL_COPY_CLEAR) {
+
+  std::vector<int> keys(100000);
+  std::iota(keys.begin(), keys.end(), 0);
+
+  rbtree<int> t(keys.begin(), keys.end());
+
+  /* Large enough to copy halves of the tree in parallel. */
+  rbtree<int> copy(parallel, t, 4);
+  EXPECT_EQ(copy, t);
+  EXPECT_TRUE(std::equal(copy.rbegin(), copy.rend(), keys.rbegin(), keys.rend()));
+  EXPECT_EQ(copy.rank(copy.find(54321)), 54321);
+
+  copy.erase(500);
+  copy.insert(-1);
+  EXPECT_EQ(*copy.begin(), -1);
+  EXPECT_EQ(*std::next(copy.find(499)), 501);
+
+  copy.clear(0);
+  EXPECT_TRUE(copy.empty());
+  EXPECT_EQ(copy.begin(), copy.end());
+
+  copy.insert({3, 1, 2});
+  EXPECT_EQ(copy, std::initializer_list<int>({1, 2, 3}));
+
+  /* Several levels of sibling tasks, which should not touch their shared parents. */
+  std::vector<int> more_keys(200000);
+  std::iota(more_keys.begin(), more_keys.end(), 0);
+
+  rbtree<int> large(sorted_unique, more_keys.begin(), more_keys.end());
+  large.clear(8);
+  EXPECT_TRUE(large.empty());
+
+  large.insert(1);
+  EXPECT_EQ(large.size(), 1);
+
+  /* Pool allocator is not shared between threads, copy is made in place. */
+  pool_rbtree<int> pooled(keys.begin(), keys.end());
+  pool_rbtree<int> pooled_copy(parallel, pooled, 4);
+  EXPECT_EQ(pooled_copy, pooled);
+  EXPECT_NE(pooled_copy.get_allocator(), pooled.get_allocator());
+
+  pooled_copy.clear(4);
+  EXPECT_TRUE(pooled_copy.empty());
+  EXPECT_EQ(pooled_copy.get_allocator().slab_count(), 0);
+
+  rbtree<int> empty_copy(parallel, rbtree<int>{}, 4);
+  EXPECT_TRUE(empty_copy.empty());
+}
+
+TEST(UNIT_TESTING, PERSISTENT) {
+
+  rbpersistent<int> t;
+  std::set<int> expected;
+
+  for (int i = 0; i < 2000; ++i) {
+
+    int key = (i * 7919) % 1000;
+    EXPECT_EQ(t.insert(key), expected.insert(key).second);
+  }
+
+  EXPECT_EQ(t.size(), 1000);
+  EXPECT_TRUE(std::equal(t.begin(), t.end(), expected.begin(), expected.end()));
+  EXPECT_TRUE(std::equal(t.rbegin(), t.rend(), expected.rbegin(), expected.rend()));
+
+  /* Snapshot is not affected by later updates. */
+  auto snap = t.snapshot();
+  for (int i = 0; i < 1000; i += 3) {
+    EXPECT_EQ(t.erase(i), 1);
+  }
+  EXPECT_EQ(t.erase(0), 0);
+  t.insert(-5);
+
+  EXPECT_EQ(snap.size(), 1000);
+  EXPECT_TRUE(std::equal(snap.begin(), snap.end(), expected.begin(), expected.end()));
+  EXPECT_TRUE(snap.contains(3));
+  EXPECT_FALSE(t.contains(3));
+
+  EXPECT_EQ(t.size(), 1000 - 334 + 1);
+  EXPECT_EQ(*t.begin(), -5);
+  EXPECT_EQ(*t.lower_bound(3), 4);
+  EXPECT_EQ(*t.upper_bound(4), 5);
+  EXPECT_EQ(t.find(6), t.end());
+
+  /* Order statistics. */
+  EXPECT_EQ(*t.select(1), 1);
+  EXPECT_EQ(t.rank(t.find(5)), 4);
+  EXPECT_TRUE(t.debug_validate());
+  EXPECT_EQ(t.less_than(1000), t.size());
+  EXPECT_EQ(snap.rank(snap.select(500)), 500);
+  EXPECT_EQ(t.select(t.size()), t.end());
+
+  /* Reverse iterators are kept at their elements, going back from rend() reaches the least one. */
+  auto rit = t.rbegin();
+  EXPECT_EQ(*rit, 998);
+  EXPECT_EQ(*rit++, 998);
+  EXPECT_EQ(*rit, 997);
+  EXPECT_EQ(rit.base(), t.find(998));
+  EXPECT_EQ(*std::prev(t.rend()), -5);
+  EXPECT_EQ(t.rend().base(), t.begin());
+  EXPECT_EQ(std::distance(t.rbegin(), t.rend()), static_cast<std::ptrdiff_t>(t.size()));
+  EXPECT_EQ(rbpersistent<int>().rbegin(), rbpersistent<int>().rend());
+
+  /* Built from the tree in linear time. */
+  rbtree<int> source = {1, 2, 3, 4, 5, 6, 7};
+  rbpersistent<int> from_tree(sorted_unique, source.begin(), source.end());
+  EXPECT_TRUE(from_tree.debug_validate());
+  EXPECT_TRUE(std::equal(from_tree.begin(), from_tree.end(), source.begin(), source.end()));
+
+  snap = from_tree;
+  from_tree.clear();
+  EXPECT_TRUE(from_tree.empty());
+  EXPECT_EQ(snap, rbpersistent<int>({7, 6, 5, 4, 3, 2, 1}));
+
+  /* Snapshot is read while the source is modified. */
+  rbpersistent<int> shared(sorted_unique, expected.begin(), expected.end());
+  auto reader_snap = shared.snapshot();
+
+  std::thread reader([&reader_snap] {
+    for (int pass = 0; pass < 20; ++pass) {
+      EXPECT_EQ(std::distance(reader_snap.begin(), reader_snap.end()), 1000);
+    }
+  });
+
+  for (int i = 0; i < 1000; ++i) {
+    shared.erase(i);
+  }
+
+  reader.join();
+  EXPECT_TRUE(shared.empty());
+  EXPECT_TRUE(reader_snap.debug_validate());
+}
+
+TEST(UNIT_TESTING, CONCURRENT) {
+
+  rbconcurrent<int> t;
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(t.insert(2 * i));
+  }
+
+  /* Changes, which do nothing, publish no version. */
+  auto current = [&t] { return t.read([](const rbconcurrent<int>::tree_type& version) { return &version; }); };
+  auto published = current();
+
+  EXPECT_FALSE(t.insert(0));
+  EXPECT_EQ(t.erase(1), 0);
+  t.update([](rbconcurrent<int>::tree_type& version) { return version.contains(1); });
+  EXPECT_EQ(current(), published);
+
+  EXPECT_EQ(t.erase(0), 1);
+  EXPECT_NE(current(), published);
+  EXPECT_TRUE(t.insert(0));
+  EXPECT_EQ(t.size(), 1000);
+  EXPECT_TRUE(t.contains(10));
+  EXPECT_EQ(t.lower_bound(11), 12);
+  EXPECT_EQ(t.upper_bound(12), 14);
+  EXPECT_EQ(t.lower_bound(5000), std::nullopt);
+  EXPECT_EQ(t.less_than(11), 6);
+  EXPECT_EQ(t.distance(0, 100), 50);
+  EXPECT_EQ(t.count_range(10, 20), 5);
+
+  /* Readers see either none or all of the batched modifications. */
+  std::atomic<bool> done = false;
+  std::vector<std::thread> readers;
+
+  for (int r = 0; r < 4; ++r) {
+    readers.emplace_back([&t, &done] {
+      while (!done.load()) {
+
+        auto [size, odd] = t.read([](const rbconcurrent<int>::tree_type& version) {
+          return std::pair(version.size(), version.count_range(-1, 1));
+        });
+
+        EXPECT_EQ(size, 1000);
+        EXPECT_LE(odd, 1);
+        EXPECT_EQ(t.distance(0, 10000), 1000);
+      }
+    });
+  }
+
+  for (int i = 0; i < 500; ++i) {
+    t.update([i](rbconcurrent<int>::tree_type& version) {
+      version.erase(2 * i);
+      version.insert(2 * i + 1);
+    });
+  }
+
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  auto snap = t.snapshot();
+  t.clear();
+  t.reclaim();
+
+  EXPECT_TRUE(t.empty());
+  EXPECT_EQ(snap.size(), 1000);
+  EXPECT_TRUE(snap.contains(999));
+  EXPECT_FALSE(snap.contains(998));
+  EXPECT_TRUE(snap.debug_validate());
+}
+
+TEST(UNIT_TESTING, SHARDED) {
+
+  sharded_rbtree<int> t = {1000, 2000, 3000};
+  EXPECT_EQ(t.shards_count(), 4);
+  EXPECT_EQ(t.begin(), t.end());
+
+  /* Writers of different shards run in parallel. */
+  std::vector<std::thread> writers;
+  for (int w = 0; w < 4; ++w) {
+    writers.emplace_back([&t, w] {
+      for (int i = w * 1000; i < (w + 1) * 1000; i += 2) {
+        t.insert(i);
+      }
+    });
+  }
+
+  for (auto& writer : writers) {
+    writer.join();
+  }
+
+  EXPECT_EQ(t.size(), 2000);
+  EXPECT_EQ(t.shard_tree(2).size(), 500);
+  EXPECT_TRUE(t.contains(2002));
+  EXPECT_FALSE(t.insert(2002));
+  EXPECT_EQ(t.erase(2002), 1);
+
+  /* Global order statistics. */
+  EXPECT_EQ(t.less_than(2003), 1001);
+  EXPECT_EQ(t.less_than(5000), 1999);
+  EXPECT_EQ(t.distance(500, 2500), 999);
+  EXPECT_EQ(t.count_range(0, 1000), 500);
+  EXPECT_EQ(t.select(1001), 2004);
+  EXPECT_EQ(t.select(1999), std::nullopt);
+  EXPECT_EQ(t.lower_bound(999), 1000);
+  EXPECT_EQ(t.count_range(2001, 2010), 3);
+  EXPECT_EQ(t.distance(2500, 500), -999);
+
+  /* Counts of ranges past a shrinking and growing shard stay exact. */
+  std::atomic<bool> done = false;
+  std::thread eraser([&t, &done] {
+    while (!done) {
+      for (int i = 0; i < 1000; i += 2) {
+        t.erase(i);
+      }
+      for (int i = 0; i < 1000; i += 2) {
+        t.insert(i);
+      }
+    }
+  });
+
+  bool exact = true;
+  for (int round = 0; round < 20000; ++round) {
+    exact = exact && (t.count_range(1500, 1510) == 5) && (t.count_range(1500, 2500) == 499);
+  }
+
+  done = true;
+  eraser.join();
+
+  EXPECT_TRUE(exact);
+  EXPECT_EQ(t.count_range(500, 2500), 999);
+
+  /* Merged order, empty shards are skipped. */
+  std::vector<int> more = {-3, 3999, 3001};
+  t.insert(more.begin(), more.end());
+
+  std::vector<int> keys(t.begin(), t.end());
+  EXPECT_EQ(keys.size(), 2002);
+  EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+  EXPECT_EQ(keys.front(), -3);
+  EXPECT_EQ(*t.rbegin(), 3999);
+  EXPECT_EQ(std::distance(t.rbegin(), t.rend()), 2002);
+
+  t.clear();
+  t.insert(2500);
+  EXPECT_EQ(*t.begin(), 2500);
+  EXPECT_EQ(*std::prev(t.end()), 2500);
+  EXPECT_EQ(t.lower_bound(0), 2500);
+  EXPECT_EQ(t.lower_bound(2501), std::nullopt);
+}
+
+TEST(UNIT_TESTING, FROZEN) {
+
+  EXPECT_TRUE(freeze(rbtree<int>{}).empty());
+  EXPECT_EQ(freeze(rbtree<int>{}).lower_bound(0), frozen_rbtree<int>().end());
+
+  /* Sizes with full and incomplete last levels. */
+  for (int n : {1, 2, 3, 4, 7, 8, 100, 1023, 1025}) {
+
+    std::vector<int> keys(static_cast<std::size_t>(n));
+    for (int i = 0; i < n; ++i) {
+      keys[static_cast<std::size_t>(i)] = 2 * i;
+    }
+
+    rbtree<int> t(keys.begin(), keys.end());
+    auto frozen = freeze(t);
+
+    EXPECT_EQ(frozen.size(), keys.size());
+    EXPECT_TRUE(std::equal(frozen.begin(), frozen.end(), keys.begin(), keys.end()));
+    EXPECT_TRUE(std::equal(frozen.rbegin(), frozen.rend(), keys.rbegin(), keys.rend()));
+
+    for (int key = -1; key <= 2 * n; ++key) {
+
+      auto it = frozen.lower_bound(key);
+      std::size_t expected = t.less_than(key);
+
+      EXPECT_EQ(frozen.rank(it), expected);
+      EXPECT_EQ(frozen.less_than(key), expected);
+      EXPECT_EQ((it == frozen.end())? -1 : *it, (expected == keys.size())? -1 : keys[expected]);
+
+      EXPECT_EQ(frozen.contains(key), t.contains(key));
+      EXPECT_EQ(frozen.rank(frozen.upper_bound(key)), t.less_than(key + 1));
+    }
+
+    EXPECT_EQ(frozen.distance(0, 2 * n), n);
+  }
+
+  rbtree<std::string> strs = {"b", "a", "d", "c"};
+  auto frozen_strs = freeze(strs);
+  EXPECT_EQ(*frozen_strs.find("c"), "c");
+  EXPECT_EQ(frozen_strs.find("e"), frozen_strs.end());
+  EXPECT_EQ(frozen_strs.count_range("a", "c"), 2);
+}
+
+TEST(UNIT_TESTING, COMPACT) {
+
+  /* Nodes are scattered by erasing and inserting elements. */
+  pool_rbtree<int> t;
+  for (int i = 0; i < 3000; ++i) {
+    t.insert(i);
+  }
+  for (int i = 0; i < 3000; i += 2) {
+    t.erase(i);
+  }
+  for (int i = 0; i < 3000; i += 2) {
+    t.insert(-i);
+  }
+
+  std::vector<int> keys(t.begin(), t.end());
+
+  /* Neighbours in the order are neighbours in memory. */
+  t.compact();
+  EXPECT_TRUE(std::equal(t.begin(), t.end(), keys.begin(), keys.end()));
+  EXPECT_TRUE(std::equal(t.rbegin(), t.rend(), keys.rbegin(), keys.rend()));
+
+  auto addr = [](auto it) { return reinterpret_cast<std::uintptr_t>(&*it); };
+  auto stride = addr(std::next(t.begin())) - addr(t.begin());
+
+  for (auto it = t.begin(), next = std::next(it); next != t.end(); ++it, ++next) {
+    EXPECT_EQ(addr(next) - addr(it), stride);
+  }
+
+  t.compact(node_layout::VAN_EMDE_BOAS);
+  EXPECT_TRUE(std::equal(t.begin(), t.end(), keys.begin(), keys.end()));
+  EXPECT_TRUE(std::equal(t.rbegin(), t.rend(), keys.rbegin(), keys.rend()));
+  EXPECT_EQ(*t.find(-2), -2);
+  EXPECT_EQ(t.rank(t.find(1)), t.less_than(1));
+
+  /* Incremental pass, tree is modified between the steps. */
+  rbtree<std::string> strs;
+  for (int i = 0; i < 100; ++i) {
+    strs.insert(std::to_string(i));
+  }
+
+  std::size_t pos = 0;
+  for (int step = 0; pos != strs.size(); ++step) {
+
+    pos = strs.compact_step(pos, 7);
+    EXPECT_EQ(strs.rank(strs.find("5")), strs.less_than("5"));
+
+    if (step % 3 == 0) {
+      strs.insert("x" + std::to_string(step));
+    }
+  }
+
+  EXPECT_EQ(strs.size(), 105);
+  EXPECT_EQ(*strs.begin(), "0");
+  EXPECT_EQ(*strs.rbegin(), "x9");
+  EXPECT_EQ(strs.compact_step(strs.size(), 7), strs.size());
+
+  rbtree<int> empty;
+  empty.compact();
+  EXPECT_TRUE(empty.empty());
+}
+
+TEST(UNIT_TESTING, BATCHED_LOOKUP) {
+
+  tree t;
+  for (int i = 0; i < 1000; ++i) {
+    t.insert(3 * i);
+  }
+
+  /* Number of keys is not a multiple of the batch width. */
+  std::vector<int> keys;
+  for (int key = -5; key < 3005; key += 2) {
+    keys.push_back(key);
+  }
+
+  std::vector<tree::const_iterator> bounds(keys.size()), found(keys.size());
+  std::vector<std::size_t> less(keys.size());
+  std::unique_ptr<bool[]> contained(new bool[keys.size()]);
+
+  t.lower_bound_many(keys, bounds);
+  t.find_many(keys, found);
+  t.less_than_many(keys, less);
+  t.contains_many(keys, {contained.get(), keys.size()});
+
+  for (std::size_t idx = 0; idx != keys.size(); ++idx) {
+
+    EXPECT_EQ(bounds[idx], t.lower_bound(keys[idx]));
+    EXPECT_EQ(found[idx], t.find(keys[idx]));
+    EXPECT_EQ(less[idx], t.less_than(keys[idx]));
+    EXPECT_EQ(contained[idx], t.contains(keys[idx]));
+  }
+
+  std::vector<int> lo = {0, 10, -5, 3000};
+  std::vector<int> hi = {30, 5, 4000, 3000};
+  std::vector<std::ptrdiff_t> dist(lo.size());
+
+  t.distance_many(lo, hi, dist);
+  for (std::size_t idx = 0; idx != lo.size(); ++idx) {
+    EXPECT_EQ(dist[idx], t.distance(lo[idx], hi[idx]));
+  }
+
+  tree empty;
+  empty.find_many(keys, found);
+  EXPECT_EQ(found.front(), empty.end());
+  empty.less_than_many(keys, less);
+  EXPECT_EQ(less.back(), 0);
+}
+
+TEST(UNIT_TESTING, INSERT_SORTED) {
+
+  tree t;
+  for (int i = 0; i < 1000; i += 3) {
+    t.insert(i);
+  }
+
+  /* Runs fall between present elements, before and after all of them, some are present. */
+  std::vector<int> run;
+  for (int i = -50; i < 1100; i += 2) {
+    run.push_back(i);
+  }
+
+  std::set<int> expected(t.begin(), t.end());
+  std::size_t added = 0;
+  for (int key : run) {
+    added += expected.insert(key).second;
+  }
+
+  EXPECT_EQ(t.insert_sorted(run.begin(), run.end()), added);
+  EXPECT_TRUE(std::equal(t.begin(), t.end(), expected.begin(), expected.end()));
+  EXPECT_TRUE(std::equal(t.rbegin(), t.rend(), expected.rbegin(), expected.rend()));
+  EXPECT_EQ(t.rank(t.find(100)), t.less_than(100));
+
+  /* Same run again adds nothing. */
+  EXPECT_EQ(t.insert_sorted(run.begin(), run.end()), 0);
+  EXPECT_EQ(t.size(), expected.size());
+
+  /* Unsorted range and range with duplicates. */
+  std::vector<int> unsorted = {5000, 4000, 4000, -1000};
+  EXPECT_EQ(t.insert_sorted(unsorted.begin(), unsorted.end()), 3);
+  EXPECT_EQ(*t.begin(), -1000);
+  EXPECT_EQ(*t.rbegin(), 5000);
+
+  pool_rbtree<std::string> strs = {"b", "d"};
+  std::vector<std::string> str_run = {"a", "c", "d", "e"};
+  EXPECT_EQ(strs.insert_sorted(str_run.begin(), str_run.end()), 3);
+  EXPECT_EQ(strs, std::initializer_list<std::string>({"a", "b", "c", "d", "e"}));
+
+  /* Runs between the same neighbours are linked as one subtree. */
+  tree sparse = {0, 1000000};
+  std::vector<int> dense(500);
+  std::iota(dense.begin(), dense.end(), 1);
+
+  EXPECT_EQ(sparse.insert_sorted(dense.begin(), dense.end()), dense.size());
+  std::iota(dense.begin(), dense.end(), 2000);
+  EXPECT_EQ(sparse.insert_sorted(dense.begin(), dense.end()), dense.size());
+  EXPECT_EQ(sparse.size(), 1002);
+  EXPECT_EQ(sparse.less_than(2000), 501);
+  EXPECT_EQ(*std::next(sparse.begin(), 501), 2000);
+  EXPECT_EQ(*std::prev(sparse.end(), 2), 2499);
+
+  /* Forward range, interleaved with the tree and partly present in it. */
+  std::forward_list<int> odd;
+  for (int i = 2499; i > 0; i -= 2) {
+    odd.push_front(i);
+  }
+
+  EXPECT_EQ(sparse.insert_sorted(odd.begin(), odd.end()), 750);
+  EXPECT_EQ(sparse.size(), 1752);
+  EXPECT_EQ(sparse.rank(sparse.find(1501)), 1001);
+
+  tree empty;
+  EXPECT_EQ(empty.insert_sorted(run.begin(), run.end()), run.size());
+  EXPECT_EQ(empty.insert_sorted(run.end(), run.end()), 0);
+}
+
+TEST(UNIT_TESTING, RANGE_VISIT) {
+
+  tree t;
+  for (int i = 0; i < 1000; i += 2) {
+    t.insert(i);
+  }
+
+  for (auto [lo, hi] : {std::pair{10, 20}, {11, 21}, {-5, 5}, {990, 2000}, {-5, 2000}, {20, 10}, {3, 4}}) {
+
+    std::vector<int> expected;
+    if (lo < hi) {
+      expected.assign(t.lower_bound(lo), t.lower_bound(hi));
+    }
+
+    std::vector<int> visited;
+    t.for_each_in_range(lo, hi, [&](int key) { visited.push_back(key); });
+    EXPECT_EQ(visited, expected);
+
+    std::vector<int> copied;
+    t.copy_range(lo, hi, std::back_inserter(copied));
+    EXPECT_EQ(copied, expected);
+
+    auto exported = t.copy_range(lo, hi);
+    EXPECT_EQ(exported, expected);
+    EXPECT_EQ(exported.capacity(), expected.size());
+  }
+
+  rbtree<std::string> strs = {"a", "b", "c", "d"};
+  std::string buf[2];
+  EXPECT_EQ(strs.copy_range("b", "d", buf), buf + 2);
+  EXPECT_EQ(buf[0], "b");
+  EXPECT_EQ(buf[1], "c");
+
+  EXPECT_TRUE(tree{}.copy_range(0, 10).empty());
 }
 
 int main(int argc, char** argv) {
 
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
-}
\ No newline at end of file
+}